@@ -4659,6 +4659,7 @@ VImage replicate( int across, int down, VOption *options = 0 ) const;
  *   - **vscale** -- Vertical scale image by this factor, double.
  *   - **idx** -- Horizontal input displacement, double.
  *   - **idy** -- Vertical input displacement, double.
+ *   - **gap** -- Reducing gap, double.
  *
  * @param scale Scale image by this factor.
  * @param options Set of options.
@@ -5057,6 +5058,7 @@ static VImage text( const char *text, VOption *options = 0 );
  *   - **export_profile** -- Fallback export profile, const char *.
  *   - **intent** -- Rendering intent, VipsIntent.
  *   - **auto_rotate** -- Use orientation tags to rotate image upright, bool.
+ *   - **fast** -- Use a box filter for very small outputs, bool.
  *
  * @param filename Filename to read from.
  * @param width Size to this width.
@@ -5079,6 +5081,7 @@ static VImage thumbnail( const char *filename, int width, VOption *options = 0 )
  *   - **export_profile** -- Fallback export profile, const char *.
  *   - **intent** -- Rendering intent, VipsIntent.
  *   - **auto_rotate** -- Use orientation tags to rotate image upright, bool.
+ *   - **fast** -- Use a box filter for very small outputs, bool.
  *
  * @param buffer Buffer to load from.
  * @param width Size to this width.
@@ -5100,6 +5103,7 @@ static VImage thumbnail_buffer( VipsBlob *buffer, int width, VOption *options =
  *   - **export_profile** -- Fallback export profile, const char *.
  *   - **intent** -- Rendering intent, VipsIntent.
  *   - **auto_rotate** -- Use orientation tags to rotate image upright, bool.
+ *   - **fast** -- Use a box filter for very small outputs, bool.
  *
  * @param width Size to this width.
  * @param options Set of options.
@@ -5121,6 +5125,7 @@ VImage thumbnail_image( int width, VOption *options = 0 ) const;
  *   - **export_profile** -- Fallback export profile, const char *.
  *   - **intent** -- Rendering intent, VipsIntent.
  *   - **auto_rotate** -- Use orientation tags to rotate image upright, bool.
+ *   - **fast** -- Use a box filter for very small outputs, bool.
  *
  * @param source Source to load from.
  * @param width Size to this width.
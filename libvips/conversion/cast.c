@@ -56,6 +56,9 @@
  * 	- remove old overflow/underflow detect
  * 8/12/20
  * 	- fix range clip in int32 -> unsigned casts [ewelot]
+ * 18/10/26
+ * 	- clip float to 8 and 16-bit ints in the input type so the loop can
+ * 	  vectorise
  */
 
 /*
@@ -214,17 +217,27 @@ G_DEFINE_TYPE( VipsCast, vips_cast, VIPS_TYPE_CONVERSION );
 	} \
 } 
 
-/* Cast float types to an int type.
- *
- * We need to do the range clip as double or we'll get errors for int max,
- * since that can't be represented as a 32-bit float.
+/* Cast down from a float or double. 8 and 16-bit ranges are exact in float,
+ * so we can clip in the input type. int max can't be represented as a 32-bit
+ * float, so 32-bit outputs clip as double against double constants.
+ */
+#define FCAST_UCHAR( X ) VIPS_CLIP( 0, (X), UCHAR_MAX )
+#define FCAST_CHAR( X ) VIPS_CLIP( SCHAR_MIN, (X), SCHAR_MAX )
+#define FCAST_USHORT( X ) VIPS_CLIP( 0, (X), USHRT_MAX )
+#define FCAST_SHORT( X ) VIPS_CLIP( SHRT_MIN, (X), SHRT_MAX )
+#define FCAST_UINT( X ) VIPS_CLIP( 0.0, (double) (X), 4294967295.0 )
+#define FCAST_INT( X ) \
+	VIPS_CLIP( -2147483648.0, (double) (X), 2147483647.0 )
+
+/* Cast float types to an int type. We're passed the CAST_ macro for the 
+ * int path and paste it to get the matching FCAST_ clip.
  */
 #define CAST_FLOAT_INT( ITYPE, OTYPE, TEMP, CAST ) { \
 	ITYPE * restrict p = (ITYPE *) in; \
 	OTYPE * restrict q = (OTYPE *) out; \
 	\
 	for( x = 0; x < sz; x++ ) \
-		q[x] = CAST( (double) p[x] ); \
+		q[x] = F ## CAST( p[x] ); \
 }
 
 /* Cast complex types to an int type. Just take the real part.
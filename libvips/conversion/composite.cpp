@@ -15,6 +15,10 @@
  *	- do our own subimage positioning
  * 8/5/19
  * 	- revise in/out/dest-in/dest-out to make smoother alpha
+ * 18/10/26
+ * 	- skip transparent layers, and layers under an opaque "over" layer,
+ * 	  for each tile
+ * 	- add an integer path for premultiplied uchar RGBA "over"
  */
 
 /*
@@ -130,6 +134,11 @@ typedef struct _VipsCompositeBase {
 	 */
 	gboolean skippable;
 
+	/* TRUE if this is premultiplied uchar RGBA and all modes are "over". 
+	 * We have a fast integer path for this very common case.
+	 */
+	gboolean over_uchar;
+
 #ifdef HAVE_VECTOR_ARITH
 	/* max_band as a vector, for the RGBA case.
 	 */
@@ -165,6 +174,14 @@ vips_composite_base_dispose( GObject *gobject )
 	G_OBJECT_CLASS( vips_composite_base_parent_class )->dispose( gobject );
 }
 
+/* How the alpha of a layer looks over a tile. 
+ */
+typedef enum {
+	VIPS_COMPOSITE_ALPHA_MIXED,
+	VIPS_COMPOSITE_ALPHA_TRANSPARENT,
+	VIPS_COMPOSITE_ALPHA_OPAQUE
+} VipsCompositeAlpha;
+
 /* Our sequence value.
  */
 typedef struct {
@@ -194,6 +211,10 @@ typedef struct {
 	 */
 	VipsPel **p;
 
+	/* For each enabled image, how its alpha looks over this tile.
+	 */
+	VipsCompositeAlpha *alpha;
+
 } VipsCompositeSequence;
 
 static int
@@ -215,6 +236,7 @@ vips_composite_stop( void *vseq, void *a, void *b )
 
 	VIPS_FREE( seq->enabled );
 	VIPS_FREE( seq->p );
+	VIPS_FREE( seq->alpha );
 
 	VIPS_FREE( seq );
 
@@ -237,6 +259,7 @@ vips_composite_start( VipsImage *out, void *a, void *b )
 	seq->input_regions = NULL;
 	seq->enabled = NULL;
 	seq->p = NULL;
+	seq->alpha = NULL;
 
 	/* How many images?
 	 */
@@ -262,8 +285,10 @@ vips_composite_start( VipsImage *out, void *a, void *b )
 
 	seq->enabled = VIPS_ARRAY( NULL, n, int );
 	seq->p = VIPS_ARRAY( NULL, n, VipsPel * );
+	seq->alpha = VIPS_ARRAY( NULL, n, VipsCompositeAlpha );
 	if( !seq->enabled ||
-		!seq->p ) {
+		!seq->p ||
+		!seq->alpha ) {
 		vips_composite_stop( seq, NULL, NULL );
 		return( NULL );
 	}
@@ -377,6 +402,42 @@ vips_composite_base_max_band( VipsCompositeBase *composite, double *max_band )
 	return( 0 );
 }
 
+/* Is a mode "skippable"? 
+ *
+ * Skippable modes are ones where a black (0, 0, 0, 0) layer placed over the
+ * base image and composited has no effect. 
+ *
+ * If all the modes in our stack are skippable, we can avoid compositing the
+ * whole stack for every request.
+ */
+static gboolean
+vips_composite_mode_skippable( VipsBlendMode mode )
+{
+	switch( mode ) {
+	case VIPS_BLEND_MODE_CLEAR:
+	case VIPS_BLEND_MODE_SOURCE:
+	case VIPS_BLEND_MODE_IN:
+	case VIPS_BLEND_MODE_OUT:
+	case VIPS_BLEND_MODE_DEST_IN:
+	case VIPS_BLEND_MODE_DEST_ATOP:
+		return( FALSE );
+
+	default:
+		return( TRUE );
+	}
+}
+
+/* The blend mode for input image @j. Image 0 (the background) has no mode.
+ */
+static VipsBlendMode
+vips_composite_base_mode( VipsCompositeBase *composite, int j )
+{
+	VipsBlendMode *mode = (VipsBlendMode *) composite->mode->area.data;
+	int n_mode = composite->mode->area.n;
+
+	return( n_mode == 1 ? mode[0] : mode[j - 1] );
+}
+
 /* Find the subset of our input images which intersect this region. If we are
  * not in skippable mode, we must enable all layers.
  */
@@ -1022,6 +1083,134 @@ vips_combine_pixels3( VipsCompositeSequence *seq, VipsPel *q )
 }
 #endif /*HAVE_VECTOR_ARITH*/
 
+/* Scan the alpha of a layer over a tile. A layer is only transparent if
+ * every band is zero, since a premultiplied layer with zero alpha can still
+ * add colour.
+ */
+template <typename T>
+static VipsCompositeAlpha
+vips_composite_base_classify_type( VipsCompositeBase *composite, 
+	VipsRegion *region, VipsRect *r )
+{
+	int bands = composite->bands;
+	double max_alpha = composite->max_band[bands];
+	int first = composite->premultiplied ? 0 : bands;
+
+	gboolean transparent;
+	gboolean opaque;
+
+	transparent = TRUE;
+	opaque = TRUE;
+	for( int y = 0; y < r->height; y++ ) {
+		T * restrict p = (T *) 
+			VIPS_REGION_ADDR( region, r->left, r->top + y );
+
+		for( int x = 0; x < r->width; x++ ) {
+			if( p[bands] != max_alpha )
+				opaque = FALSE;
+			for( int b = first; b <= bands; b++ )
+				if( p[b] != 0 )
+					transparent = FALSE;
+
+			if( !transparent &&
+				!opaque )
+				return( VIPS_COMPOSITE_ALPHA_MIXED );
+
+			p += bands + 1;
+		}
+	}
+
+	return( transparent ? 
+		VIPS_COMPOSITE_ALPHA_TRANSPARENT : 
+		VIPS_COMPOSITE_ALPHA_OPAQUE );
+}
+
+static VipsCompositeAlpha
+vips_composite_base_classify( VipsCompositeBase *composite, 
+	VipsRegion *region, VipsRect *r )
+{
+	switch( region->im->BandFmt ) {
+	case VIPS_FORMAT_UCHAR:
+		return( vips_composite_base_classify_type<unsigned char>( 
+			composite, region, r ) );
+
+	case VIPS_FORMAT_CHAR:
+		return( vips_composite_base_classify_type<signed char>( 
+			composite, region, r ) );
+
+	case VIPS_FORMAT_USHORT:
+		return( vips_composite_base_classify_type<unsigned short>( 
+			composite, region, r ) );
+
+	case VIPS_FORMAT_SHORT:
+		return( vips_composite_base_classify_type<signed short>( 
+			composite, region, r ) );
+
+	case VIPS_FORMAT_UINT:
+		return( vips_composite_base_classify_type<unsigned int>( 
+			composite, region, r ) );
+
+	case VIPS_FORMAT_INT:
+		return( vips_composite_base_classify_type<signed int>( 
+			composite, region, r ) );
+
+	case VIPS_FORMAT_FLOAT:
+		return( vips_composite_base_classify_type<float>( 
+			composite, region, r ) );
+
+	case VIPS_FORMAT_DOUBLE:
+		return( vips_composite_base_classify_type<double>( 
+			composite, region, r ) );
+
+	default:
+		return( VIPS_COMPOSITE_ALPHA_MIXED );
+	}
+}
+
+/* Process this many pixels at once in the integer "over" path. 
+ */
+#define OVER_UCHAR_CHUNK (256)
+
+/* Integer "over" for premultiplied uchar RGBA. 
+ *
+ * We accumulate in 8.8 fixed point, so rounding errors don't build up as we
+ * go down the stack and we match the float path to within 1. Everything 
+ * works along a line, so the compiler can vectorise the inner loops.
+ */
+static void
+vips_composite_base_over_uchar( VipsCompositeSequence *seq, 
+	VipsPel *q, int width )
+{
+	unsigned int acc[OVER_UCHAR_CHUNK * 4];
+
+	for( int x0 = 0; x0 < width; x0 += OVER_UCHAR_CHUNK ) {
+		int n = VIPS_MIN( OVER_UCHAR_CHUNK, width - x0 ) * 4;
+		VipsPel * restrict p = seq->p[0] + x0 * 4;
+		VipsPel * restrict tq = q + x0 * 4;
+
+		for( int k = 0; k < n; k++ )
+			acc[k] = p[k] << 8;
+
+		for( int i = 1; i < seq->n; i++ ) {
+			p = seq->p[i] + x0 * 4;
+
+			for( int k = 0; k < n; k += 4 ) {
+				unsigned int t = 255 - p[k + 3];
+
+				for( int b = 0; b < 4; b++ ) {
+					unsigned int v = (p[k + b] << 8) + 
+						acc[k + b] * t / 255;
+
+					acc[k + b] = VIPS_MIN( v, 65535 );
+				}
+			}
+		}
+
+		for( int k = 0; k < n; k++ )
+			tq[k] = VIPS_MIN( acc[k] >> 8, 255 );
+	}
+}
+
 static int
 vips_composite_base_gen( VipsRegion *output_region,
 	void *vseq, void *a, void *b, gboolean *stop )
@@ -1031,6 +1220,9 @@ vips_composite_base_gen( VipsRegion *output_region,
 	VipsRect *r = &output_region->valid;
 	int ps = VIPS_IMAGE_SIZEOF_PEL( output_region->im );
 
+	int base;
+	int n;
+
 	VIPS_DEBUG_MSG( "vips_composite_base_gen: at %d x %d, size %d x %d\n",
 		r->left, r->top, r->width, r->height );
 
@@ -1058,9 +1250,12 @@ vips_composite_base_gen( VipsRegion *output_region,
 	}
 
 	/* Prepare the appropriate parts into our set of composite
-	 * regions.
+	 * regions. We work down from the top of the stack: once we find a
+	 * layer which is solid over this tile and which uses "over", nothing 
+	 * below it can show through, so we need not compute those layers.
 	 */
-	for( int i = 0; i < seq->n; i++ ) {
+	base = 0;
+	for( int i = seq->n - 1; i >= 0; i-- ) {
 		int j = seq->enabled[i];
 
 		VipsRect hit;
@@ -1103,10 +1298,76 @@ vips_composite_base_gen( VipsRegion *output_region,
 				hit.left, hit.top ) )
 				return( -1 );
 		}
+
+		seq->alpha[i] = vips_composite_base_classify( composite,
+			seq->composite_regions[j], r );
+
+		if( i > 0 &&
+			seq->alpha[i] == VIPS_COMPOSITE_ALPHA_OPAQUE &&
+			vips_composite_base_mode( composite, j ) == 
+				VIPS_BLEND_MODE_OVER ) {
+			base = i;
+			break;
+		}
+	}
+
+	/* Drop layers hidden under the new base, and transparent layers 
+	 * which can have no effect.
+	 */
+	n = 0;
+	for( int i = base; i < seq->n; i++ ) {
+		int j = seq->enabled[i];
+
+		if( i > base &&
+			seq->alpha[i] == VIPS_COMPOSITE_ALPHA_TRANSPARENT &&
+			vips_composite_mode_skippable( 
+				vips_composite_base_mode( composite, j ) ) )
+			continue;
+
+		seq->enabled[n] = j;
+		seq->alpha[n] = seq->alpha[i];
+		n += 1;
+	}
+	seq->n = n;
+
+	VIPS_DEBUG_MSG( "  compositing %d images\n", seq->n );
+
+	/* Just one layer left, and it will come through the blend unaltered? 
+	 * We can copy it. Unpremultiply zaps colour where alpha is zero, so 
+	 * we need a solid layer for that case.
+	 */
+	if( seq->n == 1 &&
+		(composite->premultiplied ||
+		 seq->alpha[0] == VIPS_COMPOSITE_ALPHA_OPAQUE) ) {
+		vips_region_copy( seq->composite_regions[seq->enabled[0]], 
+			output_region, r, r->left, r->top );
+
+		return( 0 );
 	}
 
 	VIPS_GATE_START( "vips_composite_base_gen: work" );
 
+	if( composite->over_uchar ) {
+		for( int y = 0; y < r->height; y++ ) {
+			for( int i = 0; i < seq->n; i++ ) {
+				int j = seq->enabled[i];
+
+				seq->p[i] = VIPS_REGION_ADDR( 
+					seq->composite_regions[j],
+					r->left, r->top + y );
+			}
+
+			vips_composite_base_over_uchar( seq, 
+				VIPS_REGION_ADDR( output_region, 
+					r->left, r->top + y ), 
+				r->width );
+		}
+
+		VIPS_GATE_STOP( "vips_composite_base_gen: work" );
+
+		return( 0 );
+	}
+
 	for( int y = 0; y < r->height; y++ ) {
 		VipsPel *q;
 
@@ -1205,31 +1466,6 @@ vips_composite_base_gen( VipsRegion *output_region,
 	return( 0 );
 }
 
-/* Is a mode "skippable"? 
- *
- * Skippable modes are ones where a black (0, 0, 0, 0) layer placed over the
- * base image and composited has no effect. 
- *
- * If all the modes in our stack are skippable, we can avoid compositing the
- * whole stack for every request.
- */
-static gboolean
-vips_composite_mode_skippable( VipsBlendMode mode )
-{
-	switch( mode ) {
-	case VIPS_BLEND_MODE_CLEAR:
-	case VIPS_BLEND_MODE_SOURCE:
-	case VIPS_BLEND_MODE_IN:
-	case VIPS_BLEND_MODE_OUT:
-	case VIPS_BLEND_MODE_DEST_IN:
-	case VIPS_BLEND_MODE_DEST_ATOP:
-		return( FALSE );
-
-	default:
-		return( TRUE );
-	}
-}
-
 static int
 vips_composite_base_build( VipsObject *object )
 {
@@ -1402,6 +1638,18 @@ vips_composite_base_build( VipsObject *object )
 		return( -1 );
 	in = format;
 
+	/* Can we use the integer "over" path?
+	 */
+	composite->over_uchar = composite->premultiplied &&
+		in[0]->BandFmt == VIPS_FORMAT_UCHAR &&
+		composite->bands == 3;
+	for( int b = 0; b <= composite->bands; b++ )
+		if( composite->max_band[b] != 255 )
+			composite->over_uchar = FALSE;
+	for( int i = 0; i < composite->mode->area.n; i++ )
+		if( mode[i] != VIPS_BLEND_MODE_OVER )
+			composite->over_uchar = FALSE;
+
 	/* We want locality, so that we only prepare a few subimages each
 	 * time.
 	 */
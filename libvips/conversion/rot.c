@@ -28,6 +28,8 @@
  * 	- rewrite as a class
  * 7/3/17
  * 	- added 90/180/270 convenience functions
+ * 18/10/26
+ * 	- 90 and 270 transpose in cache-sized blocks
  */
 
 /*
@@ -93,6 +95,119 @@ typedef VipsConversionClass VipsRotClass;
 
 G_DEFINE_TYPE( VipsRot, vips_rot, VIPS_TYPE_CONVERSION );
 
+/* 90 and 270 transpose in blocks of this many pixels a side, so the input
+ * lines we step down stay in cache while we write each block.
+ */
+#define VIPS_ROT_BLOCK (32)
+
+/* Copy a block of pixels. Output pixel (x, y) comes from p + x * dx + y * dy.
+ */
+#define VIPS_ROT_TRANSPOSE( TYPE ) { \
+	for( y = 0; y < height; y++ ) { \
+		TYPE * restrict tq = (TYPE *) (q + y * qls); \
+		VipsPel * restrict tp = p + y * dy; \
+		\
+		for( x = 0; x < width; x++ ) { \
+			tq[x] = *((TYPE *) tp); \
+			tp += dx; \
+		} \
+	} \
+}
+
+static void
+vips_rot_transpose_block( VipsPel *q, int qls, VipsPel *p, int dx, int dy, 
+	int width, int height, int ps )
+{
+	int x, y, i;
+
+	switch( ps ) {
+	case 1:
+		VIPS_ROT_TRANSPOSE( guint8 );
+		break;
+
+	case 2:
+		VIPS_ROT_TRANSPOSE( guint16 );
+		break;
+
+	case 4:
+		VIPS_ROT_TRANSPOSE( guint32 );
+		break;
+
+	case 8:
+		VIPS_ROT_TRANSPOSE( guint64 );
+		break;
+
+	case 3:
+		for( y = 0; y < height; y++ ) {
+			VipsPel * restrict tq = q + y * qls;
+			VipsPel * restrict tp = p + y * dy;
+
+			for( x = 0; x < width; x++ ) {
+				tq[0] = tp[0];
+				tq[1] = tp[1];
+				tq[2] = tp[2];
+
+				tq += 3;
+				tp += dx;
+			}
+		}
+		break;
+
+	default:
+		for( y = 0; y < height; y++ ) {
+			VipsPel * restrict tq = q + y * qls;
+			VipsPel * restrict tp = p + y * dy;
+
+			for( x = 0; x < width; x++ ) {
+				for( i = 0; i < ps; i++ )
+					tq[i] = tp[i];
+
+				tq += ps;
+				tp += dx;
+			}
+		}
+		break;
+	}
+}
+
+/* Fill a width x height area at @q, line stride @qls, in blocks. Output 
+ * pixel (x, y) comes from p + x * dx + y * dy. 
+ *
+ * jpegload uses this too when it decodes straight to a rotated image.
+ */
+void
+vips__rot_transpose( VipsPel *q, int qls, VipsPel *p, int dx, int dy, 
+	int width, int height, int ps )
+{
+	int bx, by;
+
+	for( by = 0; by < height; by += VIPS_ROT_BLOCK ) 
+		for( bx = 0; bx < width; bx += VIPS_ROT_BLOCK ) 
+			vips_rot_transpose_block( 
+				q + by * qls + bx * ps,
+				qls,
+				p + bx * dx + by * dy,
+				dx, dy,
+				VIPS_MIN( VIPS_ROT_BLOCK, width - bx ),
+				VIPS_MIN( VIPS_ROT_BLOCK, height - by ),
+				ps );
+}
+
+/* Fill @or from @p. Output pixel (x, y) of @or comes from 
+ * p + x * dx + y * dy. 
+ */
+static void
+vips_rot_transpose( VipsRegion *or, VipsPel *p, int dx, int dy )
+{
+	VipsRect *r = &or->valid;
+
+	vips__rot_transpose( VIPS_REGION_ADDR( or, r->left, r->top ),
+		VIPS_REGION_LSKIP( or ), 
+		p, dx, dy, 
+		r->width, r->height, 
+		VIPS_IMAGE_SIZEOF_PEL( or->im ) );
+}
+
 static int
 vips_rot90_gen( VipsRegion *or, void *seq, void *a, void *b,
 	gboolean *stop )
@@ -103,12 +218,8 @@ vips_rot90_gen( VipsRegion *or, void *seq, void *a, void *b,
 	/* Output area.
 	 */
 	VipsRect *r = &or->valid;
-	int le = r->left;
 	int ri = VIPS_RECT_RIGHT(r);
 	int to = r->top;
-	int bo = VIPS_RECT_BOTTOM(r);
-
-	int x, y, i;
 
 	/* Pixel geometry.
 	 */
@@ -130,27 +241,13 @@ vips_rot90_gen( VipsRegion *or, void *seq, void *a, void *b,
 	ps = VIPS_IMAGE_SIZEOF_PEL( in );
 	ls = VIPS_REGION_LSKIP( ir );
 
-	/* Rotate the bit we now have.
+	/* Rotate the bit we now have. Output lines run up the input columns,
+	 * starting from the bottom left.
 	 */
-	for( y = to; y < bo; y++ ) {
-		/* Start of this output line.
-		 */
-		VipsPel *q = VIPS_REGION_ADDR( or, le, y );
-
-		/* Corresponding position in ir.
-		 */
-		VipsPel *p = VIPS_REGION_ADDR( ir, 
-			need.left + y - to, 
-			need.top + need.height - 1 );
-
-		for( x = le; x < ri; x++ ) {
-			for( i = 0; i < ps; i++ )
-				q[i] = p[i];
-
-			q += ps;
-			p -= ls;
-		}
-	}
+	vips_rot_transpose( or, 
+		VIPS_REGION_ADDR( ir, 
+			need.left, need.top + need.height - 1 ),
+		-ls, ps );
 
 	return( 0 );
 }
@@ -227,12 +324,8 @@ vips_rot270_gen( VipsRegion *or, void *seq, void *a, void *b,
 	 */
 	VipsRect *r = &or->valid;
 	int le = r->left;
-	int ri = VIPS_RECT_RIGHT(r);
-	int to = r->top;
 	int bo = VIPS_RECT_BOTTOM(r);
 
-	int x, y, i;
-
 	/* Pixel geometry.
 	 */
 	int ps, ls;
@@ -253,27 +346,12 @@ vips_rot270_gen( VipsRegion *or, void *seq, void *a, void *b,
 	ps = VIPS_IMAGE_SIZEOF_PEL( in );
 	ls = VIPS_REGION_LSKIP( ir );
 
-	/* Rotate the bit we now have.
+	/* Rotate the bit we now have. Output lines run down the input 
+	 * columns, starting from the top right.
 	 */
-	for( y = to; y < bo; y++ ) {
-		/* Start of this output line.
-		 */
-		VipsPel *q = VIPS_REGION_ADDR( or, le, y );
-
-		/* Corresponding position in ir.
-		 */
-		VipsPel *p = VIPS_REGION_ADDR( ir, 
-			need.left + need.width - (y - to) - 1,
-			need.top );
-
-		for( x = le; x < ri; x++ ) {
-			for( i = 0; i < ps; i++ )
-				q[i] = p[i];
-
-			q += ps;
-			p += ls;
-		}
-	}
+	vips_rot_transpose( or, 
+		VIPS_REGION_ADDR( ir, need.left + need.width - 1, need.top ),
+		ls, -ps );
 
 	return( 0 );
 }
@@ -23,6 +23,9 @@
  * 	- re-enable skipahead now we have the single-thread-first-tile idea
  * 6/3/17
  * 	- deprecate @trace, @access now seq is much simpler
+ * 18/10/26
+ * 	- add @lookahead, @lookahead_bytes: decode ahead of requests in a
+ * 	  background thread
  */
 
 /*
@@ -93,6 +96,29 @@ typedef struct _VipsSequential {
 	 * can stall and never wake.
 	 */
 	int error;
+
+	/* Decode up to this many strips ahead of requests in a background
+	 * thread, using no more than lookahead_bytes. 
+	 */
+	int lookahead;
+	guint64 lookahead_bytes;
+
+	/* The number of lines we decode ahead, or 0 for no lookahead.
+	 */
+	int lookahead_lines;
+
+	/* The cache we decode into, the decode thread, and a cond to signal
+	 * changes to y_pos and ahead_y. In lookahead mode, y_pos is the 
+	 * bottom of the furthest request.
+	 */
+	VipsImage *ahead_in;
+	GThread *ahead_thread;
+	GCond *ahead_cond;
+	gboolean ahead_stop;
+
+	/* All lines above this are in cache.
+	 */
+	int ahead_y;
 } VipsSequential;
 
 typedef VipsConversionClass VipsSequentialClass;
@@ -104,11 +130,137 @@ vips_sequential_dispose( GObject *gobject )
 {
 	VipsSequential *sequential = (VipsSequential *) gobject;
 
+	if( sequential->ahead_thread ) {
+		g_mutex_lock( sequential->lock );
+		sequential->ahead_stop = TRUE;
+		g_cond_broadcast( sequential->ahead_cond );
+		g_mutex_unlock( sequential->lock );
+
+		(void) vips_g_thread_join( sequential->ahead_thread );
+		sequential->ahead_thread = NULL;
+	}
+
 	VIPS_FREEF( vips_g_mutex_free, sequential->lock );
+	VIPS_FREEF( vips_g_cond_free, sequential->ahead_cond );
 
 	G_OBJECT_CLASS( vips_sequential_parent_class )->dispose( gobject );
 }
 
+/* The decode thread: keep the cache filled to lookahead_lines below the
+ * furthest request. It is the only thing which reads from our source. 
+ */
+static void *
+vips_sequential_ahead( void *data )
+{
+	VipsSequential *sequential = (VipsSequential *) data;
+	VipsImage *in = sequential->ahead_in;
+
+	VipsRegion *region;
+
+	region = vips_region_new( in );
+
+	g_mutex_lock( sequential->lock );
+
+	if( !region ) 
+		sequential->error = -1;
+
+	for(;;) {
+		VipsRect area;
+		int result;
+
+		while( !sequential->ahead_stop &&
+			!sequential->error &&
+			sequential->ahead_y < in->Ysize &&
+			sequential->ahead_y >= 
+				sequential->y_pos + sequential->lookahead_lines )
+			g_cond_wait( sequential->ahead_cond, sequential->lock );
+
+		if( sequential->ahead_stop ||
+			sequential->error ||
+			sequential->ahead_y >= in->Ysize )
+			break;
+
+		area.left = 0;
+		area.top = sequential->ahead_y;
+		area.width = 1;
+		area.height = VIPS_MIN( sequential->tile_height, 
+			in->Ysize - sequential->ahead_y );
+
+		g_mutex_unlock( sequential->lock );
+
+		result = vips_region_prepare( region, &area );
+
+		g_mutex_lock( sequential->lock );
+
+		if( result )
+			sequential->error = -1;
+		else
+			sequential->ahead_y = VIPS_RECT_BOTTOM( &area );
+
+		g_cond_broadcast( sequential->ahead_cond );
+	}
+
+	/* Wake anyone still waiting for pixels: they'll see the error.
+	 */
+	if( !sequential->ahead_stop &&
+		sequential->ahead_y < in->Ysize ) 
+		sequential->error = -1;
+	g_cond_broadcast( sequential->ahead_cond );
+
+	g_mutex_unlock( sequential->lock );
+
+	VIPS_UNREF( region );
+
+	return( NULL );
+}
+
+/* Lookahead mode: wait for the decode thread to get past this request, then
+ * fetch from cache without holding our lock.
+ */
+static int
+vips_sequential_generate_ahead( VipsRegion *or, VipsRegion *ir,
+	VipsSequential *sequential )
+{
+        VipsRect *r = &or->valid;
+	int bottom = VIPS_RECT_BOTTOM( r );
+
+	VIPS_GATE_START( "vips_sequential_generate_ahead: wait" );
+
+	g_mutex_lock( sequential->lock );
+
+	/* Start the decode thread on the first request.
+	 */
+	if( !sequential->ahead_thread &&
+		!sequential->error &&
+		!(sequential->ahead_thread = vips_g_thread_new( "sequential", 
+			vips_sequential_ahead, sequential )) ) 
+		sequential->error = -1;
+
+	if( bottom > sequential->y_pos ) {
+		sequential->y_pos = bottom;
+		g_cond_broadcast( sequential->ahead_cond );
+	}
+
+	while( !sequential->error &&
+		sequential->ahead_y < bottom )
+		g_cond_wait( sequential->ahead_cond, sequential->lock );
+
+	VIPS_GATE_STOP( "vips_sequential_generate_ahead: wait" );
+
+	if( sequential->error ) {
+		g_mutex_unlock( sequential->lock );
+		return( -1 );
+	}
+
+	g_mutex_unlock( sequential->lock );
+
+	if( vips_region_prepare( ir, r ) ||
+		vips_region_region( or, ir, r, r->left, r->top ) ) 
+		return( -1 );
+
+	return( 0 );
+}
+
 static int
 vips_sequential_generate( VipsRegion *or, 
 	void *seq, void *a, void *b, gboolean *stop )
@@ -117,6 +269,9 @@ vips_sequential_generate( VipsRegion *or,
         VipsRect *r = &or->valid;
 	VipsRegion *ir = (VipsRegion *) seq;
 
+	if( sequential->lookahead_lines > 0 )
+		return( vips_sequential_generate_ahead( or, ir, sequential ) );
+
 	if( sequential->trace )
 		printf( "vips_sequential_generate %p: "
 			"request for line %d, height %d\n", 
@@ -192,7 +347,54 @@ vips_sequential_build( VipsObject *object )
 	if( VIPS_OBJECT_CLASS( vips_sequential_parent_class )->build( object ) )
 		return( -1 );
 
-	if( vips_linecache( sequential->in, &t, 
+	if( sequential->lookahead > 0 ) {
+		size_t line_bytes = 
+			VIPS_IMAGE_SIZEOF_LINE( sequential->in );
+
+		guint64 lines;
+
+		lines = (guint64) sequential->lookahead * 
+			sequential->tile_height;
+		if( sequential->lookahead_bytes > 0 )
+			lines = VIPS_MIN( lines, 
+				sequential->lookahead_bytes / line_bytes );
+		lines = VIPS_MIN( lines, sequential->in->Ysize );
+		sequential->lookahead_lines = 
+			VIPS_MAX( lines, sequential->tile_height );
+	}
+
+	if( sequential->lookahead_lines > 0 ) {
+		int tile_width;
+		int tile_height;
+		int n_lines;
+		int max_tiles;
+
+		/* Size the cache for the usual non-locality from threading
+		 * (see vips_line_cache_build()), plus our lookahead.
+		 */
+		vips_get_tile_size( sequential->in, 
+			&tile_width, &tile_height, &n_lines );
+		max_tiles = VIPS_MAX( 2, 4 * n_lines / sequential->tile_height ) +
+			sequential->lookahead_lines / sequential->tile_height + 
+			1;
+
+		/* A threaded cache, so workers can fetch pixels while the
+		 * decode thread is running. Only the decode thread will 
+		 * ever calculate tiles.
+		 */
+		if( vips_tilecache( sequential->in, &t, 
+			"tile_width", sequential->in->Xsize,
+			"tile_height", sequential->tile_height,
+			"max_tiles", max_tiles,
+			"access", VIPS_ACCESS_SEQUENTIAL,
+			"threaded", TRUE,
+			"persistent", TRUE,
+			NULL ) )
+			return( -1 );
+
+		sequential->ahead_in = t;
+	}
+	else if( vips_linecache( sequential->in, &t, 
 		"tile_height", sequential->tile_height,
 		"access", VIPS_ACCESS_SEQUENTIAL,
 		/* We need seq caches to persist across minimise in case
@@ -259,6 +461,20 @@ vips_sequential_class_init( VipsSequentialClass *class )
 		G_STRUCT_OFFSET( VipsSequential, trace ),
 		TRUE );
 
+	VIPS_ARG_INT( class, "lookahead", 7, 
+		_( "Lookahead" ), 
+		_( "Decode this many strips ahead in a background thread" ),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET( VipsSequential, lookahead ),
+		0, 1000000, 0 );
+
+	VIPS_ARG_UINT64( class, "lookahead_bytes", 8, 
+		_( "Lookahead bytes" ), 
+		_( "Maximum memory for lookahead, 0 for no limit" ),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET( VipsSequential, lookahead_bytes ),
+		0, G_MAXUINT64, 0 );
+
 }
 
 static void
@@ -268,6 +484,14 @@ vips_sequential_init( VipsSequential *sequential )
 	sequential->tile_height = 1;
 	sequential->error = 0;
 	sequential->trace = FALSE;
+	sequential->lookahead = 0;
+	sequential->lookahead_bytes = 0;
+	sequential->lookahead_lines = 0;
+	sequential->ahead_in = NULL;
+	sequential->ahead_thread = NULL;
+	sequential->ahead_cond = vips_g_cond_new();
+	sequential->ahead_stop = FALSE;
+	sequential->ahead_y = 0;
 }
 
 /**
@@ -279,6 +503,8 @@ vips_sequential_init( VipsSequential *sequential )
  * Optional arguments:
  *
  * * @strip_height: height of cache strips
+ * * @lookahead: decode this many strips ahead
+ * * @lookahead_bytes: max memory for lookahead
  *
  * This operation behaves rather like vips_copy() between images
  * @in and @out, except that it checks that pixels on @in are only requested
@@ -288,6 +514,12 @@ vips_sequential_init( VipsSequential *sequential )
  * @strip_height can be used to set the size of the tiles that
  * vips_sequential() uses. The default value is 1.
  *
+ * Normally, threads reading from @in take turns to fetch pixels, so the
+ * pipeline runs at the speed of the decoder. Set @lookahead to have a 
+ * background thread decode up to that many strips ahead of the furthest 
+ * request instead, so that workers mostly find pixels ready in cache. 
+ * @lookahead_bytes limits the memory this can use. 
+ *
  * See also: vips_cache(), vips_linecache(), vips_tilecache().
  *
  * Returns: 0 on success, -1 on error.
@@ -35,6 +35,18 @@
  * 	- terminate on tile calc error
  * 7/3/17
  * 	- remove "access" on linecache, use the base class instead
+ * 18/10/26
+ * 	- paste tiles outside the lock in threaded mode
+ * 	- each tile has its own "done" signal, so we only wake threads which
+ * 	  need that tile
+ * 	- add "max_bytes"
+ * 	- random access caches evict by recompute cost as well as age
+ * 	- count hits, misses and evictions
+ * 	- add "spill_bytes" for a disc tier
+ * 	- spill file IO happens outside the cache lock
+ * 	- spill failures warn, and leave the error buffer alone
+ * 	- attach hit, miss and eviction counts to @out at the end of each
+ * 	  computation
  */
 
 /*
@@ -77,6 +89,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif /*HAVE_UNISTD_H*/
+#ifdef HAVE_IO_H
+#include <io.h>
+#endif /*HAVE_IO_H*/
+
+#include <glib/gstdio.h>
 
 #include <vips/vips.h>
 #include <vips/internal.h>
@@ -84,6 +107,31 @@
 
 #include "pconversion.h"
 
+/* Try to make an O_BINARY ... sometimes need the leading '_'.
+ */
+#ifdef BINARY_OPEN
+#ifndef O_BINARY
+#ifdef _O_BINARY
+#define O_BINARY _O_BINARY
+#endif /*_O_BINARY*/
+#endif /*!O_BINARY*/
+#endif /*BINARY_OPEN*/
+
+/* If we have O_BINARY, add it to a mode flags set.
+ */
+#ifdef O_BINARY
+#define BINARYIZE(M) ((M) | O_BINARY)
+#else /*!O_BINARY*/
+#define BINARYIZE(M) (M)
+#endif /*O_BINARY*/
+
+#define MODE_SPILL BINARYIZE (O_RDWR | O_CREAT | O_TRUNC)
+
+/* When a random access cache is full, we pick the cheapest of this many of
+ * the least-recently-used tiles for reuse.
+ */
+#define VIPS_TILE_CACHE_CANDIDATES (8)
+
 /* A tile in cache can be in one of three states:
  *
  * DATA		- the tile holds valid pixels 
@@ -103,8 +151,16 @@ typedef struct _VipsTile {
 
 	VipsTileState state;
 
+	/* How long this tile took to calculate, in microseconds. 
+	 */
+	gint64 cost;
+
 	VipsRegion *region;		/* Region with private mem for data */
 
+	/* Signalled when a CALC tile becomes DATA. Waits use the cache lock.
+	 */
+	GCond *done;
+
 	/* We count how many threads are relying on this tile. This tile can't
 	 * be flushed if ref_count > 0.
 	 */
@@ -115,6 +171,18 @@ typedef struct _VipsTile {
 	 * pointer is NULL.
 	 */
 	VipsRect pos; 
+
+	/* Set when the tile is moved, if the cache was spilling then. Only
+	 * tiles with this set touch the spill file or the spill lock.
+	 */
+	gboolean spill;
+
+	/* Set when this tile was moved while it held DATA. The region still
+	 * has the pixels for @evicted, and they must go to the spill file 
+	 * before the tile is calculated.
+	 */
+	gboolean spill_evicted;
+	VipsRect evicted;
 } VipsTile;
 
 typedef struct _VipsBlockCache {
@@ -124,14 +192,38 @@ typedef struct _VipsBlockCache {
 	int tile_width;	
 	int tile_height;
 	int max_tiles;
+	guint64 max_bytes;
 
 	VipsAccess access;
 	gboolean threaded;
 	gboolean persistent;
 
 	int ntiles;			/* Current cache size */
+	guint64 hits;			/* Requests we found in cache */
+	guint64 misses;			/* Requests we had to calculate */
+	guint64 evictions;		/* Tiles reused for a new position */
+
+	/* Evicted tiles can be saved to a spill file on disc. The file is a
+	 * ring of tile-sized slots, and the hash maps tile positions to
+	 * slot numbers (plus one, so we can spot NULL). 
+	 *
+	 * The spill state and file IO have their own lock, so threads can
+	 * use the rest of the cache while a tile is being read or written.
+	 * spill_bytes is fixed after build. spill_failed is set if the file 
+	 * stops working, and is only touched under the main cache lock.
+	 */
+	GMutex *spill_lock;
+	guint64 spill_bytes;		/* Max size of spill file */
+	gboolean spill_failed;		/* Spill file IO failed, stop using it */
+	char *spill_filename;
+	int spill_fd;
+	int spill_slots;		/* Number of slots in spill file */
+	int spill_next;			/* Write the next tile here */
+	VipsRect *spill_pos;		/* Position of tile in each slot */
+	GHashTable *spill;		/* Tile position -> slot + 1 */
+	guint64 spill_hits;		/* Misses we found in the spill file */
+	guint64 spill_misses;		/* Misses not in the spill file */
 	GMutex *lock;			/* Lock everything here */
-	GCond *new_tile;		/* A new tile is ready */
 	GHashTable *tiles;		/* Tiles, hashed by coordinates */
 	GQueue *recycle;		/* Queue of unreffed tiles to reuse */
 } VipsBlockCache;
@@ -158,21 +250,235 @@ vips_block_cache_dispose( GObject *gobject )
 {
 	VipsBlockCache *cache = (VipsBlockCache *) gobject;
 
+	if( cache->hits + cache->misses > 0 )
+		g_info( "%s: %" G_GUINT64_FORMAT " hits, "
+			"%" G_GUINT64_FORMAT " misses, "
+			"%" G_GUINT64_FORMAT " evictions, "
+			"%d tiles", 
+			VIPS_OBJECT_GET_CLASS( cache )->nickname,
+			cache->hits, cache->misses, cache->evictions, 
+			cache->ntiles );
+	if( cache->spill_hits + cache->spill_misses > 0 )
+		g_info( "%s: spill file %" G_GUINT64_FORMAT " hits, "
+			"%" G_GUINT64_FORMAT " misses", 
+			VIPS_OBJECT_GET_CLASS( cache )->nickname,
+			cache->spill_hits, cache->spill_misses ); 
+	cache->hits = 0;
+	cache->misses = 0;
+	cache->spill_hits = 0;
+	cache->spill_misses = 0;
+
 	vips_block_cache_drop_all( cache );
 	VIPS_FREEF( vips_g_mutex_free, cache->lock );
-	VIPS_FREEF( vips_g_cond_free, cache->new_tile );
+	VIPS_FREEF( vips_g_mutex_free, cache->spill_lock );
 
 	if( cache->tiles )
 		g_assert( g_hash_table_size( cache->tiles ) == 0 );
 	VIPS_FREEF( g_hash_table_destroy, cache->tiles );
 	VIPS_FREEF( g_queue_free, cache->recycle );
 
+	VIPS_FREEF( g_hash_table_destroy, cache->spill );
+	VIPS_FREE( cache->spill_pos );
+	if( cache->spill_fd != -1 ) {
+		vips_tracked_close( cache->spill_fd );
+		cache->spill_fd = -1;
+	}
+	if( cache->spill_filename ) {
+		g_unlink( cache->spill_filename );
+		VIPS_FREE( cache->spill_filename );
+	}
+
 	G_OBJECT_CLASS( vips_block_cache_parent_class )->dispose( gobject );
 }
 
+/* The most memory a tile can need.
+ */
+static guint64
+vips_block_cache_tile_bytes( VipsBlockCache *cache )
+{
+	return( (guint64) cache->tile_width * cache->tile_height *
+		VIPS_IMAGE_SIZEOF_PEL( cache->in ) );
+}
+
+/* Make the spill file on first use. 
+ *
+ * The spill functions run on worker threads and a failure just means we
+ * stop spilling, so they warn rather than touching the error buffer.
+ */
+static int
+vips_block_cache_spill_open( VipsBlockCache *cache )
+{
+	if( cache->spill_fd != -1 )
+		return( 0 );
+
+	/* We've tried and failed to open it before.
+	 */
+	if( cache->spill_filename )
+		return( -1 );
+
+	/* Build checked we have room for at least one tile.
+	 */
+	cache->spill_slots = VIPS_MIN( INT_MAX, 
+		cache->spill_bytes / vips_block_cache_tile_bytes( cache ) );
+	g_assert( cache->spill_slots > 0 );
+
+	if( !(cache->spill_pos = 
+		g_try_new0( VipsRect, cache->spill_slots )) ) {
+		g_warning( "%s", _( "out of memory for spill file index" ) );
+		return( -1 );
+	}
+
+	cache->spill_filename = vips__temp_name( "%s.spill" );
+	if( (cache->spill_fd = vips_tracked_open( cache->spill_filename, 
+		MODE_SPILL, 0600 )) == -1 ) {
+		g_warning( _( "unable to open \"%s\": %s" ), 
+			cache->spill_filename, g_strerror( errno ) );
+		return( -1 );
+	}
+
+	return( 0 );
+}
+
+/* Seek to the start of a slot. 
+ */
+static int
+vips_block_cache_spill_seek( VipsBlockCache *cache, int slot )
+{
+	if( vips__seek_no_error( cache->spill_fd, 
+		slot * vips_block_cache_tile_bytes( cache ), SEEK_SET ) == -1 ) {
+		g_warning( _( "spill file seek failed: %s" ), 
+			g_strerror( errno ) );
+		return( -1 );
+	}
+
+	return( 0 );
+}
+
+/* Save the pixels in @region for tile @pos to the spill file, if they are 
+ * not there already. Call with spill_lock held.
+ */
+static int
+vips_block_cache_spill_write( VipsBlockCache *cache, 
+	VipsRegion *region, VipsRect *pos )
+{
+	size_t line_bytes = VIPS_REGION_SIZEOF_LINE( region );
+
+	int slot;
+	int y;
+
+	if( g_hash_table_lookup( cache->spill, pos ) )
+		return( 0 );
+
+	if( vips_block_cache_spill_open( cache ) )
+		return( -1 );
+
+	/* Knock out whatever was in this slot before.
+	 */
+	slot = cache->spill_next;
+	cache->spill_next = (slot + 1) % cache->spill_slots;
+	if( cache->spill_pos[slot].width > 0 ) {
+		g_hash_table_remove( cache->spill, &cache->spill_pos[slot] );
+		cache->spill_pos[slot].width = 0;
+	}
+
+	if( vips_block_cache_spill_seek( cache, slot ) )
+		return( -1 );
+	for( y = 0; y < region->valid.height; y++ ) {
+		VipsPel *p = VIPS_REGION_ADDR( region, 
+			region->valid.left, region->valid.top + y );
+		size_t n = line_bytes;
+
+		while( n > 0 ) {
+			gint64 bytes_written = write( cache->spill_fd, p, n );
+
+			if( bytes_written <= 0 ) {
+				g_warning( _( "spill file write failed: %s" ), 
+					g_strerror( errno ) );
+				return( -1 );
+			}
+
+			p += bytes_written;
+			n -= bytes_written;
+		}
+	}
+
+	cache->spill_pos[slot] = *pos;
+	g_hash_table_insert( cache->spill, 
+		&cache->spill_pos[slot], GINT_TO_POINTER( slot + 1 ) );
+
+	return( 0 );
+}
+
+static int
+vips_block_cache_spill_read_line( VipsBlockCache *cache, 
+	VipsPel *buf, size_t n )
+{
+	while( n > 0 ) {
+		gint64 bytes_read = read( cache->spill_fd, buf, n );
+
+		if( bytes_read <= 0 ) {
+			g_warning( _( "spill file read failed: %s" ), 
+				g_strerror( errno ) );
+			return( -1 );
+		}
+
+		buf += bytes_read;
+		n -= bytes_read;
+	}
+
+	return( 0 );
+}
+
+/* Try to load a tile's pixels from the spill file. Return 0 for found, 1
+ * for not found, and -1 on error. Call with spill_lock held.
+ */
+static int
+vips_block_cache_spill_read( VipsBlockCache *cache, VipsTile *tile )
+{
+	VipsRegion *region = tile->region;
+	size_t line_bytes = VIPS_REGION_SIZEOF_LINE( region );
+
+	int slot;
+	int y;
+
+	slot = GPOINTER_TO_INT( 
+		g_hash_table_lookup( cache->spill, &tile->pos ) ) - 1;
+	if( slot < 0 ) 
+		return( 1 );
+
+	if( vips_block_cache_spill_seek( cache, slot ) )
+		return( -1 );
+	for( y = 0; y < region->valid.height; y++ ) 
+		if( vips_block_cache_spill_read_line( cache, 
+			VIPS_REGION_ADDR( region, 
+				region->valid.left, region->valid.top + y ),
+			line_bytes ) )
+			return( -1 );
+
+	return( 0 );
+}
+
+/* Call with the cache lock held.
+ */
 static int
 vips_tile_move( VipsTile *tile, int x, int y )
 {
+	VipsBlockCache *cache = tile->cache;
+
+	/* If we are evicting some pixels, they should go to the spill file.
+	 * That's disc IO, so we don't do it here, under the cache lock. We
+	 * keep the old pixels and vips_tile_calc() writes them out later.
+	 * A tile can be moved again before it's calculated, so don't
+	 * overwrite an eviction that's still pending.
+	 */
+	tile->spill = cache->spill_bytes > 0 && !cache->spill_failed;
+	if( tile->spill &&
+		tile->state == VIPS_TILE_STATE_DATA &&
+		!tile->spill_evicted ) {
+		tile->spill_evicted = TRUE;
+		tile->evicted = tile->pos;
+	}
+
 	/* We are changing x/y and therefore the hash value. We must unlink
 	 * from the old hash position and relink at the new place.
 	 */
@@ -183,18 +489,67 @@ vips_tile_move( VipsTile *tile, int x, int y )
 	tile->pos.width = tile->cache->tile_width;
 	tile->pos.height = tile->cache->tile_height;
 
+	/* The cost was for the old position. 
+	 */
+	tile->cost = 0;
+
 	g_hash_table_insert( tile->cache->tiles, &tile->pos, tile );
 
-	if( vips_region_buffer( tile->region, &tile->pos ) )
+	if( !tile->spill_evicted &&
+		vips_region_buffer( tile->region, &tile->pos ) )
 		return( -1 );
 
-	/* No data yet, but someone must want it.
+	/* No data yet, but someone must want it. 
 	 */
 	tile->state = VIPS_TILE_STATE_PEND;
 
 	return( 0 );
 }
 
+/* Fill a CALC tile. We are called without the cache lock in threaded mode,
+ * and no other thread will touch a CALC tile. Write any evicted pixels to 
+ * the spill file, then try to read the new pixels back from there, and only 
+ * calculate if that fails. 
+ *
+ * If the spill file fails, set @spill_failed and just recalculate. The
+ * caller turns spilling off once it has the cache lock again.
+ */
+static int
+vips_tile_calc( VipsTile *tile, VipsRegion *in, gboolean *spill_failed )
+{
+	VipsBlockCache *cache = tile->cache;
+
+	int result;
+
+	result = 1;
+	if( tile->spill ) {
+		g_mutex_lock( cache->spill_lock );
+		if( tile->spill_evicted &&
+			vips_block_cache_spill_write( cache, 
+				tile->region, &tile->evicted ) ) 
+			result = -1;
+		tile->spill_evicted = FALSE;
+		if( vips_region_buffer( tile->region, &tile->pos ) ) {
+			g_mutex_unlock( cache->spill_lock );
+			return( -1 );
+		}
+		if( result == 1 &&
+			(result = vips_block_cache_spill_read( cache, tile )) )
+			cache->spill_misses += 1;
+		else if( result == 0 )
+			cache->spill_hits += 1;
+		g_mutex_unlock( cache->spill_lock );
+
+		if( result == -1 )
+			*spill_failed = TRUE;
+		if( result == 0 )
+			return( 0 );
+	}
+
+	return( vips_region_prepare_to( in, tile->region, 
+		&tile->pos, tile->pos.left, tile->pos.top ) );
+}
+
 static VipsTile *
 vips_tile_new( VipsBlockCache *cache, int x, int y )
 {
@@ -205,8 +560,12 @@ vips_tile_new( VipsBlockCache *cache, int x, int y )
 
 	tile->cache = cache;
 	tile->state = VIPS_TILE_STATE_PEND;
+	tile->cost = 0;
 	tile->ref_count = 0;
 	tile->region = NULL;
+	tile->spill = FALSE;
+	tile->spill_evicted = FALSE;
+	tile->done = vips_g_cond_new();
 	tile->pos.left = x;
 	tile->pos.top = y;
 	tile->pos.width = cache->tile_width;
@@ -272,6 +631,53 @@ vips_tile_find_topmost( GQueue *recycle )
 	return( tile );
 }
 
+/* Search the oldest few tiles on the recycle list for the one which will 
+ * be cheapest to recalculate. All tiles are the same size, so we weight 
+ * cost by age, so we still tend to drop the least-recently-used.
+ */
+static VipsTile *
+vips_tile_find_cheapest( GQueue *recycle )
+{
+	VipsTile *best;
+	gint64 best_score;
+	GList *p;
+	int i;
+
+	best = NULL;
+	best_score = 0;
+	for( i = 0, p = recycle->head; 
+		i < VIPS_TILE_CACHE_CANDIDATES && p; 
+		i++, p = p->next ) {
+		VipsTile *tile = (VipsTile *) p->data;
+		gint64 score = (tile->cost + 1) * (i + 1);
+
+		if( !best ||
+			score < best_score ) {
+			best = tile;
+			best_score = score;
+		}
+	}
+
+	return( best );
+}
+
+/* Is the cache full? 
+ */
+static gboolean
+vips_block_cache_full( VipsBlockCache *cache )
+{
+	if( cache->max_tiles != -1 &&
+		cache->ntiles >= cache->max_tiles )
+		return( TRUE );
+
+	if( cache->max_bytes > 0 &&
+		(cache->ntiles + 1) * vips_block_cache_tile_bytes( cache ) > 
+			cache->max_bytes )
+		return( TRUE );
+
+	return( FALSE );
+}
+
 /* Find existing tile, make a new tile, or if we have a full set of tiles, 
  * reuse one.
  */
@@ -285,13 +691,15 @@ vips_tile_find( VipsBlockCache *cache, int x, int y )
 	if( (tile = vips_tile_search( cache, x, y )) ) {
 		VIPS_DEBUG_MSG_RED( "vips_tile_find: "
 			"tile %d x %d in cache\n", x, y ); 
+		cache->hits += 1;
 		return( tile );
 	}
 
+	cache->misses += 1;
+
 	/* VipsBlockCache not full?
 	 */
-	if( cache->max_tiles == -1 ||
-		cache->ntiles < cache->max_tiles ) {
+	if( !vips_block_cache_full( cache ) ) {
 		VIPS_DEBUG_MSG_RED( "vips_tile_find: "
 			"making new tile at %d x %d\n", x, y ); 
 		if( !(tile = vips_tile_new( cache, x, y )) )
@@ -305,7 +713,7 @@ vips_tile_find( VipsBlockCache *cache, int x, int y )
 	 */
 	if( cache->recycle ) {
 		if( cache->access == VIPS_ACCESS_RANDOM ) 
-			tile = g_queue_peek_head( cache->recycle ); 
+			tile = vips_tile_find_cheapest( cache->recycle ); 
 		else
 			/* This is slower :( We have to search the recycle
 			 * queue.
@@ -326,6 +734,8 @@ vips_tile_find( VipsBlockCache *cache, int x, int y )
 	VIPS_DEBUG_MSG_RED( "vips_tile_find: reusing tile %d x %d\n", 
 		tile->pos.left, tile->pos.top );
 
+	cache->evictions += 1;
+
 	if( vips_tile_move( tile, x, y ) )
 		return( NULL );
 
@@ -340,6 +750,23 @@ vips_tile_unlocked( gpointer key, gpointer value, gpointer user_data )
 	return( !tile->ref_count );
 }
 
+/* Attach a counter to @image as "tilecache-hits" etc. 
+ */
+static void
+vips_block_cache_set_stat( VipsBlockCache *cache, VipsImage *image,
+	const char *name, guint64 value )
+{
+	char field[256];
+
+	vips_snprintf( field, 256, "%s-%s", 
+		VIPS_OBJECT_GET_CLASS( cache )->nickname, name );
+	vips_image_set_int( image, field, VIPS_MIN( value, INT_MAX ) );
+}
+
+/* "minimise" is emitted on every image in a pipeline at the end of each
+ * computation, so it's a safe point to publish our counters, and to drop
+ * the cache if we're not persistent.
+ */
 static void
 vips_block_cache_minimise( VipsImage *image, VipsBlockCache *cache )
 {
@@ -347,10 +774,39 @@ vips_block_cache_minimise( VipsImage *image, VipsBlockCache *cache )
 
 	g_mutex_lock( cache->lock );
 
-	/* We can't drop tiles that are in use.
-	 */
-	g_hash_table_foreach_remove( cache->tiles, 
-		vips_tile_unlocked, NULL );
+	vips_block_cache_set_stat( cache, image, "hits", cache->hits );
+	vips_block_cache_set_stat( cache, image, "misses", cache->misses );
+	vips_block_cache_set_stat( cache, image, 
+		"evictions", cache->evictions );
+
+	if( cache->spill_bytes > 0 ) {
+		g_mutex_lock( cache->spill_lock );
+		vips_block_cache_set_stat( cache, image, 
+			"spill-hits", cache->spill_hits );
+		vips_block_cache_set_stat( cache, image, 
+			"spill-misses", cache->spill_misses );
+		g_mutex_unlock( cache->spill_lock );
+	}
+
+	if( !cache->persistent ) {
+		/* We can't drop tiles that are in use.
+		 */
+		g_hash_table_foreach_remove( cache->tiles, 
+			vips_tile_unlocked, NULL );
+
+		/* Forget anything in the spill file too. 
+		 */
+		if( cache->spill_bytes > 0 ) {
+			g_mutex_lock( cache->spill_lock );
+			g_hash_table_remove_all( cache->spill );
+			if( cache->spill_pos )
+				memset( cache->spill_pos, 0, 
+					cache->spill_slots * 
+						sizeof( VipsRect ) );
+			cache->spill_next = 0;
+			g_mutex_unlock( cache->spill_lock );
+		}
+	}
 
 	g_mutex_unlock( cache->lock );
 }
@@ -367,13 +823,19 @@ vips_block_cache_build( VipsObject *object )
 		build( object ) )
 		return( -1 );
 
+	if( cache->spill_bytes > 0 &&
+		cache->spill_bytes < vips_block_cache_tile_bytes( cache ) ) {
+		vips_error( "tilecache", 
+			"%s", _( "spill_bytes too small for one tile" ) );
+		return( -1 );
+	}
+
 	VIPS_DEBUG_MSG( "vips_block_cache_build: max size = %g MB\n",
 		(cache->max_tiles * cache->tile_width * cache->tile_height *
 		 	VIPS_IMAGE_SIZEOF_PEL( cache->in )) / (1024 * 1024.0) );
 
-	if( !cache->persistent )
-		g_signal_connect( conversion->out, "minimise", 
-			G_CALLBACK( vips_block_cache_minimise ), cache );
+	g_signal_connect( conversion->out, "minimise", 
+		G_CALLBACK( vips_block_cache_minimise ), cache );
 
 	return( 0 );
 }
@@ -472,6 +934,7 @@ vips_tile_destroy( VipsTile *tile )
 	tile->cache = NULL;
 
 	VIPS_UNREF( tile->region );
+	VIPS_FREEF( vips_g_cond_free, tile->done );
 
 	g_free( tile );
 }
@@ -485,10 +948,27 @@ vips_block_cache_init( VipsBlockCache *cache )
 	cache->access = VIPS_ACCESS_RANDOM;
 	cache->threaded = FALSE;
 	cache->persistent = FALSE;
+	cache->max_bytes = 0;
 
 	cache->ntiles = 0;
+	cache->hits = 0;
+	cache->misses = 0;
+	cache->evictions = 0;
+
+	cache->spill_bytes = 0;
+	cache->spill_failed = FALSE;
+	cache->spill_filename = NULL;
+	cache->spill_fd = -1;
+	cache->spill_slots = 0;
+	cache->spill_next = 0;
+	cache->spill_pos = NULL;
+	cache->spill = g_hash_table_new( 
+		(GHashFunc) vips_rect_hash, 
+		(GEqualFunc) vips_rect_equal );
+	cache->spill_hits = 0;
+	cache->spill_misses = 0;
+	cache->spill_lock = vips_g_mutex_new();
 	cache->lock = vips_g_mutex_new();
-	cache->new_tile = vips_g_cond_new();
 	cache->tiles = g_hash_table_new_full( 
 		(GHashFunc) vips_rect_hash, 
 		(GEqualFunc) vips_rect_equal,
@@ -601,6 +1081,20 @@ vips_tile_paste( VipsTile *tile, VipsRegion *or )
 		vips_region_copy( tile->region, or, &hit, hit.left, hit.top ); 
 }
 
+static gint64
+vips_tile_cache_time( void )
+{
+#ifdef HAVE_MONOTONIC_TIME
+	return( g_get_monotonic_time() );  
+#else
+	GTimeVal time;
+
+	g_get_current_time( &time );
+
+	return( (gint64) time.tv_sec * G_USEC_PER_SEC + time.tv_usec ); 
+#endif
+}
+
 /* Also called from vips_line_cache_gen(), beware.
  */
 static int
@@ -614,6 +1108,8 @@ vips_tile_cache_gen( VipsRegion *or,
 	VipsTile *tile;
 	GSList *work;
 	GSList *p;
+	gint64 start;
+	gboolean spill_failed;
 	int result;
 
 	result = 0;
@@ -633,28 +1129,42 @@ vips_tile_cache_gen( VipsRegion *or,
 	work = vips_tile_cache_ref( cache, r );
 
 	while( work ) {
+		GSList *ready;
+
 		/* Search for data tiles: easy, we can just paste those in.
 		 */
-		for(;;) { 
-			for( p = work; p; p = p->next ) { 
-				tile = (VipsTile *) p->data;
+		ready = NULL;
+		for( p = work; p; p = p->next ) { 
+			tile = (VipsTile *) p->data;
 
-				if( tile->state == VIPS_TILE_STATE_DATA ) 
-					break;
-			}
+			if( tile->state == VIPS_TILE_STATE_DATA ) 
+				ready = g_slist_prepend( ready, tile );
+		}
 
-			if( !p )
-				break;
+		if( ready ) {
+			for( p = ready; p; p = p->next ) 
+				work = g_slist_remove( work, p->data );
+
+			/* Our ref stops DATA tiles being moved or
+			 * recycled, so in threaded mode we can paste 
+			 * without the lock.
+			 */
+			if( cache->threaded ) 
+				g_mutex_unlock( cache->lock );
 
-			VIPS_DEBUG_MSG_RED( "vips_tile_cache_gen: "
-				"pasting %p\n", tile ); 
+			for( p = ready; p; p = p->next ) {
+				VIPS_DEBUG_MSG_RED( "vips_tile_cache_gen: "
+					"pasting %p\n", p->data ); 
+
+				vips_tile_paste( (VipsTile *) p->data, or );
+			}
 
-			vips_tile_paste( tile, or );
+			if( cache->threaded ) 
+				g_mutex_lock( cache->lock );
 
-			/* We're done with this tile.
+			/* We're done with these tiles.
 			 */
-			work = g_slist_remove( work, tile );
-			vips_tile_unref( tile ); 
+			vips_tile_cache_unref( ready );
 		}
 
 		/* Calculate the first PEND tile we find on the work list. We
@@ -678,10 +1188,13 @@ vips_tile_cache_gen( VipsRegion *or,
 				if( cache->threaded ) 
 					g_mutex_unlock( cache->lock );
 
-				result = vips_region_prepare_to( in, 
-					tile->region, 
-					&tile->pos, 
-					tile->pos.left, tile->pos.top );
+				start = vips_tile_cache_time();
+
+				spill_failed = FALSE;
+				result = vips_tile_calc( tile, in, 
+					&spill_failed );
+
+				tile->cost = vips_tile_cache_time() - start;
 
 				if( cache->threaded ) {
 					VIPS_GATE_START( "vips_tile_cache_gen: "
@@ -693,6 +1206,9 @@ vips_tile_cache_gen( VipsRegion *or,
 						"wait2" );
 				}
 
+				if( spill_failed )
+					cache->spill_failed = TRUE;
+
 				/* If there was an error calculating this
 				 * tile, black it out and terminate
 				 * calculation. We have to stop so we can
@@ -715,37 +1231,53 @@ vips_tile_cache_gen( VipsRegion *or,
 
 				tile->state = VIPS_TILE_STATE_DATA;
 
-				/* Let everyone know there's a new DATA tile. 
-				 * They need to all check their work lists.
+				/* Wake any threads waiting for this tile. 
 				 */
-				g_cond_broadcast( cache->new_tile );
+				g_cond_broadcast( tile->done );
 
 				break;
 			}
 		}
 
-		/* There are no PEND or DATA tiles, we must need a tile some
-		 * other thread is currently calculating.
+		/* There are no PEND tiles, we must need a tile some
+		 * other thread is currently calculating. Tiles may have
+		 * become DATA while we were pasting, so check for them.
 		 *
-		 * We must block until the CALC tiles we need are done.
+		 * Otherwise, block until the first CALC tile we need is done.
 		 */
 		if( !p && 
 			work ) {
+			VipsTile *wait;
+
+			wait = NULL;
 			for( p = work; p; p = p->next ) { 
 				tile = (VipsTile *) p->data;
 
+				if( tile->state == VIPS_TILE_STATE_DATA ) {
+					wait = NULL;
+					break;
+				}
+
 				g_assert( tile->state == VIPS_TILE_STATE_CALC );
+
+				if( !wait )
+					wait = tile;
 			}
 
-			VIPS_DEBUG_MSG_RED( "vips_tile_cache_gen: waiting\n" ); 
+			if( wait ) {
+				VIPS_DEBUG_MSG_RED( "vips_tile_cache_gen: "
+					"waiting for %p\n", wait ); 
 
-			VIPS_GATE_START( "vips_tile_cache_gen: wait3" );
+				VIPS_GATE_START( "vips_tile_cache_gen: wait3" );
 
-			g_cond_wait( cache->new_tile, cache->lock );
+				while( wait->state == VIPS_TILE_STATE_CALC )
+					g_cond_wait( wait->done, cache->lock );
 
-			VIPS_GATE_STOP( "vips_tile_cache_gen: wait3" );
+				VIPS_GATE_STOP( "vips_tile_cache_gen: wait3" );
 
-			VIPS_DEBUG_MSG( "vips_tile_cache_gen: awake!\n" ); 
+				VIPS_DEBUG_MSG( "vips_tile_cache_gen: "
+					"awake!\n" ); 
+			}
 		}
 	}
 
@@ -811,6 +1343,20 @@ vips_tile_cache_class_init( VipsTileCacheClass *class )
 		G_STRUCT_OFFSET( VipsBlockCache, max_tiles ),
 		-1, 1000000, 1000 );
 
+	VIPS_ARG_UINT64( class, "max_bytes", 9, 
+		_( "Max bytes" ), 
+		_( "Maximum size of cache in bytes, 0 for no limit" ),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET( VipsBlockCache, max_bytes ),
+		0, G_MAXUINT64, 0 );
+
+	VIPS_ARG_UINT64( class, "spill_bytes", 10, 
+		_( "Spill bytes" ), 
+		_( "Save evicted tiles to a temporary file of up to this size" ),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET( VipsBlockCache, spill_bytes ),
+		0, G_MAXUINT64, 0 );
+
 }
 
 static void
@@ -829,6 +1375,8 @@ vips_tile_cache_init( VipsTileCache *cache )
  * * @tile_width: width of tiles in cache
  * * @tile_height: height of tiles in cache
  * * @max_tiles: maximum number of tiles to cache
+ * * @max_bytes: maximum size of cache in bytes
+ * * @spill_bytes: save evicted tiles to disc, up to this many bytes
  * * @access: hint expected access pattern #VipsAccess
  * * @threaded: allow many threads
  * * @persistent: don't drop cache at end of computation
@@ -837,16 +1385,32 @@ vips_tile_cache_init( VipsTileCache *cache )
  * @in and @out, except that it keeps a cache of computed pixels. 
  * This cache is made of up to @max_tiles tiles (a value of -1 
  * means any number of tiles), and each tile is of size @tile_width
- * by @tile_height pixels. 
+ * by @tile_height pixels. If @max_bytes is set, the cache will also hold 
+ * no more than that many bytes of pixels.
  *
  * Each cache tile is made with a single call to 
  * vips_region_prepare(). 
  *
  * When the cache fills, a tile is chosen for reuse. If @access is
- * #VIPS_ACCESS_RANDOM, then the least-recently-used tile is reused. If 
+ * #VIPS_ACCESS_RANDOM, then the tile which was quickest to calculate out 
+ * of the few least-recently-used tiles is reused. If 
  * @access is #VIPS_ACCESS_SEQUENTIAL 
  * the top-most tile is reused.
  *
+ * If @spill_bytes is set, tiles evicted from a full cache are written to a
+ * temporary file of up to that size, and read back if they are needed
+ * again. This can be useful if @in is very expensive to calculate. Tiles 
+ * are stored uncompressed. If the spill file fails, a warning is issued 
+ * and the cache carries on without it.
+ *
+ * At the end of each computation, the number of cache hits, misses and 
+ * evictions so far are attached to @out as the int metadata items
+ * "tilecache-hits", "tilecache-misses" and "tilecache-evictions". With
+ * @spill_bytes, "tilecache-spill-hits" and "tilecache-spill-misses" count 
+ * misses which were and were not found in the spill file. They are 
+ * also logged with g_info() when the cache is freed: run with `--vips-info` 
+ * to see them.
+ *
  * By default, @tile_width and @tile_height are 128 pixels, and the operation
  * will cache up to 1,000 tiles. @access defaults to #VIPS_ACCESS_RANDOM.
  *
@@ -87,6 +87,12 @@
  * 	- add IIIF layout
  * 24/4/20 [IllyaMoskvin]
  * 	- better IIIF tile naming
+ * 18/10/26
+ * 	- write zip containers with our own streaming zip64 writer, deflating
+ * 	  tiles in parallel
+ * 	- add @dedupe
+ * 	- bound the size of the @dedupe table
+ * 	- spool the zip central directory to a temp file
  */
 
 /*
@@ -166,8 +172,18 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif /*HAVE_UNISTD_H*/
+#ifdef HAVE_IO_H
+#include <io.h>
+#endif /*HAVE_IO_H*/
 #include <string.h>
 
+#include <glib/gstdio.h>
+
 #include <vips/vips.h>
 #include <vips/internal.h>
 
@@ -179,8 +195,556 @@
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wdeprecated-declarations"
 #include <gsf/gsf.h>
+#include <gsf/gsf-output-impl.h>
 #pragma GCC diagnostic pop
 
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif /*HAVE_ZLIB*/
+
+#ifdef HAVE_ZLIB
+/* A simple streaming zip writer. 
+ *
+ * libgsf's zip writer keeps an object for every file and directory until 
+ * the end, and can only have one write active at once. For large pyramids 
+ * we write each entry straight to the output as it arrives. The central 
+ * directory is spooled to a temporary file and copied to the output at the 
+ * end, so memory use doesn't grow with the number of tiles.
+ *
+ * Entries are deflated by the thread that makes them, outside the lock, 
+ * so tiles compress in parallel. We switch to zip64 records for 
+ * entries past 4gb, and for the end of the central directory if we need to.
+ */
+
+#define VIPS_ZIP_MAX32 (0xffffffffu)
+#define VIPS_ZIP_MAX16 (0xffffu)
+
+/* Flush the central directory to the spool file in chunks of about this 
+ * size. 
+ */
+#define VIPS_ZIP_CENTRAL_CHUNK (1024 * 1024)
+
+/* Try to make an O_BINARY ... sometimes need the leading '_'.
+ */
+#ifdef BINARY_OPEN
+#ifndef O_BINARY
+#ifdef _O_BINARY
+#define O_BINARY _O_BINARY
+#endif /*_O_BINARY*/
+#endif /*!O_BINARY*/
+#endif /*BINARY_OPEN*/
+
+/* If we have O_BINARY, add it to a mode flags set.
+ */
+#ifdef O_BINARY
+#define BINARYIZE(M) ((M) | O_BINARY)
+#else /*!O_BINARY*/
+#define BINARYIZE(M) (M)
+#endif /*O_BINARY*/
+
+#define MODE_SPOOL BINARYIZE (O_RDWR | O_CREAT | O_TRUNC)
+
+typedef struct _VipsZip {
+	/* Write the zip file here. We don't own this.
+	 */
+	GsfOutput *out;
+
+	/* 0 for stored, -1 for zlib default, 1 - 9 for a deflate level.
+	 */
+	int deflate_level;
+
+	/* Timestamp for all entries, in DOS format.
+	 */
+	guint16 dos_time;
+	guint16 dos_date;
+
+	/* Everything below is protected by this.
+	 */
+	GMutex *lock;
+
+	/* Bytes written so far, ie. the offset of the next local header.
+	 */
+	guint64 offset;
+
+	/* The central directory we will write at the end. Records collect 
+	 * in @central, and are flushed to the spool file when that gets 
+	 * large. @central_length counts both.
+	 */
+	VipsDbuf central;
+	char *central_filename;
+	int central_fd;
+	guint64 central_length;
+	guint64 n_entries;
+} VipsZip;
+
+static void
+vips_zip_put16( VipsPel **p, guint16 x )
+{
+	(*p)[0] = x & 0xff;
+	(*p)[1] = (x >> 8) & 0xff;
+	*p += 2;
+}
+
+static void
+vips_zip_put32( VipsPel **p, guint32 x )
+{
+	vips_zip_put16( p, x & 0xffff );
+	vips_zip_put16( p, (x >> 16) & 0xffff );
+}
+
+static void
+vips_zip_put64( VipsPel **p, guint64 x )
+{
+	vips_zip_put32( p, x & 0xffffffff );
+	vips_zip_put32( p, (x >> 32) & 0xffffffff );
+}
+
+static VipsZip *
+vips_zip_new( GsfOutput *out, int deflate_level )
+{
+	VipsZip *zip = g_new( VipsZip, 1 );
+	GDateTime *now = g_date_time_new_now_local();
+
+	zip->out = out;
+	zip->deflate_level = deflate_level;
+	zip->dos_time = (g_date_time_get_hour( now ) << 11) |
+		(g_date_time_get_minute( now ) << 5) |
+		(g_date_time_get_second( now ) / 2);
+	zip->dos_date = (VIPS_MAX( 0, g_date_time_get_year( now ) - 1980 ) << 9) |
+		(g_date_time_get_month( now ) << 5) |
+		g_date_time_get_day_of_month( now );
+	zip->lock = vips_g_mutex_new();
+	zip->offset = 0;
+	vips_dbuf_init( &zip->central );
+	zip->central_filename = NULL;
+	zip->central_fd = -1;
+	zip->central_length = 0;
+	zip->n_entries = 0;
+
+	g_date_time_unref( now );
+
+	return( zip );
+}
+
+static void
+vips_zip_free( VipsZip *zip )
+{
+	VIPS_FREEF( vips_g_mutex_free, zip->lock );
+	vips_dbuf_destroy( &zip->central );
+	if( zip->central_fd != -1 ) {
+		vips_tracked_close( zip->central_fd );
+		zip->central_fd = -1;
+	}
+	if( zip->central_filename ) {
+		g_unlink( zip->central_filename );
+		VIPS_FREE( zip->central_filename );
+	}
+	g_free( zip );
+}
+
+/* Move the central directory records we have in memory to the spool file.
+ */
+static int
+vips_zip_central_flush( VipsZip *zip )
+{
+	const VipsPel *buf;
+	size_t length;
+
+	buf = vips_dbuf_string( &zip->central, &length );
+	if( length == 0 )
+		return( 0 );
+
+	if( zip->central_fd == -1 ) {
+		zip->central_filename = vips__temp_name( "%s.zipdir" );
+		if( (zip->central_fd = vips_tracked_open( 
+			zip->central_filename, MODE_SPOOL, 0600 )) == -1 ) {
+			vips_error_system( errno, "vips_zip", 
+				_( "unable to open \"%s\"" ), 
+				zip->central_filename );
+			return( -1 );
+		}
+	}
+
+	if( vips__write( zip->central_fd, buf, length ) )
+		return( -1 );
+	vips_dbuf_reset( &zip->central );
+
+	return( 0 );
+}
+
+static int
+vips_zip_write( VipsZip *zip, const void *data, size_t length )
+{
+	if( length > 0 &&
+		!gsf_output_write( zip->out, length, data ) ) {
+		vips_error( "vips_zip", "%s", 
+			gsf_output_error( zip->out ) ?
+				gsf_output_error( zip->out )->message :
+				_( "write error" ) );
+		return( -1 );
+	}
+	zip->offset += length;
+
+	return( 0 );
+}
+
+/* Deflate @data to a new buffer. NULL if it doesn't get smaller, or on error.
+ */
+static VipsPel *
+vips_zip_deflate( VipsZip *zip, 
+	const void *data, size_t length, size_t *compressed_length )
+{
+	z_stream stream;
+	VipsPel *buf;
+	size_t buf_length;
+
+	memset( &stream, 0, sizeof( stream ) );
+	if( deflateInit2( &stream, zip->deflate_level, Z_DEFLATED, 
+		-MAX_WBITS, 8, Z_DEFAULT_STRATEGY ) != Z_OK )
+		return( NULL );
+
+	buf_length = deflateBound( &stream, length );
+	if( !(buf = g_try_malloc( buf_length )) ) {
+		deflateEnd( &stream );
+		return( NULL );
+	}
+
+	stream.next_in = (Bytef *) data;
+	stream.avail_in = length;
+	stream.next_out = buf;
+	stream.avail_out = buf_length;
+	if( deflate( &stream, Z_FINISH ) != Z_STREAM_END ||
+		stream.total_out >= length ) {
+		deflateEnd( &stream );
+		g_free( buf );
+		return( NULL );
+	}
+
+	*compressed_length = stream.total_out;
+	deflateEnd( &stream );
+
+	return( buf );
+}
+
+/* Add a file to the zip. Safe to call from many threads. 
+ */
+static int
+vips_zip_add( VipsZip *zip, const char *path, 
+	const void *data, size_t length )
+{
+	size_t path_length = strlen( path );
+	guint32 crc = crc32( crc32( 0L, Z_NULL, 0 ), data, length );
+
+	VipsPel *compressed;
+	size_t compressed_length;
+	guint16 method;
+	guint64 offset;
+	gboolean zip64;
+	VipsPel header[46 + 28];
+	VipsPel *p;
+	int result;
+
+	/* Deflate before we take the lock. Incompressible data (eg. JPEG
+	 * tiles) is stored instead.
+	 */
+	compressed = NULL;
+	compressed_length = length;
+	method = 0;
+	if( zip->deflate_level != 0 &&
+		(compressed = vips_zip_deflate( zip, 
+			data, length, &compressed_length )) ) 
+		method = 8;
+
+	g_mutex_lock( zip->lock );
+
+	offset = zip->offset;
+
+	/* The sizes go into a zip64 extra field if they won't fit. We need 
+	 * to know in the local header, before we write the data.
+	 */
+	zip64 = length >= VIPS_ZIP_MAX32 ||
+		compressed_length >= VIPS_ZIP_MAX32;
+
+	p = header;
+	vips_zip_put32( &p, 0x04034b50 );
+	vips_zip_put16( &p, zip64 ? 45 : 20 );
+	vips_zip_put16( &p, 0 );
+	vips_zip_put16( &p, method );
+	vips_zip_put16( &p, zip->dos_time );
+	vips_zip_put16( &p, zip->dos_date );
+	vips_zip_put32( &p, crc );
+	vips_zip_put32( &p, zip64 ? VIPS_ZIP_MAX32 : compressed_length );
+	vips_zip_put32( &p, zip64 ? VIPS_ZIP_MAX32 : length );
+	vips_zip_put16( &p, path_length );
+	vips_zip_put16( &p, zip64 ? 20 : 0 );
+
+	result = vips_zip_write( zip, header, p - header ) ||
+		vips_zip_write( zip, path, path_length );
+
+	if( !result &&
+		zip64 ) {
+		p = header;
+		vips_zip_put16( &p, 0x0001 );
+		vips_zip_put16( &p, 16 );
+		vips_zip_put64( &p, length );
+		vips_zip_put64( &p, compressed_length );
+		result = vips_zip_write( zip, header, p - header );
+	}
+
+	if( !result )
+		result = vips_zip_write( zip, 
+			compressed ? compressed : data, compressed_length );
+
+	if( !result ) {
+		/* And the matching central directory record. Any field that
+		 * won't fit in 32 bits goes in the extra field, in order.
+		 */
+		VipsPel extra[28];
+		VipsPel *q;
+
+		q = extra + 4;
+		if( length >= VIPS_ZIP_MAX32 )
+			vips_zip_put64( &q, length );
+		if( compressed_length >= VIPS_ZIP_MAX32 )
+			vips_zip_put64( &q, compressed_length );
+		if( offset >= VIPS_ZIP_MAX32 )
+			vips_zip_put64( &q, offset );
+		if( q > extra + 4 ) {
+			VipsPel *r = extra;
+
+			vips_zip_put16( &r, 0x0001 );
+			vips_zip_put16( &r, (q - extra) - 4 );
+		}
+		else
+			q = extra;
+
+		p = header;
+		vips_zip_put32( &p, 0x02014b50 );
+		vips_zip_put16( &p, 45 );
+		vips_zip_put16( &p, q > extra ? 45 : 20 );
+		vips_zip_put16( &p, 0 );
+		vips_zip_put16( &p, method );
+		vips_zip_put16( &p, zip->dos_time );
+		vips_zip_put16( &p, zip->dos_date );
+		vips_zip_put32( &p, crc );
+		vips_zip_put32( &p, 
+			VIPS_MIN( compressed_length, VIPS_ZIP_MAX32 ) );
+		vips_zip_put32( &p, VIPS_MIN( length, VIPS_ZIP_MAX32 ) );
+		vips_zip_put16( &p, path_length );
+		vips_zip_put16( &p, q - extra );
+		vips_zip_put16( &p, 0 );
+		vips_zip_put16( &p, 0 );
+		vips_zip_put16( &p, 0 );
+		vips_zip_put32( &p, 0 );
+		vips_zip_put32( &p, VIPS_MIN( offset, VIPS_ZIP_MAX32 ) );
+
+		vips_dbuf_write( &zip->central, header, p - header );
+		vips_dbuf_write( &zip->central, 
+			(const VipsPel *) path, path_length );
+		vips_dbuf_write( &zip->central, extra, q - extra );
+
+		zip->central_length += (p - header) + path_length + 
+			(q - extra);
+		zip->n_entries += 1;
+
+		if( vips_dbuf_tell( &zip->central ) >= 
+			VIPS_ZIP_CENTRAL_CHUNK ) 
+			result = vips_zip_central_flush( zip );
+	}
+
+	g_mutex_unlock( zip->lock );
+
+	g_free( compressed );
+
+	return( result );
+}
+
+/* Write the central directory and the end records. 
+ */
+static int
+vips_zip_finish( VipsZip *zip )
+{
+	guint64 central_offset = zip->offset;
+	guint64 central_length = zip->central_length;
+
+	const VipsPel *central;
+	size_t length;
+	VipsPel header[56 + 20 + 22];
+	VipsPel *p;
+
+	/* Copy back anything we spooled, then the records still in memory.
+	 */
+	if( zip->central_fd != -1 ) {
+		VipsPel *buf;
+		gint64 bytes_read;
+
+		if( vips__seek( zip->central_fd, 0, SEEK_SET ) == -1 )
+			return( -1 );
+
+		buf = g_malloc( VIPS_ZIP_CENTRAL_CHUNK );
+		while( (bytes_read = read( zip->central_fd, 
+			buf, VIPS_ZIP_CENTRAL_CHUNK )) > 0 ) 
+			if( vips_zip_write( zip, buf, bytes_read ) ) {
+				g_free( buf );
+				return( -1 );
+			}
+		g_free( buf );
+
+		if( bytes_read < 0 ) {
+			vips_error_system( errno, "vips_zip", 
+				"%s", _( "read failed" ) );
+			return( -1 );
+		}
+	}
+
+	central = vips_dbuf_string( &zip->central, &length );
+	if( vips_zip_write( zip, central, length ) )
+		return( -1 );
+	g_assert( zip->offset - central_offset == central_length );
+
+	p = header;
+
+	if( zip->n_entries >= VIPS_ZIP_MAX16 ||
+		central_offset >= VIPS_ZIP_MAX32 ||
+		central_length >= VIPS_ZIP_MAX32 ) {
+		guint64 zip64_offset = zip->offset;
+
+		/* zip64 end of central directory record, then the locator.
+		 */
+		vips_zip_put32( &p, 0x06064b50 );
+		vips_zip_put64( &p, 44 );
+		vips_zip_put16( &p, 45 );
+		vips_zip_put16( &p, 45 );
+		vips_zip_put32( &p, 0 );
+		vips_zip_put32( &p, 0 );
+		vips_zip_put64( &p, zip->n_entries );
+		vips_zip_put64( &p, zip->n_entries );
+		vips_zip_put64( &p, central_length );
+		vips_zip_put64( &p, central_offset );
+
+		vips_zip_put32( &p, 0x07064b50 );
+		vips_zip_put32( &p, 0 );
+		vips_zip_put64( &p, zip64_offset );
+		vips_zip_put32( &p, 1 );
+	}
+
+	vips_zip_put32( &p, 0x06054b50 );
+	vips_zip_put16( &p, 0 );
+	vips_zip_put16( &p, 0 );
+	vips_zip_put16( &p, VIPS_MIN( zip->n_entries, VIPS_ZIP_MAX16 ) );
+	vips_zip_put16( &p, VIPS_MIN( zip->n_entries, VIPS_ZIP_MAX16 ) );
+	vips_zip_put32( &p, VIPS_MIN( central_length, VIPS_ZIP_MAX32 ) );
+	vips_zip_put32( &p, VIPS_MIN( central_offset, VIPS_ZIP_MAX32 ) );
+	vips_zip_put16( &p, 0 );
+
+	return( vips_zip_write( zip, header, p - header ) );
+}
+
+/* A GsfOutput for one file in a VipsZip. Writes accumulate in memory, and 
+ * the file is compressed and added to the zip on close.
+ */
+typedef struct _VipsZipEntry {
+	GsfOutput parent_instance;
+
+	VipsZip *zip;
+	char *path;
+	VipsDbuf dbuf;
+} VipsZipEntry;
+
+typedef GsfOutputClass VipsZipEntryClass;
+
+G_DEFINE_TYPE( VipsZipEntry, vips_zip_entry, GSF_OUTPUT_TYPE );
+
+static void
+vips_zip_entry_finalize( GObject *gobject )
+{
+	VipsZipEntry *entry = (VipsZipEntry *) gobject;
+
+	VIPS_FREE( entry->path );
+	vips_dbuf_destroy( &entry->dbuf );
+
+	G_OBJECT_CLASS( vips_zip_entry_parent_class )->finalize( gobject );
+}
+
+static gboolean
+vips_zip_entry_close( GsfOutput *output )
+{
+	VipsZipEntry *entry = (VipsZipEntry *) output;
+
+	size_t length;
+	const VipsPel *data;
+
+	data = vips_dbuf_string( &entry->dbuf, &length );
+
+	return( !vips_zip_add( entry->zip, entry->path, data, length ) );
+}
+
+static gboolean
+vips_zip_entry_seek( GsfOutput *output, gsf_off_t offset, GSeekType whence )
+{
+	VipsZipEntry *entry = (VipsZipEntry *) output;
+
+	int w;
+
+	switch( whence ) {
+	case G_SEEK_CUR:
+		w = SEEK_CUR;
+		break;
+
+	case G_SEEK_END:
+		w = SEEK_END;
+		break;
+
+	default:
+		w = SEEK_SET;
+		break;
+	}
+
+	return( vips_dbuf_seek( &entry->dbuf, offset, w ) );
+}
+
+static gboolean
+vips_zip_entry_write( GsfOutput *output, size_t num_bytes, guint8 const *data )
+{
+	VipsZipEntry *entry = (VipsZipEntry *) output;
+
+	return( vips_dbuf_write( &entry->dbuf, data, num_bytes ) );
+}
+
+static void
+vips_zip_entry_class_init( VipsZipEntryClass *class )
+{
+	GObjectClass *gobject_class = G_OBJECT_CLASS( class );
+
+	gobject_class->finalize = vips_zip_entry_finalize;
+
+	class->Close = vips_zip_entry_close;
+	class->Seek = vips_zip_entry_seek;
+	class->Write = vips_zip_entry_write;
+}
+
+static void
+vips_zip_entry_init( VipsZipEntry *entry )
+{
+	entry->zip = NULL;
+	entry->path = NULL;
+	vips_dbuf_init( &entry->dbuf );
+}
+
+static GsfOutput *
+vips_zip_entry_new( VipsZip *zip, const char *path )
+{
+	VipsZipEntry *entry = g_object_new( vips_zip_entry_get_type(), 
+		"name", path,
+		NULL );
+
+	entry->zip = zip;
+	entry->path = g_strdup( path );
+
+	return( GSF_OUTPUT( entry ) );
+}
+#endif /*HAVE_ZLIB*/
+
 /* Simple wrapper around libgsf.
  *
  * We need to be able to do scattered writes to structured files. So while
@@ -222,31 +786,60 @@ typedef struct _VipsGsfDirectory {
 	 */
 	gint deflate_level;
 
+	/* For filesystem output, the root node has the directory it is 
+	 * writing to. We need this to make hard links.
+	 */
+	char *root_path;
+
+#ifdef HAVE_ZLIB
+	/* If set, the root node writes files straight to this zip, and there
+	 * are no child directories. name is the base directory in the zip.
+	 */
+	VipsZip *zip;
+#endif /*HAVE_ZLIB*/
+
 } VipsGsfDirectory; 
 
-static void *vips_gsf_tree_close( VipsGsfDirectory *tree );
+static int vips_gsf_tree_close( VipsGsfDirectory *tree );
 
 static void *
 vips_gsf_tree_close_cb( void *item, void *a, void *b )
 {
 	VipsGsfDirectory *tree = (VipsGsfDirectory *) item;
+	int *result = (int *) a;
+
+	if( vips_gsf_tree_close( tree ) )
+		*result = -1;
 
-	return( vips_gsf_tree_close( tree ) );
+	return( NULL );
 }
 
-/* Close all dirs, non-NULL on error.
+/* Close all dirs and free the tree. The tree is always freed, even if 
+ * something fails, and we return -1 on error.
  */
-static void *
+static int
 vips_gsf_tree_close( VipsGsfDirectory *tree )
 {
-	vips_slist_map2( tree->children, vips_gsf_tree_close_cb, NULL, NULL );
+	int result;
+
+	result = 0;
+	vips_slist_map2( tree->children, 
+		vips_gsf_tree_close_cb, &result, NULL );
+
+#ifdef HAVE_ZLIB
+	if( tree->zip ) {
+		if( vips_zip_finish( tree->zip ) )
+			result = -1;
+		VIPS_FREEF( vips_zip_free, tree->zip );
+	}
+#endif /*HAVE_ZLIB*/
 
 	if( tree->out ) {
 		if( !gsf_output_is_closed( tree->out ) &&
 			!gsf_output_close( tree->out ) ) {
 			vips_error( "vips_gsf", 
 				"%s", _( "unable to close stream" ) ); 
-			return( tree );
+			result = -1;
 		}
 
 		VIPS_UNREF( tree->out );
@@ -257,7 +850,7 @@ vips_gsf_tree_close( VipsGsfDirectory *tree )
 			!gsf_output_close( tree->container ) ) {
 			vips_error( "vips_gsf", 
 				"%s", _( "unable to close stream" ) ); 
-			return( tree );
+			result = -1;
 		}
 
 		VIPS_UNREF( tree->container );
@@ -265,9 +858,10 @@ vips_gsf_tree_close( VipsGsfDirectory *tree )
 
 	VIPS_FREEF( g_slist_free, tree->children );
 	VIPS_FREE( tree->name );
+	VIPS_FREE( tree->root_path );
 	VIPS_FREE( tree );
 
-	return( NULL ); 
+	return( result ); 
 }
 
 /* Make a new tree root.
@@ -285,10 +879,30 @@ vips_gsf_tree_new( GsfOutput *out, gint deflate_level )
 	tree->file_count = 0;
 	tree->filename_lengths = 0;
 	tree->deflate_level = deflate_level;
+	tree->root_path = NULL;
+#ifdef HAVE_ZLIB
+	tree->zip = NULL;
+#endif /*HAVE_ZLIB*/
 
 	return( tree ); 
 }
 
+#ifdef HAVE_ZLIB
+/* Make a new tree root which writes to a zip file. All files go into the 
+ * directory @name.
+ */
+static VipsGsfDirectory *
+vips_gsf_tree_new_zip( GsfOutput *out, const char *name, gint deflate_level )
+{
+	VipsGsfDirectory *tree = vips_gsf_tree_new( NULL, deflate_level );
+
+	tree->name = g_strdup( name );
+	tree->zip = vips_zip_new( out, deflate_level );
+
+	return( tree ); 
+}
+#endif /*HAVE_ZLIB*/
+
 static void *
 vips_gsf_child_by_name_sub( VipsGsfDirectory *dir, const char *name, void *b )
 {
@@ -324,6 +938,10 @@ vips_gsf_dir_new( VipsGsfDirectory *parent, const char *name )
 	dir->file_count = 0;
 	dir->filename_lengths = 0;
 	dir->deflate_level = parent->deflate_level;
+	dir->root_path = NULL;
+#ifdef HAVE_ZLIB
+	dir->zip = NULL;
+#endif /*HAVE_ZLIB*/
 
 	if( GSF_IS_OUTFILE_ZIP( parent->out ) )
 		dir->out = gsf_outfile_new_child_full( 
@@ -343,22 +961,36 @@ vips_gsf_dir_new( VipsGsfDirectory *parent, const char *name )
 	return( dir ); 
 }
 
-/* Return a GsfOutput for writing to a path. Paths are object name first, then
- * path components with least-specific first, NULL-terminated. For example:
- *
- * GsfOutput *obj = vips_gsf_path( tree, "fred.jpg", "a", "b", NULL );
- *
- * Returns an obj you can use to write to a/b/fred.jpg. 
- *
- * You must write, close and unref obj.
+/* Walk down @dirs (NULL-terminated, least-specific first), making any
+ * directories we need. 
  */
-static GsfOutput *
-vips_gsf_path( VipsGsfDirectory *tree, const char *name, ... )
+static VipsGsfDirectory *
+vips_gsf_dir_find( VipsGsfDirectory *tree, const char **dirs )
 {
-	va_list ap;
 	VipsGsfDirectory *dir;
 	VipsGsfDirectory *child;
-	char *dir_name;
+	int i;
+
+	dir = tree; 
+	for( i = 0; dirs[i]; i++ ) {
+		if( (child = vips_gsf_child_by_name( dir, dirs[i] )) )
+			dir = child;
+		else 
+			dir = vips_gsf_dir_new( dir, dirs[i] );
+
+		tree->filename_lengths += strlen( dirs[i] ) + 1;
+	}
+
+	return( dir );
+}
+
+/* As vips_gsf_path(), but with the path components in a NULL-terminated
+ * array.
+ */
+static GsfOutput *
+vips_gsf_pathv( VipsGsfDirectory *tree, const char *name, const char **dirs )
+{
+	VipsGsfDirectory *dir;
 	GsfOutput *obj;
 
 	/* vips_gsf_path() always makes a new file, though it may add to an
@@ -366,19 +998,30 @@ vips_gsf_path( VipsGsfDirectory *tree, const char *name, ... )
 	 * path we are creating.
 	 */
 	tree->file_count += 1;
-	tree->filename_lengths += strlen( tree->out->name ) + strlen( name ) + 1;
 
-	dir = tree; 
-	va_start( ap, name );
-	while( (dir_name = va_arg( ap, char * )) ) {
-		if( (child = vips_gsf_child_by_name( dir, dir_name )) )
-			dir = child;
-		else 
-			dir = vips_gsf_dir_new( dir, dir_name );
+#ifdef HAVE_ZLIB
+	/* Zip files just need the full path, there's no tree to build.
+	 */
+	if( tree->zip ) {
+		GString *path;
+		int i;
 
-		tree->filename_lengths += strlen( dir_name ) + 1;
+		path = g_string_new( tree->name );
+		for( i = 0; dirs[i]; i++ ) 
+			g_string_append_printf( path, "/%s", dirs[i] ); 
+		g_string_append_printf( path, "/%s", name ); 
+
+		tree->filename_lengths += path->len;
+		obj = vips_zip_entry_new( tree->zip, path->str );
+		g_string_free( path, TRUE );
+
+		return( obj );
 	}
-	va_end( ap );
+#endif /*HAVE_ZLIB*/
+
+	tree->filename_lengths += strlen( tree->out->name ) + strlen( name ) + 1;
+
+	dir = vips_gsf_dir_find( tree, dirs );
 
 	if( GSF_IS_OUTFILE_ZIP( dir->out ) ) {
 		/* Confusingly, libgsf compression-level really means
@@ -412,6 +1055,89 @@ vips_gsf_path( VipsGsfDirectory *tree, const char *name, ... )
 	return( obj ); 
 }
 
+/* The deepest path we make.
+ */
+#define VIPS_GSF_MAX_DEPTH (10)
+
+/* Return a GsfOutput for writing to a path. Paths are object name first, then
+ * path components with least-specific first, NULL-terminated. For example:
+ *
+ * GsfOutput *obj = vips_gsf_path( tree, "fred.jpg", "a", "b", NULL );
+ *
+ * Returns an obj you can use to write to a/b/fred.jpg. 
+ *
+ * You must write, close and unref obj.
+ */
+static GsfOutput *
+vips_gsf_path( VipsGsfDirectory *tree, const char *name, ... )
+{
+	va_list ap;
+	const char *dirs[VIPS_GSF_MAX_DEPTH + 1];
+	int n;
+
+	n = 0;
+	va_start( ap, name );
+	while( n < VIPS_GSF_MAX_DEPTH &&
+		(dirs[n] = va_arg( ap, const char * )) ) 
+		n += 1;
+	va_end( ap );
+	dirs[n] = NULL;
+
+	return( vips_gsf_pathv( tree, name, dirs ) ); 
+}
+
+/* The filename @name and @dirs will have on disc, or NULL if we are not 
+ * writing to the filesystem. Free with g_free().
+ */
+static char *
+vips_gsf_filename( VipsGsfDirectory *tree, const char *name, const char **dirs )
+{
+	GString *path;
+	int i;
+
+	if( !tree->root_path )
+		return( NULL );
+
+	path = g_string_new( tree->root_path );
+	for( i = 0; dirs[i]; i++ ) 
+		g_string_append_printf( path, "%s%s", G_DIR_SEPARATOR_S, dirs[i] );
+	g_string_append_printf( path, "%s%s", G_DIR_SEPARATOR_S, name );
+
+	return( g_string_free( path, FALSE ) );
+}
+
+/* Make @name and @dirs a hard link to the existing file @from. This only
+ * works for filesystem output. Returns non-zero, with no error set, if we 
+ * can't link, and the caller should write the file instead.
+ */
+static int
+vips_gsf_link( VipsGsfDirectory *tree, 
+	const char *from, const char *name, const char **dirs )
+{
+#ifndef G_OS_WIN32
+	char *filename;
+	int result;
+
+	if( !tree->root_path )
+		return( -1 );
+
+	/* Make sure the directories exist.
+	 */
+	(void) vips_gsf_dir_find( tree, dirs );
+
+	filename = vips_gsf_filename( tree, name, dirs );
+	result = link( from, filename );
+	g_free( filename );
+
+	if( !result )
+		tree->file_count += 1;
+
+	return( result );
+#else /*G_OS_WIN32*/
+	return( -1 );
+#endif /*G_OS_WIN32*/
+}
+
 typedef struct _VipsForeignSaveDz VipsForeignSaveDz;
 typedef struct _Layer Layer;
 
@@ -477,6 +1203,7 @@ struct _VipsForeignSaveDz {
 	int skip_blanks;
 	gboolean no_strip;
 	char *id;
+	gboolean dedupe;
 
 	/* Tile and overlap geometry. The members above are the parameters we
 	 * accept, this next set are the derived values which are actually 
@@ -557,6 +1284,15 @@ struct _VipsForeignSaveDz {
 	 */
 	VipsPel *ink;
 
+	/* For @dedupe, the tiles we've written so far, indexed by a digest
+	 * of their pixels. Keys are strings, values are TileEntry. 
+	 */
+	GHashTable *tiles;
+
+	/* Bytes of encoded tiles held in @tiles.
+	 */
+	size_t tiles_bytes;
+
 };
 
 typedef VipsForeignSaveClass VipsForeignSaveDzClass;
@@ -602,15 +1338,13 @@ estimate_zip_size( VipsForeignSaveDz *dz )
 }
 #endif /*HAVE_GSF_ZIP64*/
 
+/* Encode @image in @format.
+ */
 static int
-write_image( VipsForeignSaveDz *dz,
-	GsfOutput *out, VipsImage *image, const char *format )
+encode_image( VipsForeignSaveDz *dz, 
+	VipsImage *image, const char *format, void **buf, size_t *len )
 {
-	VipsObjectClass *class = VIPS_OBJECT_GET_CLASS( dz );
-
 	VipsImage *t;
-	void *buf;
-	size_t len;
 
 	/* We need to block progress signalling on individual image write, so
 	 * we need a copy of the tile in case it's shared (eg. associated
@@ -623,7 +1357,7 @@ write_image( VipsForeignSaveDz *dz,
 	 * off. Most people don't want metadata on every tile.
 	 */
 	vips_image_set_int( t, "hide-progress", 1 );
-	if( vips_image_write_to_buffer( t, format, &buf, &len,
+	if( vips_image_write_to_buffer( t, format, buf, len,
 		"strip", !dz->no_strip,
 		NULL ) ) {
 		VIPS_UNREF( t );
@@ -631,6 +1365,36 @@ write_image( VipsForeignSaveDz *dz,
 	}
 	VIPS_UNREF( t );
 
+	return( 0 );
+}
+
+/* Write @buf to @out, then close @out. 
+ */
+static int
+write_buffer( VipsForeignSaveDz *dz,
+	GsfOutput *out, const void *buf, size_t len )
+{
+	VipsObjectClass *class = VIPS_OBJECT_GET_CLASS( dz );
+
+#ifdef HAVE_ZLIB
+	/* Our own zip writer is threadsafe, and it deflates on close, so we 
+	 * can skip the lock. It has zip64, so there's no size check either.
+	 */
+	if( dz->tree->zip ) {
+		gboolean ok;
+
+		ok = gsf_output_write( out, len, buf );
+		ok = gsf_output_close( out ) && ok;
+		if( !ok ) {
+			vips_error( class->nickname,
+				"%s", _( "unable to write to zip" ) );
+			return( -1 );
+		}
+
+		return( 0 );
+	}
+#endif /*HAVE_ZLIB*/
+
 	/* gsf doesn't like more than one write active at once.
 	 */
 	g_mutex_lock( vips__global_lock );
@@ -638,7 +1402,6 @@ write_image( VipsForeignSaveDz *dz,
 	if( !gsf_output_write( out, len, buf ) ) {
 		gsf_output_close( out );
 		g_mutex_unlock( vips__global_lock );
-		g_free( buf );
 		vips_error( class->nickname,
 			"%s", gsf_output_error( out )->message );
 
@@ -675,6 +1438,24 @@ write_image( VipsForeignSaveDz *dz,
 
 	g_mutex_unlock( vips__global_lock );
 
+	return( 0 );
+}
+
+static int
+write_image( VipsForeignSaveDz *dz,
+	GsfOutput *out, VipsImage *image, const char *format )
+{
+	void *buf;
+	size_t len;
+
+	if( encode_image( dz, image, format, &buf, &len ) )
+		return( -1 );
+
+	if( write_buffer( dz, out, buf, len ) ) {
+		g_free( buf );
+		return( -1 );
+	}
+
 	g_free( buf );
 
 	return( 0 );
@@ -705,6 +1486,7 @@ vips_foreign_save_dz_dispose( GObject *gobject )
 	VIPS_FREE( dz->tempdir );
 	VIPS_FREE( dz->root_name );
 	VIPS_FREE( dz->file_suffix );
+	VIPS_FREEF( g_hash_table_destroy, dz->tiles );
 
 	G_OBJECT_CLASS( vips_foreign_save_dz_parent_class )->
 		dispose( gobject );
@@ -1378,18 +2160,29 @@ strip_allocate( VipsThreadState *state, void *a, gboolean *stop )
 	return( 0 );
 }
 
-/* Make an output object for a tile in the current layout.
+/* Where a tile goes in the output tree.
  */
-static GsfOutput *
-tile_name( Layer *layer, int x, int y )
+typedef struct _TilePath {
+	char name[VIPS_PATH_MAX];
+	char dirname[VIPS_PATH_MAX];
+	char dirname2[VIPS_PATH_MAX];
+
+	/* NULL-terminated, least-specific first, as for vips_gsf_path().
+	 */
+	const char *dirs[4];
+} TilePath;
+
+/* Find the path for a tile in the current layout.
+ */
+static void
+tile_path( Layer *layer, int x, int y, TilePath *path )
 {
 	VipsForeignSaveDz *dz = layer->dz;
 	VipsForeignSave *save = (VipsForeignSave *) dz;
 
-	GsfOutput *out; 
-	char name[VIPS_PATH_MAX];
-	char dirname[VIPS_PATH_MAX];
-	char dirname2[VIPS_PATH_MAX];
+	char *name = path->name;
+	char *dirname = path->dirname;
+	char *dirname2 = path->dirname2;
 	Layer *p;
 	int n;
 
@@ -1399,8 +2192,9 @@ tile_name( Layer *layer, int x, int y )
 		vips_snprintf( name, VIPS_PATH_MAX, 
 			"%d_%d%s", x, y, dz->file_suffix );
 
-		out = vips_gsf_path( dz->tree, name, 
-			dz->root_name, dirname, NULL );
+		path->dirs[0] = dz->root_name;
+		path->dirs[1] = dirname;
+		path->dirs[2] = NULL;
 
 		break;
 
@@ -1429,7 +2223,8 @@ tile_name( Layer *layer, int x, int y )
 		 */
 		dz->tile_count += 1;
 
-		out = vips_gsf_path( dz->tree, name, dirname, NULL );
+		path->dirs[0] = dirname;
+		path->dirs[1] = NULL;
 
 		break;
 
@@ -1439,7 +2234,9 @@ tile_name( Layer *layer, int x, int y )
 		vips_snprintf( name, VIPS_PATH_MAX, 
 			"%d%s", x, dz->file_suffix );
 
-		out = vips_gsf_path( dz->tree, name, dirname, dirname2, NULL );
+		path->dirs[0] = dirname;
+		path->dirs[1] = dirname2;
+		path->dirs[2] = NULL;
 
 		break;
 
@@ -1474,8 +2271,10 @@ tile_name( Layer *layer, int x, int y )
 
 		/* "0" is rotation and is always 0.
 		 */
-		out = vips_gsf_path( dz->tree, 
-			name, dirname, dirname2, "0", NULL );
+		path->dirs[0] = dirname;
+		path->dirs[1] = dirname2;
+		path->dirs[2] = "0";
+		path->dirs[3] = NULL;
 }
 
 		break;
@@ -1485,14 +2284,12 @@ tile_name( Layer *layer, int x, int y )
 
 		/* Stop compiler warnings.
 		 */
-		out = NULL;
+		path->dirs[0] = NULL;
 	}
 
 #ifdef DEBUG_VERBOSE
-	printf( "tile_name: writing to %s\n", name );
+	printf( "tile_path: writing to %s\n", name );
 #endif /*DEBUG_VERBOSE*/
-
-	return( out );
 }
 
 /* Test for tile nearly equal to background colour. In google maps mode, we 
@@ -1542,6 +2339,163 @@ tile_equal( VipsImage *image, int threshold, VipsPel * restrict ink )
 	return( TRUE );
 }
 
+/* A tile we've written, for @dedupe. 
+ */
+typedef struct _TileEntry {
+	/* For filesystem output, the file we wrote. Repeats are hard links to 
+	 * this.
+	 */
+	char *filename;
+
+	/* Otherwise, the encoded tile, if we had space to keep it. Repeats 
+	 * are written again from this, but skip the encode.
+	 */
+	void *buf;
+	size_t len;
+} TileEntry;
+
+/* Keep at most this many bytes of encoded tiles, and remember at most this
+ * many tiles. Repeated tiles are almost always background, so they are 
+ * small and turn up early.
+ */
+#define VIPS_DZ_MAX_TILES_BYTES (64 * 1024 * 1024)
+#define VIPS_DZ_MAX_TILES (100000)
+
+static void
+tile_entry_free( TileEntry *entry )
+{
+	VIPS_FREE( entry->filename );
+	VIPS_FREE( entry->buf );
+	g_free( entry );
+}
+
+/* Make a digest of the pixels in a tile. Free with g_free().
+ */
+static char *
+tile_digest( VipsImage *image )
+{
+	const size_t line_size = VIPS_IMAGE_SIZEOF_LINE( image );
+
+	VipsRect rect;
+	VipsRegion *region;
+	GChecksum *checksum;
+	int header[4];
+	char *digest;
+	int y;
+
+	region = vips_region_new( image ); 
+
+	rect.left = 0;
+	rect.top = 0;
+	rect.width = image->Xsize;
+	rect.height = image->Ysize;
+	if( vips_region_prepare( region, &rect ) ) {
+		g_object_unref( region );
+		return( NULL ); 
+	}
+
+	/* Include the geometry, so edge tiles with the same bytes but a 
+	 * different shape don't match.
+	 */
+	checksum = g_checksum_new( G_CHECKSUM_SHA1 );
+	header[0] = image->Xsize;
+	header[1] = image->Ysize;
+	header[2] = image->Bands;
+	header[3] = image->BandFmt;
+	g_checksum_update( checksum, (guchar *) header, sizeof( header ) );
+	for( y = 0; y < image->Ysize; y++ ) 
+		g_checksum_update( checksum, 
+			VIPS_REGION_ADDR( region, 0, y ), line_size );
+	digest = g_strdup( g_checksum_get_string( checksum ) );
+
+	g_checksum_free( checksum );
+	g_object_unref( region );
+
+	return( digest );
+}
+
+/* If we've seen a tile with this digest before, link or copy it to @path. 
+ *
+ * Return 0 if we wrote the tile, 1 if it's new and the caller must encode 
+ * and write it, -1 for error.
+ */
+static int
+tile_repeat( VipsForeignSaveDz *dz, const char *digest, TilePath *path )
+{
+	TileEntry *entry;
+	GsfOutput *out;
+	int result;
+
+	g_mutex_lock( vips__global_lock );
+
+	if( !(entry = g_hash_table_lookup( dz->tiles, digest )) ) {
+		g_mutex_unlock( vips__global_lock );
+		return( 1 );
+	}
+
+	if( entry->filename &&
+		!vips_gsf_link( dz->tree, 
+			entry->filename, path->name, path->dirs ) ) {
+		g_mutex_unlock( vips__global_lock );
+		return( 0 );
+	}
+
+	if( !entry->buf ) {
+		g_mutex_unlock( vips__global_lock );
+		return( 1 );
+	}
+
+	out = vips_gsf_pathv( dz->tree, path->name, path->dirs );
+
+	g_mutex_unlock( vips__global_lock );
+
+	/* Entries are never changed once they are in the table, so we can 
+	 * write from buf outside the lock.
+	 */
+	result = write_buffer( dz, out, entry->buf, entry->len );
+	g_object_unref( out );
+
+	return( result );
+}
+
+/* Note a tile we've just written. We take ownership of @digest and @buf.
+ *
+ * Once the table is full, or in zip mode once we have no space left for 
+ * the encoded tile, we just forget about it. An entry with nothing to 
+ * copy from would be no use.
+ */
+static void
+tile_remember( VipsForeignSaveDz *dz, 
+	char *digest, TilePath *path, void *buf, size_t len )
+{
+	g_mutex_lock( vips__global_lock );
+
+	if( g_hash_table_size( dz->tiles ) < VIPS_DZ_MAX_TILES &&
+		!g_hash_table_lookup( dz->tiles, digest ) &&
+		(dz->tree->root_path ||
+		 dz->tiles_bytes + len <= VIPS_DZ_MAX_TILES_BYTES) ) {
+		TileEntry *entry = g_new0( TileEntry, 1 );
+
+		if( dz->tree->root_path ) 
+			entry->filename = vips_gsf_filename( dz->tree, 
+				path->name, path->dirs );
+		else {
+			entry->buf = buf;
+			entry->len = len;
+			dz->tiles_bytes += len;
+			buf = NULL;
+		}
+
+		g_hash_table_insert( dz->tiles, digest, entry );
+		digest = NULL;
+	}
+
+	g_mutex_unlock( vips__global_lock );
+
+	g_free( digest );
+	g_free( buf );
+}
+
 static int
 strip_work( VipsThreadState *state, void *a )
 {
@@ -1553,6 +2507,10 @@ strip_work( VipsThreadState *state, void *a )
 	VipsImage *x;
 	VipsImage *t;
 	GsfOutput *out; 
+	TilePath path;
+	char *digest;
+	void *buf;
+	size_t len;
 
 #ifdef DEBUG_VERBOSE
 	printf( "strip_work\n" );
@@ -1618,21 +2576,56 @@ strip_work( VipsThreadState *state, void *a )
 	/* we need to single-thread around calls to gsf.
 	 */
 	g_mutex_lock( vips__global_lock );
+	tile_path( layer, 
+		state->x / dz->tile_step, state->y / dz->tile_step, &path );
+	g_mutex_unlock( vips__global_lock );
 
-	out = tile_name( layer, 
-		state->x / dz->tile_step, state->y / dz->tile_step );
+	/* Have we written a tile with these pixels before? 
+	 */
+	digest = NULL;
+	if( dz->dedupe ) {
+		int result;
 
+		if( !(digest = tile_digest( x )) ) {
+			g_object_unref( x );
+			return( -1 );
+		}
+
+		if( (result = tile_repeat( dz, digest, &path )) <= 0 ) {
+			g_free( digest );
+			g_object_unref( x );
+
+			return( result );
+		}
+	}
+
+	if( encode_image( dz, x, dz->suffix, &buf, &len ) ) {
+		g_free( digest );
+		g_object_unref( x );
+		return( -1 );
+	}
+	g_object_unref( x );
+
+	g_mutex_lock( vips__global_lock );
+	out = vips_gsf_pathv( dz->tree, path.name, path.dirs );
 	g_mutex_unlock( vips__global_lock );
 
-	if( write_image( dz, out, x, dz->suffix ) ) {
+	if( write_buffer( dz, out, buf, len ) ) {
 		g_object_unref( out );
-		g_object_unref( x );
+		g_free( digest );
+		g_free( buf );
 
 		return( -1 );
 	}
-
 	g_object_unref( out );
-	g_object_unref( x );
+
+	/* Note this tile for later repeats. tile_remember() takes ownership 
+	 * of digest and buf.
+	 */
+	if( digest ) 
+		tile_remember( dz, digest, &path, buf, len );
+	else
+		g_free( buf );
 
 #ifdef DEBUG_VERBOSE
 	printf( "strip_work: success\n" );
@@ -1989,6 +2982,7 @@ vips_foreign_save_dz_build( VipsObject *object )
 	VipsForeignSaveDz *dz = (VipsForeignSaveDz *) object;
 	VipsObjectClass *class = VIPS_OBJECT_GET_CLASS( dz ); 
 	VipsRect real_pixels; 
+	int result;
 
 	/* Google, zoomify and iiif default to zero overlap, ".jpg".
 	 */
@@ -2080,6 +3074,10 @@ vips_foreign_save_dz_build( VipsObject *object )
 	save->ready = z;
 }
 
+	if( dz->dedupe )
+		dz->tiles = g_hash_table_new_full( g_str_hash, g_str_equal,
+			g_free, (GDestroyNotify) tile_entry_free );
+
 	/* We use ink to check for blank tiles.
 	 */
 	if( dz->skip_blanks >= 0 ) {
@@ -2222,6 +3220,7 @@ vips_foreign_save_dz_build( VipsObject *object )
 			}
 		
 			dz->tree = vips_gsf_tree_new( out, 0 );
+			dz->tree->root_path = g_strdup( dz->tempdir );
 		}
 		else { 
 			GsfOutput *out;
@@ -2237,14 +3236,17 @@ vips_foreign_save_dz_build( VipsObject *object )
 			}
 		
 			dz->tree = vips_gsf_tree_new( out, 0 );
+			dz->tree->root_path = g_strdup( name );
 		}
 		break;
 
 	case VIPS_FOREIGN_DZ_CONTAINER_ZIP:
 	case VIPS_FOREIGN_DZ_CONTAINER_SZI:
 {
+#ifndef HAVE_ZLIB
 		GsfOutput *zip;
 		GsfOutput *out2;
+#endif /*HAVE_ZLIB*/
 		GError *error = NULL;
 		char name[VIPS_PATH_MAX];
 
@@ -2266,6 +3268,13 @@ vips_foreign_save_dz_build( VipsObject *object )
 		else
 			dz->out = gsf_output_memory_new();
 
+#ifdef HAVE_ZLIB
+		/* Our own zip writer is much faster than libgsf's, and 
+		 * always supports zip64 and deflate level.
+		 */
+		dz->tree = vips_gsf_tree_new_zip( dz->out, 
+			dz->basename, dz->compression );
+#else /*!HAVE_ZLIB*/
 		if( !(zip = (GsfOutput *) 
 			gsf_outfile_zip_new( dz->out, &error )) ) {
 			vips_g_error( &error );
@@ -2294,6 +3303,7 @@ vips_foreign_save_dz_build( VipsObject *object )
 		/* Note the thing that will need closing up on exit.
 		 */
 		dz->tree->container = zip; 
+#endif /*HAVE_ZLIB*/
 }
 		break;
 
@@ -2374,9 +3384,10 @@ vips_foreign_save_dz_build( VipsObject *object )
 
 	/* Shut down the output to flush everything.
 	 */
-	if( vips_gsf_tree_close( dz->tree ) )
-		return( -1 ); 
+	result = vips_gsf_tree_close( dz->tree );
 	dz->tree = NULL; 
+	if( result )
+		return( -1 ); 
 
 	/* If we are writing a zip to the filesystem, we must unref out to
 	 * force it to disc.
@@ -2535,6 +3546,13 @@ vips_foreign_save_dz_class_init( VipsForeignSaveDzClass *class )
 		G_STRUCT_OFFSET( VipsForeignSaveDz, id ),
 		"https://example.com/iiif" );
 
+	VIPS_ARG_BOOL( class, "dedupe", 22, 
+		_( "Dedupe" ), 
+		_( "Write identical tiles once" ),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET( VipsForeignSaveDz, dedupe ),
+		FALSE );
+
 	/* How annoying. We stupidly had these in earlier versions.
 	 */
 
@@ -2778,6 +3796,7 @@ vips_foreign_save_dz_buffer_init( VipsForeignSaveDzBuffer *buffer )
  * * @skip_blanks: %gint skip tiles which are nearly equal to the background
  * * @no_strip: %gboolean don't strip tiles
  * * @id: %gchar id for IIIF properties
+ * * @dedupe: %gboolean write identical tiles once
  *
  * Save an image as a set of tiles at various resolutions. By default dzsave
  * uses DeepZoom layout -- use @layout to pick other conventions.
@@ -2832,7 +3851,15 @@ vips_foreign_save_dz_buffer_init( VipsForeignSaveDzBuffer *buffer )
  * If you set @skip_blanks to a value greater than or equal to zero, tiles 
  * which are all within that many pixel values to the background are skipped. 
  * This can save a lot of space for some image types. This option defaults to 
- * 5 in Google layout mode, -1 otherwise.
+ * 5 in Google layout mode, -1 otherwise. Blank tiles are skipped at every
+ * level of the pyramid.
+ *
+ * Set @dedupe to only encode each distinct tile once. Tiles which have exactly
+ * the same pixels as one written earlier become hard links to the earlier 
+ * file for filesystem output, or reuse the earlier encoded tile in zip 
+ * output. This can save a lot of time and space for slides with large areas 
+ * of background. To bound memory use, only the first 100,000 distinct tiles 
+ * are remembered, and zip output keeps at most 64MB of encoded tiles.
  *
  * In IIIF layout, you can set the base of the `id` property in `info.json` 
  * with @id. The default is `https://example.com/iiif`.
@@ -2879,6 +3906,7 @@ vips_dzsave( VipsImage *in, const char *name, ... )
  * * @skip_blanks: %gint skip tiles which are nearly equal to the background
  * * @no_strip: %gboolean don't strip tiles
  * * @id: %gchar id for IIIF properties
+ * * @dedupe: %gboolean write identical tiles once
  *
  * As vips_dzsave(), but save to a memory buffer. 
  *
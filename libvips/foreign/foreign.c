@@ -2086,6 +2086,7 @@ vips_foreign_operation_init( void )
 	extern GType vips_foreign_save_jpeg_buffer_get_type( void ); 
 	extern GType vips_foreign_save_jpeg_target_get_type( void ); 
 	extern GType vips_foreign_save_jpeg_mime_get_type( void ); 
+	extern GType vips_foreign_jpegtran_source_get_type( void ); 
 
 	extern GType vips_foreign_load_tiff_file_get_type( void ); 
 	extern GType vips_foreign_load_tiff_buffer_get_type( void ); 
@@ -2207,9 +2208,6 @@ vips_foreign_operation_init( void )
 	vips_foreign_load_png_file_get_type(); 
 	vips_foreign_load_png_buffer_get_type(); 
 	vips_foreign_load_png_source_get_type(); 
-	vips_foreign_save_png_file_get_type(); 
-	vips_foreign_save_png_buffer_get_type(); 
-	vips_foreign_save_png_target_get_type(); 
 #endif /*HAVE_PNG*/
 
 #ifdef HAVE_SPNG
@@ -2218,6 +2216,12 @@ vips_foreign_operation_init( void )
 	vips_foreign_load_png_source_get_type(); 
 #endif /*HAVE_SPNG*/
 
+#if defined(HAVE_PNG) || defined(HAVE_SPNG_ENCODE)
+	vips_foreign_save_png_file_get_type(); 
+	vips_foreign_save_png_buffer_get_type(); 
+	vips_foreign_save_png_target_get_type(); 
+#endif /*defined(HAVE_PNG) || defined(HAVE_SPNG_ENCODE)*/
+
 #ifdef HAVE_MATIO
 	vips_foreign_load_mat_get_type(); 
 #endif /*HAVE_MATIO*/
@@ -2230,6 +2234,7 @@ vips_foreign_operation_init( void )
 	vips_foreign_save_jpeg_buffer_get_type(); 
 	vips_foreign_save_jpeg_target_get_type(); 
 	vips_foreign_save_jpeg_mime_get_type(); 
+	vips_foreign_jpegtran_source_get_type(); 
 #endif /*HAVE_JPEG*/
 
 #ifdef HAVE_LIBWEBP
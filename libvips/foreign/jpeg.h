@@ -77,6 +77,9 @@ typedef struct {
 void vips__new_output_message( j_common_ptr cinfo );
 void vips__new_error_exit( j_common_ptr cinfo );
 
+void vips__jpeg_source_src( j_decompress_ptr cinfo, VipsSource *source );
+void vips__jpeg_target_dest( j_compress_ptr cinfo, VipsTarget *target );
+
 #ifdef __cplusplus
 }
 #endif /*__cplusplus*/
@@ -110,6 +110,12 @@
  * 	- better handling of JFIF res unit 0
  * 13/9/20
  * 	- set resolution unit from JFIF 
+ * 18/10/26
+ * 	- autorotate decodes straight to a rotated memory image
+ * 	- decode chunks between restart markers in parallel
+ * 	- 90 and 270 autorotate decode strips and transpose in blocks
+ * 	- autorotate by 90, 180 and 270 rotates the DCT coefficients with
+ * 	  vips_jpegtran_source(), if it can, and decodes sequentially
  */
 
 /*
@@ -199,8 +205,36 @@ typedef struct _ReadJpeg {
 	 */
 	VipsSource *source;
 
+	/* For restart decode, the mapped source, the offsets of the SOF
+	 * height field and the end of the SOS header, and the start and end
+	 * of each entropy-coded segment.
+	 */
+	const VipsPel *data;
+	size_t length;
+	size_t sof;
+	size_t sos_end;
+	int n_segments;
+	size_t *segment_start;
+	size_t *segment_end;
+
+	/* MCU geometry, the number of MCU rows we decode in each chunk, and
+	 * the number of MCU rows above each chunk we must decode for
+	 * upsampling context.
+	 */
+	int mcu_height;
+	int mcus_across;
+	int mcus_down;
+	int chunk_rows;
+	int context_rows;
+
 } ReadJpeg;
 
+/* Decode restart chunks at least this many lines high. Each chunk has its
+ * own libjpeg, so they need to be large enough to hide the setup cost and
+ * any context rows we decode twice.
+ */
+#define RESTART_CHUNK_HEIGHT (256)
+
 #define SOURCE_BUFFER_SIZE (4096)
 
 /* Private struct for source input.
@@ -276,6 +310,28 @@ skip_input_data( j_decompress_ptr cinfo, long num_bytes )
 	}
 }
 
+/* Set cinfo to read from a source. jpegtran uses this too.
+ */
+void
+vips__jpeg_source_src( j_decompress_ptr cinfo, VipsSource *source )
+{
+	Source *src;
+
+	cinfo->src = (struct jpeg_source_mgr *)
+		(*cinfo->mem->alloc_small)( 
+			(j_common_ptr) cinfo, JPOOL_PERMANENT,
+			sizeof( Source ) );
+
+	src = (Source *) cinfo->src;
+	src->source = source;
+	src->pub.init_source = source_init_source;
+	src->pub.fill_input_buffer = source_fill_input_buffer;
+	src->pub.resync_to_restart = jpeg_resync_to_restart; 
+	src->pub.skip_input_data = skip_input_data; 
+	src->pub.bytes_in_buffer = 0;
+	src->pub.next_input_byte = src->buf;
+}
+
 static int
 readjpeg_open_input( ReadJpeg *jpeg )
 {
@@ -283,24 +339,10 @@ readjpeg_open_input( ReadJpeg *jpeg )
 
 	if( jpeg->source &&
 		!cinfo->src ) {
-		Source *src;
-
 		if( vips_source_rewind( jpeg->source ) )
 			return( -1 );
 
-		cinfo->src = (struct jpeg_source_mgr *)
-			(*cinfo->mem->alloc_small)( 
-				(j_common_ptr) cinfo, JPOOL_PERMANENT,
-				sizeof( Source ) );
-
-		src = (Source *) cinfo->src;
-		src->source = jpeg->source;
-		src->pub.init_source = source_init_source;
-		src->pub.fill_input_buffer = source_fill_input_buffer;
-		src->pub.resync_to_restart = jpeg_resync_to_restart; 
-		src->pub.skip_input_data = skip_input_data; 
-		src->pub.bytes_in_buffer = 0;
-		src->pub.next_input_byte = src->buf;
+		vips__jpeg_source_src( cinfo, jpeg->source );
 	}
 
 	return( 0 );
@@ -331,6 +373,8 @@ readjpeg_free( ReadJpeg *jpeg )
 	jpeg_destroy_decompress( &jpeg->cinfo );
 
 	VIPS_UNREF( jpeg->source );
+	VIPS_FREE( jpeg->segment_start );
+	VIPS_FREE( jpeg->segment_end );
 
 	return( 0 );
 }
@@ -366,6 +410,9 @@ readjpeg_new( VipsSource *source, VipsImage *out,
 	jpeg->eman.fp = NULL;
 	jpeg->y_pos = 0;
 	jpeg->autorotate = autorotate;
+	jpeg->data = NULL;
+	jpeg->segment_start = NULL;
+	jpeg->segment_end = NULL;
 
 	/* This is used by the error handlers to signal invalidate on the
 	 * output image.
@@ -837,6 +884,681 @@ read_jpeg_generate( VipsRegion *or,
 	return( 0 );
 }
 
+/* Find the entropy-coded segments in a baseline JPEG with restart markers.
+ * If every chunk of MCU rows starts on a restart boundary, we can decode
+ * chunks in parallel, each with its own libjpeg.
+ *
+ * Return TRUE if we can use restart decode for this image.
+ */
+static gboolean
+readjpeg_restart( ReadJpeg *jpeg )
+{
+	struct jpeg_decompress_struct *cinfo = &jpeg->cinfo;
+
+	const VipsPel *p;
+	size_t length;
+	size_t i;
+	int n_frame;
+	int n_scan;
+	int mcu_width;
+	int a, b;
+	int step;
+	gint64 n_mcus;
+	int k;
+
+	if( cinfo->restart_interval == 0 ||
+		vips_concurrency_get() < 2 ||
+		!vips_source_is_mappable( jpeg->source ) ||
+		!(p = vips_source_map( jpeg->source, &length )) )
+		return( FALSE );
+
+	/* Walk the markers up to the first SOS. We only handle huffman 
+	 * sequential frames.
+	 */
+	if( length < 4 ||
+		p[0] != 0xff || 
+		p[1] != 0xd8 )
+		return( FALSE );
+	jpeg->sof = 0;
+	n_frame = 0;
+	n_scan = 0;
+	for( i = 2; ; ) {
+		int marker;
+
+		if( i + 4 > length ||
+			p[i] != 0xff )
+			return( FALSE );
+		marker = p[i + 1];
+
+		/* Skip fill bytes.
+		 */
+		if( marker == 0xff ) {
+			i += 1;
+			continue;
+		}
+
+		if( marker == 0xc0 || 
+			marker == 0xc1 ) {
+			if( i + 10 > length )
+				return( FALSE );
+			jpeg->sof = i;
+			n_frame = p[i + 9];
+		}
+		else if( marker >= 0xc2 && 
+			marker <= 0xcf &&
+			marker != 0xc4 &&
+			marker != 0xc8 &&
+			marker != 0xcc ) 
+			return( FALSE );
+
+		if( marker == 0xda ) {
+			if( jpeg->sof == 0 ||
+				i + 5 > length )
+				return( FALSE );
+			n_scan = p[i + 4];
+			jpeg->sos_end = i + 2 + ((p[i + 2] << 8) | p[i + 3]);
+			break;
+		}
+
+		i += 2 + ((p[i + 2] << 8) | p[i + 3]);
+	}
+
+	/* A single scan with all the components, and no DNL.
+	 */
+	if( n_scan != n_frame ||
+		n_frame != cinfo->num_components ||
+		jpeg->sos_end >= length ||
+		((p[jpeg->sof + 5] << 8) | p[jpeg->sof + 6]) == 0 )
+		return( FALSE );
+
+	if( n_scan == 1 ) {
+		mcu_width = DCTSIZE;
+		jpeg->mcu_height = DCTSIZE;
+	}
+	else {
+		mcu_width = DCTSIZE * cinfo->max_h_samp_factor;
+		jpeg->mcu_height = DCTSIZE * cinfo->max_v_samp_factor;
+	}
+	jpeg->mcus_across = VIPS_ROUND_UP( (int) cinfo->image_width, 
+		mcu_width ) / mcu_width;
+	jpeg->mcus_down = VIPS_ROUND_UP( (int) cinfo->image_height, 
+		jpeg->mcu_height ) / jpeg->mcu_height;
+
+	/* We can start a chunk on any MCU row which is also the start of a 
+	 * restart interval. This is every @step rows.
+	 */
+	a = cinfo->restart_interval;
+	b = jpeg->mcus_across;
+	while( b ) {
+		int t = a % b;
+
+		a = b;
+		b = t;
+	}
+	step = cinfo->restart_interval / a;
+
+	jpeg->chunk_rows = VIPS_ROUND_UP( RESTART_CHUNK_HEIGHT, 
+		jpeg->mcu_height ) / jpeg->mcu_height;
+	jpeg->chunk_rows = VIPS_ROUND_UP( jpeg->chunk_rows, step );
+
+	/* Vertical chroma upsampling looks at the rows above and below, so
+	 * decode an extra step above each chunk and throw it away. 
+	 */
+	jpeg->context_rows = n_scan > 1 && 
+		cinfo->max_v_samp_factor > 1 ? step : 0;
+
+	/* Only worth doing if we have several chunks.
+	 */
+	if( jpeg->chunk_rows * 2 > jpeg->mcus_down )
+		return( FALSE );
+
+	/* Every segment ends with a two byte marker, so a broken header can't
+	 * make us allocate more than the file size.
+	 */
+	n_mcus = (gint64) jpeg->mcus_across * jpeg->mcus_down;
+	if( VIPS_ROUND_UP( n_mcus, cinfo->restart_interval ) / 
+		cinfo->restart_interval > length / 2 )
+		return( FALSE );
+	jpeg->n_segments = VIPS_ROUND_UP( n_mcus, cinfo->restart_interval ) /
+		cinfo->restart_interval;
+
+	VIPS_FREE( jpeg->segment_start );
+	VIPS_FREE( jpeg->segment_end );
+	jpeg->segment_start = VIPS_ARRAY( NULL, jpeg->n_segments, size_t );
+	jpeg->segment_end = VIPS_ARRAY( NULL, jpeg->n_segments, size_t );
+	if( !jpeg->segment_start ||
+		!jpeg->segment_end )
+		return( FALSE );
+
+	/* Find the RSTn markers. They must be in sequence, and the scan must
+	 * end with EOI after exactly the number of segments we expect, or we
+	 * leave the file to libjpeg's error recovery.
+	 */
+	k = 0;
+	jpeg->segment_start[0] = jpeg->sos_end;
+	for( i = jpeg->sos_end; ; ) {
+		const VipsPel *q;
+		int marker;
+
+		if( !(q = memchr( p + i, 0xff, length - i )) )
+			return( FALSE );
+		i = q - p;
+		if( i + 1 >= length )
+			return( FALSE );
+		marker = p[i + 1];
+
+		if( marker == 0x00 ) 
+			/* A stuffed zero.
+			 */
+			i += 2;
+		else if( marker == 0xff )
+			/* A fill byte.
+			 */
+			i += 1;
+		else if( marker >= 0xd0 &&
+			marker <= 0xd7 ) {
+			if( marker != 0xd0 + k % 8 )
+				return( FALSE );
+
+			jpeg->segment_end[k] = i;
+			k += 1;
+			if( k >= jpeg->n_segments )
+				return( FALSE );
+			jpeg->segment_start[k] = i + 2;
+			i += 2;
+		}
+		else {
+			jpeg->segment_end[k] = i;
+			k += 1;
+			if( marker != 0xd9 ||
+				k != jpeg->n_segments )
+				return( FALSE );
+
+			break;
+		}
+	}
+
+	jpeg->data = p;
+	jpeg->length = length;
+
+#ifdef DEBUG
+	printf( "readjpeg_restart: %d segments, %d MCU rows per chunk, "
+		"%d context rows\n", 
+		jpeg->n_segments, jpeg->chunk_rows, jpeg->context_rows );
+#endif /*DEBUG*/
+
+	return( TRUE );
+}
+
+static void
+chunk_init_source( j_decompress_ptr cinfo )
+{
+}
+
+static boolean
+chunk_fill_input_buffer( j_decompress_ptr cinfo )
+{
+	static const JOCTET eoi_buffer[4] = {
+		(JOCTET) 0xFF, (JOCTET) JPEG_EOI, 0, 0
+	};
+
+	WARNMS( cinfo, JWRN_JPEG_EOF );
+	cinfo->src->next_input_byte = eoi_buffer;
+	cinfo->src->bytes_in_buffer = 2;
+
+	return( TRUE );
+}
+
+static void
+chunk_skip_input_data( j_decompress_ptr cinfo, long num_bytes )
+{
+	struct jpeg_source_mgr *src = cinfo->src;
+
+	if( num_bytes > 0 ) {
+		if( num_bytes > (long) src->bytes_in_buffer )
+			(void) (*src->fill_input_buffer) (cinfo);
+		else {
+			src->next_input_byte += (size_t) num_bytes;
+			src->bytes_in_buffer -= (size_t) num_bytes;
+		}
+	}
+}
+
+/* Build a JPEG in memory for a chunk of MCU rows, starting @first rows 
+ * down and with enough entropy-coded segments to cover @last rows. The
+ * restart markers are renumbered and the frame height is patched to be the
+ * rest of the image, so libjpeg sees the same bottom edge.
+ */
+static VipsPel *
+read_jpeg_chunk_build( ReadJpeg *jpeg, int first, int last, size_t *length )
+{
+	int image_height = jpeg->cinfo.image_height - first * jpeg->mcu_height;
+	int restart_interval = jpeg->cinfo.restart_interval;
+	int s0 = (gint64) first * jpeg->mcus_across / restart_interval;
+	int s1 = VIPS_ROUND_UP( (gint64) last * jpeg->mcus_across, 
+		restart_interval ) / restart_interval;
+
+	VipsPel *buf;
+	VipsPel *q;
+	int s;
+
+	*length = jpeg->sos_end;
+	for( s = s0; s < s1; s++ ) 
+		*length += jpeg->segment_end[s] - jpeg->segment_start[s] + 2;
+	if( !(buf = vips_malloc( NULL, *length )) )
+		return( NULL );
+
+	q = buf;
+	memcpy( q, jpeg->data, jpeg->sos_end );
+	q[jpeg->sof + 5] = image_height >> 8;
+	q[jpeg->sof + 6] = image_height & 0xff;
+	q += jpeg->sos_end;
+
+	for( s = s0; s < s1; s++ ) {
+		size_t n = jpeg->segment_end[s] - jpeg->segment_start[s];
+
+		memcpy( q, jpeg->data + jpeg->segment_start[s], n );
+		q += n;
+
+		*q++ = 0xff;
+		*q++ = s < s1 - 1 ? 0xd0 + (s - s0) % 8 : 0xd9;
+	}
+
+	g_assert( q - buf == *length );
+
+	return( buf );
+}
+
+/* Decode the part of @chunk which falls inside @or.
+ */
+static int
+read_jpeg_chunk( ReadJpeg *jpeg, VipsRegion *or, int chunk )
+{
+	VipsRect *r = &or->valid;
+	int sz = jpeg->cinfo.output_width * jpeg->cinfo.output_components;
+	int row0 = chunk * jpeg->chunk_rows;
+	int row1 = VIPS_MIN( jpeg->mcus_down, row0 + jpeg->chunk_rows );
+	int first = VIPS_MAX( 0, row0 - jpeg->context_rows );
+	int last = VIPS_MIN( jpeg->mcus_down, 
+		row1 + (jpeg->context_rows ? 1 : 0) );
+
+	/* Output lines we decode, and the range we keep.
+	 */
+	int start = first * jpeg->mcu_height / jpeg->shrink;
+	int top = VIPS_MAX( r->top, row0 * jpeg->mcu_height / jpeg->shrink );
+	int bottom = VIPS_MIN( VIPS_RECT_BOTTOM( r ), 
+		row1 * jpeg->mcu_height / jpeg->shrink );
+
+	struct jpeg_decompress_struct cinfo;
+	ErrorManager eman;
+	struct jpeg_source_mgr src;
+	VipsPel *buf;
+	size_t length;
+	VipsPel *line;
+	int x, y;
+
+	if( !(buf = read_jpeg_chunk_build( jpeg, first, last, &length )) )
+		return( -1 );
+	if( !(line = vips_malloc( NULL, sz )) ) {
+		g_free( buf );
+		return( -1 );
+	}
+
+	cinfo.err = jpeg_std_error( &eman.pub );
+	eman.pub.error_exit = vips__new_error_exit;
+	eman.pub.output_message = vips__new_output_message;
+	eman.fp = NULL;
+	cinfo.client_data = jpeg->cinfo.client_data;
+
+	/* Here for longjmp() from vips__new_error_exit().
+	 */
+	if( setjmp( eman.jmp ) ) {
+		jpeg_destroy_decompress( &cinfo );
+		g_free( line );
+		g_free( buf );
+
+		return( -1 );
+	}
+
+	jpeg_create_decompress( &cinfo );
+	src.init_source = chunk_init_source;
+	src.fill_input_buffer = chunk_fill_input_buffer;
+	src.skip_input_data = chunk_skip_input_data;
+	src.resync_to_restart = jpeg_resync_to_restart;
+	src.term_source = chunk_init_source;
+	src.next_input_byte = buf;
+	src.bytes_in_buffer = length;
+	cinfo.src = &src;
+
+	jpeg_read_header( &cinfo, TRUE );
+	cinfo.scale_denom = jpeg->shrink;
+	cinfo.scale_num = 1;
+	jpeg_start_decompress( &cinfo );
+
+	for( y = start; y < bottom; y++ ) {
+		JSAMPROW row_pointer[1];
+
+		if( y < top ) 
+			row_pointer[0] = (JSAMPLE *) line;
+		else
+			row_pointer[0] = (JSAMPLE *) 
+				VIPS_REGION_ADDR( or, 0, y );
+
+		jpeg_read_scanlines( &cinfo, &row_pointer[0], 1 );
+
+		if( y >= top &&
+			jpeg->invert_pels ) 
+			for( x = 0; x < sz; x++ )
+				row_pointer[0][x] = 255 - row_pointer[0][x];
+	}
+
+	jpeg_destroy_decompress( &cinfo );
+	g_free( line );
+	g_free( buf );
+
+	/* libjpeg warnings are used for serious image corruption, and the
+	 * message is already in the error log.
+	 */
+	if( eman.pub.num_warnings > 0 &&
+		jpeg->fail ) 
+		return( -1 );
+
+	return( 0 );
+}
+
+/* A band of chunks being decoded in parallel.
+ */
+typedef struct _ReadJpegBand {
+	ReadJpeg *jpeg;
+	VipsRegion *or;
+
+	/* The next chunk to decode, and one beyond the last.
+	 */
+	int chunk;
+	int end;
+} ReadJpegBand;
+
+static int
+read_jpeg_band_allocate( VipsThreadState *state, void *a, gboolean *stop )
+{
+	ReadJpegBand *band = (ReadJpegBand *) a;
+
+	if( band->chunk >= band->end ) {
+		*stop = TRUE;
+		return( 0 );
+	}
+
+	state->x = band->chunk;
+	band->chunk += 1;
+
+	return( 0 );
+}
+
+static int
+read_jpeg_band_work( VipsThreadState *state, void *a )
+{
+	ReadJpegBand *band = (ReadJpegBand *) a;
+
+	int result;
+
+	VIPS_GATE_START( "read_jpeg_band_work: work" );
+
+	result = read_jpeg_chunk( band->jpeg, band->or, state->x );
+
+	VIPS_GATE_STOP( "read_jpeg_band_work: work" );
+
+	return( result );
+}
+
+/* Decode a band of lines, one chunk per thread. 
+ */
+static int
+read_jpeg_generate_restart( VipsRegion *or, 
+	void *seq, void *a, void *b, gboolean *stop )
+{
+        VipsRect *r = &or->valid;
+	ReadJpeg *jpeg = (ReadJpeg *) a;
+	int chunk_height = jpeg->chunk_rows * jpeg->mcu_height / jpeg->shrink;
+
+	ReadJpegBand band;
+
+#ifdef DEBUG_VERBOSE
+	printf( "read_jpeg_generate_restart: %p line %d, %d rows\n", 
+		g_thread_self(), r->top, r->height );
+#endif /*DEBUG_VERBOSE*/
+
+	/* We're inside a sequential where tiles are the full image width.
+	 */
+	g_assert( r->left == 0 );
+	g_assert( r->width == or->im->Xsize );
+
+	band.jpeg = jpeg;
+	band.or = or;
+	band.chunk = r->top / chunk_height;
+	band.end = VIPS_ROUND_UP( VIPS_RECT_BOTTOM( r ), chunk_height ) / 
+		chunk_height;
+
+	return( vips_threadpool_run( or->im, 
+		vips_thread_state_new, 
+		read_jpeg_band_allocate, read_jpeg_band_work, 
+		NULL, &band ) );
+}
+
+/* Autorotate decodes this many scanlines at a time.
+ */
+#define READ_JPEG_ROTATE_STRIP (32)
+
+/* Decode the whole image to @out, a memory image, rotating and flipping 
+ * each line as we go to match vips_autorot(). This is the fallback for 
+ * orientations read_jpeg_dct_rotate() can't do.
+ *
+ * Any rotation needs the whole image before the first output line is 
+ * known, so we can't stay sequential, but this saves a copy and a 
+ * separate rotate pass over the decoded image.
+ *
+ * We decode strips of READ_JPEG_ROTATE_STRIP scanlines. Flips write each 
+ * line straight out, 90 and 270 transpose the strip in blocks, so we 
+ * don't stride a whole output line for every pixel.
+ */
+static int
+read_jpeg_rotate( ReadJpeg *jpeg, VipsImage *in, VipsImage *out )
+{
+	struct jpeg_decompress_struct *cinfo = &jpeg->cinfo;
+	int orientation = vips_image_get_orientation( in );
+	int width = jpeg->output_width;
+	int height = jpeg->output_height;
+	int sz = cinfo->output_width * cinfo->output_components;
+	int ps = VIPS_IMAGE_SIZEOF_PEL( in );
+
+	/* Input (x, y) goes to output (ax * x + bx * y + cx, 
+	 * ay * x + by * y + cy).
+	 */
+	int ax, bx, cx;
+	int ay, by, cy;
+
+	VipsPel *strip;
+	int x, y, i, n;
+
+	ax = 1; bx = 0; cx = 0;
+	ay = 0; by = 1; cy = 0;
+	switch( orientation ) {
+	case 2:
+		ax = -1; cx = width - 1;
+		break;
+
+	case 3:
+		ax = -1; cx = width - 1;
+		by = -1; cy = height - 1;
+		break;
+
+	case 4:
+		by = -1; cy = height - 1;
+		break;
+
+	case 5:
+		ax = 0; bx = 1; 
+		ay = 1; by = 0;
+		break;
+
+	case 6:
+		ax = 0; bx = -1; cx = height - 1;
+		ay = 1; by = 0;
+		break;
+
+	case 7:
+		ax = 0; bx = -1; cx = height - 1;
+		ay = -1; by = 0; cy = width - 1;
+		break;
+
+	case 8:
+		ax = 0; bx = 1;
+		ay = -1; by = 0; cy = width - 1;
+		break;
+
+	default:
+		break;
+	}
+
+	if( vips_image_pipelinev( out, VIPS_DEMAND_STYLE_THINSTRIP, 
+		in, NULL ) )
+		return( -1 );
+	out->Xsize = width;
+	out->Ysize = height;
+	if( vips_image_get_orientation_swap( in ) ) 
+		VIPS_SWAP( int, out->Xsize, out->Ysize );
+	vips_autorot_remove_angle( out ); 
+	if( vips_image_write_prepare( out ) ||
+		!(strip = VIPS_ARRAY( out, 
+			READ_JPEG_ROTATE_STRIP * sz, VipsPel )) )
+		return( -1 );
+
+	for( y = 0; y < height; y += n ) {
+		n = VIPS_MIN( READ_JPEG_ROTATE_STRIP, height - y );
+
+		for( i = 0; i < n; i++ ) {
+			VipsPel *line = strip + i * sz;
+			JSAMPROW row_pointer[1];
+
+			row_pointer[0] = (JSAMPLE *) line;
+			jpeg_read_scanlines( cinfo, &row_pointer[0], 1 );
+			jpeg->y_pos += 1; 
+
+			if( jpeg->eman.pub.num_warnings > 0 &&
+				jpeg->fail ) 
+				return( -1 );
+
+			if( jpeg->invert_pels ) 
+				for( x = 0; x < sz; x++ )
+					line[x] = 255 - line[x];
+		}
+
+		if( bx != 0 ) {
+			/* Strip lines y to y + n - 1 become output columns,
+			 * input columns become output lines. 
+			 */
+			int left = bx > 0 ? y + cx : cx - (y + n - 1);
+			VipsPel *p = strip + 
+				(bx > 0 ? 0 : (n - 1) * sz) +
+				(ay > 0 ? 0 : (width - 1) * ps);
+
+			vips__rot_transpose( VIPS_IMAGE_ADDR( out, left, 0 ),
+				VIPS_IMAGE_SIZEOF_LINE( out ),
+				p, bx * sz, ay * ps,
+				n, width, ps );
+		}
+		else 
+			for( i = 0; i < n; i++ ) {
+				VipsPel *p = strip + i * sz;
+				VipsPel *q = VIPS_IMAGE_ADDR( out, 
+					cx, by * (y + i) + cy );
+
+				if( ax > 0 )
+					memcpy( q, p, width * ps );
+				else 
+					for( x = 0; x < width; x++ ) {
+						int j;
+
+						for( j = 0; j < ps; j++ )
+							q[j] = p[j];
+
+						p += ps;
+						q -= ps;
+					}
+			}
+	}
+
+	return( 0 );
+}
+
+/* Rotate the DCT coefficients of the whole file with 
+ * vips_jpegtran_source(), and set @rotated to a source for the result. We 
+ * can then decode that sequentially, and we only hold the compressed 
+ * file, not the decoded image.
+ *
+ * jpegtran can only rotate, and it trims partial MCUs from any edge which 
+ * moves to the left or top, so for flips, or if the image has a partial 
+ * MCU on such an edge, set @rotated to NULL and the caller falls back to 
+ * read_jpeg_rotate().
+ */
+static int
+read_jpeg_dct_rotate( ReadJpeg *jpeg, VipsImage *in, VipsSource **rotated )
+{
+	struct jpeg_decompress_struct *cinfo = &jpeg->cinfo;
+	int mcu_width = cinfo->num_components == 1 ? 
+		DCTSIZE : cinfo->max_h_samp_factor * DCTSIZE;
+	int mcu_height = cinfo->num_components == 1 ? 
+		DCTSIZE : cinfo->max_v_samp_factor * DCTSIZE;
+	gboolean whole_width = cinfo->image_width % mcu_width == 0;
+	gboolean whole_height = cinfo->image_height % mcu_height == 0;
+
+	VipsAngle angle;
+	VipsTarget *target;
+	VipsBlob *blob;
+
+	*rotated = NULL;
+
+	switch( vips_image_get_orientation( in ) ) {
+	case 3:
+		if( !whole_width ||
+			!whole_height )
+			return( 0 );
+		angle = VIPS_ANGLE_D180;
+		break;
+
+	case 6:
+		if( !whole_height )
+			return( 0 );
+		angle = VIPS_ANGLE_D90;
+		break;
+
+	case 8:
+		if( !whole_width )
+			return( 0 );
+		angle = VIPS_ANGLE_D270;
+		break;
+
+	default:
+		return( 0 );
+	}
+
+	if( !(target = vips_target_new_to_memory()) )
+		return( -1 );
+	if( vips_jpegtran_source( jpeg->source, target, 
+		"angle", angle,
+		NULL ) ) {
+		VIPS_UNREF( target );
+		return( -1 );
+	}
+	g_object_get( target, "blob", &blob, NULL );
+	*rotated = vips_source_new_from_blob( blob );
+	vips_area_unref( VIPS_AREA( blob ) );
+	VIPS_UNREF( target );
+	if( !*rotated )
+		return( -1 );
+
+	return( 0 );
+}
+
 /* Read a cinfo to a VIPS image.
  */
 static int
@@ -847,6 +1569,7 @@ read_jpeg_image( ReadJpeg *jpeg, VipsImage *out )
 		vips_object_local_array( VIPS_OBJECT( out ), 5 );
 
 	VipsImage *im;
+	VipsSource *rotated;
 
 	/* Here for longjmp() from vips__new_error_exit().
 	 */
@@ -857,35 +1580,91 @@ read_jpeg_image( ReadJpeg *jpeg, VipsImage *out )
 	if( read_jpeg_header( jpeg, t[0] ) )
 		return( -1 );
 
-	jpeg_start_decompress( cinfo );
+	rotated = NULL;
+	if( jpeg->autorotate &&
+		read_jpeg_dct_rotate( jpeg, t[0], &rotated ) )
+		return( -1 );
+
+	if( rotated ) {
+		int result;
+
+		/* The rotated file has the same markers, including the 
+		 * orientation, so load it without autorotate and then drop 
+		 * the tag. libjpeg writes a new JFIF header, so take the 
+		 * resolution from the original. vips_autorot() doesn't swap
+		 * it, so we don't either.
+		 */
+		t[4] = vips_image_new();
+		result = vips__jpeg_read_source( rotated, t[4], 
+			FALSE, jpeg->shrink, jpeg->fail, FALSE );
+		VIPS_UNREF( rotated );
+		if( result )
+			return( -1 );
+
+		vips_autorot_remove_angle( t[4] ); 
+		t[4]->Xres = t[0]->Xres;
+		t[4]->Yres = t[0]->Yres;
+		im = t[4];
+	}
+	else if( jpeg->autorotate &&
+		vips_image_get_orientation( t[0] ) != 1 ) {
+		jpeg_start_decompress( cinfo );
+
+		/* Rotating needs random access, so we decode to memory, 
+		 * rotating as we go.
+		 */
+		t[3] = vips_image_new_memory();
+		if( read_jpeg_rotate( jpeg, t[0], t[3] ) )
+			return( -1 );
+		im = t[3];
+	}
+	else if( readjpeg_restart( jpeg ) ) {
+		int chunk_height = 
+			jpeg->chunk_rows * jpeg->mcu_height / jpeg->shrink;
 
 #ifdef DEBUG
-	printf( "read_jpeg_image: starting decompress\n" );
+		printf( "read_jpeg_image: starting restart decompress\n" );
 #endif /*DEBUG*/
 
+		/* Each tile of the sequential is a band of chunks, one per
+		 * thread.
+		 */
+		if( vips_image_generate( t[0], 
+			NULL, read_jpeg_generate_restart, NULL, 
+			jpeg, NULL ) ||
+			vips_sequential( t[0], &t[1], 
+				"tile_height", 
+					chunk_height * vips_concurrency_get(),
+				NULL ) ||
+			vips_extract_area( t[1], &t[2], 
+				0, 0, 
+				jpeg->output_width, jpeg->output_height, 
+				NULL ) )
+			return( -1 );
+		im = t[2];
+	}
 	/* We must crop after the seq, or our generate may not be asked for
 	 * full lines of pixels and will attempt to write beyond the buffer.
 	 */
-	if( vips_image_generate( t[0], 
-		NULL, read_jpeg_generate, NULL, 
-		jpeg, NULL ) ||
-		vips_sequential( t[0], &t[1], 
-			"tile_height", 8,
-			NULL ) ||
-		vips_extract_area( t[1], &t[2], 
-			0, 0, jpeg->output_width, jpeg->output_height, NULL ) )
-		return( -1 );
-	im = t[2];
+	else {
+		jpeg_start_decompress( cinfo );
 
-	if( jpeg->autorotate &&
-		vips_image_get_orientation( im ) != 1 ) {
-		/* We have to copy to memory before calling autorot, since it
-		 * needs random access.
-		 */
-		if( !(t[3] = vips_image_copy_memory( im )) ||
-			vips_autorot( t[3], &t[4], NULL ) )
+#ifdef DEBUG
+		printf( "read_jpeg_image: starting decompress\n" );
+#endif /*DEBUG*/
+
+		if( vips_image_generate( t[0], 
+			NULL, read_jpeg_generate, NULL, 
+			jpeg, NULL ) ||
+			vips_sequential( t[0], &t[1], 
+				"tile_height", 8,
+				NULL ) ||
+			vips_extract_area( t[1], &t[2], 
+				0, 0, 
+				jpeg->output_width, jpeg->output_height, 
+				NULL ) )
 			return( -1 );
-		im = t[4];
+		im = t[2];
 	}
 
 	if( vips_image_write( im, out ) )
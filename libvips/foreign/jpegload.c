@@ -441,6 +441,10 @@ vips_foreign_load_jpeg_buffer_init( VipsForeignLoadJpegBuffer *buffer )
  * Read a JPEG file into a VIPS image. It can read most 8-bit JPEG images, 
  * including CMYK and YCbCr.
  *
+ * Baseline JPEGs with restart markers, as written by most cameras and
+ * scanners, are decoded in parallel if the file can be mapped. Each
+ * thread decodes a chunk of lines which starts on a restart marker. 
+ *
  * @shrink means shrink by this integer factor during load.  Possible values 
  * are 1, 2, 4 and 8. Shrinking during read is very much faster than 
  * decompressing the whole image and then shrinking later.
@@ -451,7 +455,10 @@ vips_foreign_load_jpeg_buffer_init( VipsForeignLoadJpegBuffer *buffer )
  *
  * Setting @autorotate to %TRUE will make the loader interpret the 
  * orientation tag and automatically rotate the image appropriately during
- * load. 
+ * load. Rotations by 90, 180 or 270 degrees of images which are a whole 
+ * number of MCUs along the edges that move are done losslessly on the 
+ * compressed data, and the result is decoded sequentially. Other 
+ * orientations are decoded to memory. 
  *
  * If @autorotate is %FALSE, the metadata field #VIPS_META_ORIENTATION is set 
  * to the value of the orientation tag. Applications may read and interpret 
@@ -4,6 +4,8 @@
  * 	- wrap a class around the jpeg writer
  * 18/2/20 Elad-Laufer
  * 	- add subsample_mode, deprecate no_subsample
+ * 18/10/26
+ * 	- add restart_interval
  */
 
 /*
@@ -103,6 +105,10 @@ typedef struct _VipsForeignSaveJpeg {
 	 */
 	int quant_table;
 
+	/* Add restart markers every this many MCUs.
+	 */
+	int restart_interval;
+
 } VipsForeignSaveJpeg;
 
 typedef VipsForeignSaveClass VipsForeignSaveJpegClass;
@@ -231,6 +237,13 @@ vips_foreign_save_jpeg_class_init( VipsForeignSaveJpegClass *class )
 		G_STRUCT_OFFSET( VipsForeignSaveJpeg, subsample_mode ),
 		VIPS_TYPE_FOREIGN_JPEG_SUBSAMPLE,
 		VIPS_FOREIGN_JPEG_SUBSAMPLE_AUTO );
+
+	VIPS_ARG_INT( class, "restart_interval", 20,
+		_( "Restart interval" ),
+		_( "Add restart markers every specified number of MCUs" ),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET( VipsForeignSaveJpeg, restart_interval ),
+		0, 65535, 0 );
 }
 
 static void
@@ -268,7 +281,8 @@ vips_foreign_save_jpeg_target_build( VipsObject *object )
 		jpeg->Q, jpeg->profile, jpeg->optimize_coding, 
 		jpeg->interlace, save->strip, jpeg->trellis_quant,
 		jpeg->overshoot_deringing, jpeg->optimize_scans,
-		jpeg->quant_table, jpeg->subsample_mode ) )
+		jpeg->quant_table, jpeg->subsample_mode, 
+		jpeg->restart_interval ) )
 		return( -1 );
 
 	return( 0 );
@@ -334,7 +348,8 @@ vips_foreign_save_jpeg_file_build( VipsObject *object )
 		jpeg->Q, jpeg->profile, jpeg->optimize_coding, 
 		jpeg->interlace, save->strip, jpeg->trellis_quant,
 		jpeg->overshoot_deringing, jpeg->optimize_scans,
-		jpeg->quant_table, jpeg->subsample_mode ) ) {
+		jpeg->quant_table, jpeg->subsample_mode, 
+		jpeg->restart_interval ) ) {
 		VIPS_UNREF( target );
 		return( -1 );
 	}
@@ -404,7 +419,8 @@ vips_foreign_save_jpeg_buffer_build( VipsObject *object )
 		jpeg->Q, jpeg->profile, jpeg->optimize_coding, 
 		jpeg->interlace, save->strip, jpeg->trellis_quant,
 		jpeg->overshoot_deringing, jpeg->optimize_scans,
-		jpeg->quant_table, jpeg->subsample_mode ) ) {
+		jpeg->quant_table, jpeg->subsample_mode, 
+		jpeg->restart_interval ) ) {
 		VIPS_UNREF( target );
 		return( -1 );
 	}
@@ -477,7 +493,8 @@ vips_foreign_save_jpeg_mime_build( VipsObject *object )
 		jpeg->Q, jpeg->profile, jpeg->optimize_coding, 
 		jpeg->interlace, save->strip, jpeg->trellis_quant,
 		jpeg->overshoot_deringing, jpeg->optimize_scans,
-		jpeg->quant_table, jpeg->subsample_mode ) ) {
+		jpeg->quant_table, jpeg->subsample_mode, 
+		jpeg->restart_interval ) ) {
 		VIPS_UNREF( target );
 		return( -1 );
 	}
@@ -534,6 +551,7 @@ vips_foreign_save_jpeg_mime_init( VipsForeignSaveJpegMime *mime )
  * * @overshoot_deringing: %gboolean, overshoot samples with extreme values
  * * @optimize_scans: %gboolean, split DCT coefficients into separate scans
  * * @quant_table: %gint, quantization table index
+ * * @restart_interval: %gint, restart interval in MCUs
  *
  * Write a VIPS image to a file as JPEG.
  *
@@ -604,6 +622,13 @@ vips_foreign_save_jpeg_mime_init( VipsForeignSaveJpegMime *mime )
  * For maximum compression with mozjpeg, a useful set of options is `strip, 
  * optimize-coding, interlace, optimize-scans, trellis-quant, quant_table=3`.
  *
+ * Set @restart_interval to add a restart marker every that many MCUs (8x8
+ * or 16x16 pixel blocks). Decoders can use these to recover from errors, 
+ * or to decode in parallel. If the output is baseline and
+ * @optimize_coding is off, bands of the image will also be compressed in 
+ * parallel. This works best if @restart_interval is a factor or a multiple
+ * of the number of MCUs across the image.
+ *
  * The image is automatically converted to RGB, Monochrome or CMYK before 
  * saving. 
  *
@@ -650,6 +675,7 @@ vips_jpegsave( VipsImage *in, const char *filename, ... )
  * * @overshoot_deringing: %gboolean, overshoot samples with extreme values
  * * @optimize_scans: %gboolean, split DCT coefficients into separate scans
  * * @quant_table: %gint, quantization table index
+ * * @restart_interval: %gint, restart interval in MCUs
  *
  * As vips_jpegsave(), but save to a target.
  *
@@ -689,6 +715,7 @@ vips_jpegsave_target( VipsImage *in, VipsTarget *target, ... )
  * * @overshoot_deringing: %gboolean, overshoot samples with extreme values
  * * @optimize_scans: %gboolean, split DCT coefficients into separate scans
  * * @quant_table: %gint, quantization table index
+ * * @restart_interval: %gint, restart interval in MCUs
  *
  * As vips_jpegsave(), but save to a memory buffer. 
  *
@@ -745,6 +772,7 @@ vips_jpegsave_buffer( VipsImage *in, void **buf, size_t *len, ... )
  * * @overshoot_deringing: %gboolean, overshoot samples with extreme values
  * * @optimize_scans: %gboolean, split DCT coefficients into separate scans
  * * @quant_table: %gint, quantization table index
+ * * @restart_interval: %gint, restart interval in MCUs
  *
  * As vips_jpegsave(), but save as a mime jpeg on stdout.
  *
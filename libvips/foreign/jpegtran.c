@@ -0,0 +1,695 @@
+/* lossless crop and rotate of jpeg sources
+ *
+ * 18/10/26
+ * 	- first version, based on the transforms in jpegtran
+ */
+
+/*
+
+    This file is part of VIPS.
+
+    VIPS is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301  USA
+
+ */
+
+/*
+
+    These files are distributed with VIPS - http://www.vips.ecs.soton.ac.uk
+
+ */
+
+/*
+#define DEBUG
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /*HAVE_CONFIG_H*/
+#include <vips/intl.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+
+#include <vips/vips.h>
+#include <vips/internal.h>
+
+#include "pforeign.h"
+
+#ifdef HAVE_JPEG
+
+#include "jpeg.h"
+
+typedef struct _VipsForeignJpegtranSource {
+	VipsOperation parent_object;
+
+	/* Read from here, write to there.
+	 */
+	VipsSource *source;
+	VipsTarget *target;
+
+	/* Rotate by this, after cropping.
+	 */
+	VipsAngle angle;
+
+	/* The crop area, in input coordinates. width and height of zero
+	 * mean to the right and bottom edges.
+	 */
+	int left;
+	int top;
+	int width;
+	int height;
+
+	/* Drop all APP and COM markers.
+	 */
+	gboolean strip;
+
+	/* Write a progressive file.
+	 */
+	gboolean interlace;
+
+	/* Compute optimal Huffman coding tables.
+	 */
+	gboolean optimize_coding;
+
+} VipsForeignJpegtranSource;
+
+typedef VipsOperationClass VipsForeignJpegtranSourceClass;
+
+G_DEFINE_TYPE( VipsForeignJpegtranSource, vips_foreign_jpegtran_source,
+	VIPS_TYPE_OPERATION );
+
+/* State during a transform.
+ */
+typedef struct _Jpegtran {
+	VipsForeignJpegtranSource *jpegtran;
+
+	struct jpeg_decompress_struct srcinfo;
+	struct jpeg_compress_struct dstinfo;
+	ErrorManager eman;
+
+	/* The size of an MCU in pixels, and the crop area, snapped to the
+	 * MCU grid.
+	 */
+	int mcu_width;
+	int mcu_height;
+	int left;
+	int top;
+	int width;
+	int height;
+
+	/* Output coefficients, plus the size of each component in blocks.
+	 */
+	jvirt_barray_ptr *dst_coef;
+	int *dst_cols;
+	int *dst_rows;
+} Jpegtran;
+
+/* Does an angle swap width and height.
+ */
+#define SWAPS( ANGLE ) \
+	((ANGLE) == VIPS_ANGLE_D90 || (ANGLE) == VIPS_ANGLE_D270)
+
+/* Work out the crop area. Left and top must be on the MCU grid, so we round
+ * them down. Rotation moves the right or bottom edge to the left or top,
+ * so those edges must be whole MCUs and we trim off any partial ones, as
+ * jpegtran -trim does.
+ */
+static int
+jpegtran_geometry( Jpegtran *tran )
+{
+	VipsForeignJpegtranSource *jpegtran = tran->jpegtran;
+	VipsObjectClass *class = VIPS_OBJECT_GET_CLASS( jpegtran );
+	j_decompress_ptr srcinfo = &tran->srcinfo;
+	VipsAngle angle = jpegtran->angle;
+	int image_width = srcinfo->image_width;
+	int image_height = srcinfo->image_height;
+
+	int left;
+	int top;
+
+	/* Single-component images are not interleaved, so their MCU is
+	 * always a single block.
+	 */
+	if( srcinfo->num_components == 1 ) {
+		tran->mcu_width = DCTSIZE;
+		tran->mcu_height = DCTSIZE;
+	}
+	else {
+		tran->mcu_width = srcinfo->max_h_samp_factor * DCTSIZE;
+		tran->mcu_height = srcinfo->max_v_samp_factor * DCTSIZE;
+	}
+
+	tran->width = jpegtran->width == 0 ?
+		image_width - jpegtran->left : jpegtran->width;
+	tran->height = jpegtran->height == 0 ?
+		image_height - jpegtran->top : jpegtran->height;
+	if( tran->width <= 0 ||
+		tran->height <= 0 ||
+		jpegtran->left + tran->width > image_width ||
+		jpegtran->top + tran->height > image_height ) {
+		vips_error( class->nickname, "%s", _( "bad crop area" ) );
+		return( -1 );
+	}
+
+	left = VIPS_ROUND_DOWN( jpegtran->left, tran->mcu_width );
+	top = VIPS_ROUND_DOWN( jpegtran->top, tran->mcu_height );
+	tran->width += jpegtran->left - left;
+	tran->height += jpegtran->top - top;
+	tran->left = left;
+	tran->top = top;
+
+	if( angle == VIPS_ANGLE_D180 ||
+		angle == VIPS_ANGLE_D270 )
+		tran->width = VIPS_ROUND_DOWN( tran->width, tran->mcu_width );
+	if( angle == VIPS_ANGLE_D90 ||
+		angle == VIPS_ANGLE_D180 )
+		tran->height = VIPS_ROUND_DOWN( tran->height, tran->mcu_height );
+	if( tran->width == 0 ||
+		tran->height == 0 ) {
+		vips_error( class->nickname,
+			"%s", _( "crop area smaller than one MCU" ) );
+		return( -1 );
+	}
+
+#ifdef DEBUG
+	printf( "jpegtran_geometry: mcu %d x %d, "
+		"crop left = %d, top = %d, width = %d, height = %d\n",
+		tran->mcu_width, tran->mcu_height,
+		tran->left, tran->top, tran->width, tran->height );
+#endif /*DEBUG*/
+
+	return( 0 );
+}
+
+/* Ask for the output coefficient arrays. This must be done before
+ * jpeg_read_coefficients() realizes the input ones.
+ */
+static void
+jpegtran_request( Jpegtran *tran )
+{
+	j_decompress_ptr srcinfo = &tran->srcinfo;
+	VipsAngle angle = tran->jpegtran->angle;
+	int n = srcinfo->num_components;
+	int out_width = SWAPS( angle ) ? tran->height : tran->width;
+	int out_height = SWAPS( angle ) ? tran->width : tran->height;
+	int mcu_width = SWAPS( angle ) ? tran->mcu_height : tran->mcu_width;
+	int mcu_height = SWAPS( angle ) ? tran->mcu_width : tran->mcu_height;
+
+	int i;
+
+	tran->dst_coef = (jvirt_barray_ptr *)
+		(*srcinfo->mem->alloc_small)( (j_common_ptr) srcinfo,
+			JPOOL_IMAGE, n * sizeof( jvirt_barray_ptr ) );
+	tran->dst_cols = (int *)
+		(*srcinfo->mem->alloc_small)( (j_common_ptr) srcinfo,
+			JPOOL_IMAGE, n * sizeof( int ) );
+	tran->dst_rows = (int *)
+		(*srcinfo->mem->alloc_small)( (j_common_ptr) srcinfo,
+			JPOOL_IMAGE, n * sizeof( int ) );
+
+	/* Each component is padded out to a whole number of MCUs, as
+	 * libjpeg expects.
+	 */
+	for( i = 0; i < n; i++ ) {
+		jpeg_component_info *comp = &srcinfo->comp_info[i];
+		int h = n == 1 ? 1 : comp->h_samp_factor;
+		int v = n == 1 ? 1 : comp->v_samp_factor;
+
+		if( SWAPS( angle ) )
+			VIPS_SWAP( int, h, v );
+
+		tran->dst_cols[i] = h * 
+			((out_width + mcu_width - 1) / mcu_width);
+		tran->dst_rows[i] = v * 
+			((out_height + mcu_height - 1) / mcu_height);
+		tran->dst_coef[i] = (*srcinfo->mem->request_virt_barray)
+			( (j_common_ptr) srcinfo, JPOOL_IMAGE, FALSE,
+			  tran->dst_cols[i], tran->dst_rows[i], v );
+	}
+}
+
+/* Transform the coefficients of a single block. Flipping a block negates the
+ * odd frequencies along that axis. u is horizontal frequency, v vertical.
+ */
+static void
+jpegtran_block( JCOEFPTR out, JCOEFPTR in, VipsAngle angle )
+{
+	int u, v;
+
+	switch( angle ) {
+	case VIPS_ANGLE_D0:
+		memcpy( out, in, sizeof( JBLOCK ) );
+		break;
+
+	case VIPS_ANGLE_D90:
+		/* Transpose, then flip left-right.
+		 */
+		for( v = 0; v < DCTSIZE; v++ )
+			for( u = 0; u < DCTSIZE; u++ ) 
+				out[v * DCTSIZE + u] = (u & 1) ?
+					-in[u * DCTSIZE + v] : 
+					in[u * DCTSIZE + v];
+		break;
+
+	case VIPS_ANGLE_D180:
+		for( v = 0; v < DCTSIZE; v++ )
+			for( u = 0; u < DCTSIZE; u++ ) 
+				out[v * DCTSIZE + u] = ((u ^ v) & 1) ?
+					-in[v * DCTSIZE + u] : 
+					in[v * DCTSIZE + u];
+		break;
+
+	case VIPS_ANGLE_D270:
+		/* Transpose, then flip top-bottom.
+		 */
+		for( v = 0; v < DCTSIZE; v++ )
+			for( u = 0; u < DCTSIZE; u++ ) 
+				out[v * DCTSIZE + u] = (v & 1) ?
+					-in[u * DCTSIZE + v] : 
+					in[u * DCTSIZE + v];
+		break;
+
+	default:
+		g_assert_not_reached();
+	}
+}
+
+/* Fill the output coefficient arrays from the input ones. Blocks in the
+ * padding around the output which have no input block are zeroed.
+ */
+static void
+jpegtran_blocks( Jpegtran *tran, jvirt_barray_ptr *src_coef )
+{
+	j_decompress_ptr srcinfo = &tran->srcinfo;
+	VipsAngle angle = tran->jpegtran->angle;
+	int n = srcinfo->num_components;
+
+	int i;
+
+	for( i = 0; i < n; i++ ) {
+		jpeg_component_info *comp = &srcinfo->comp_info[i];
+		int h = n == 1 ? 1 : comp->h_samp_factor;
+		int v = n == 1 ? 1 : comp->v_samp_factor;
+
+		/* The crop area in blocks. The right and bottom edges are
+		 * only used by transforms which flip that axis, and then
+		 * they are on the MCU grid.
+		 */
+		int left = tran->left / tran->mcu_width * h;
+		int top = tran->top / tran->mcu_height * v;
+		int right = left + tran->width / tran->mcu_width * h - 1;
+		int bottom = top + tran->height / tran->mcu_height * v - 1;
+
+		int x, y;
+
+		for( y = 0; y < tran->dst_rows[i]; y++ ) {
+			JBLOCKROW out = (*srcinfo->mem->access_virt_barray)
+				( (j_common_ptr) srcinfo, tran->dst_coef[i],
+				  y, 1, TRUE )[0];
+
+			for( x = 0; x < tran->dst_cols[i]; x++ ) {
+				int sx, sy;
+
+				switch( angle ) {
+				case VIPS_ANGLE_D0:
+					sx = left + x;
+					sy = top + y;
+					break;
+
+				case VIPS_ANGLE_D90:
+					sx = left + y;
+					sy = bottom - x;
+					break;
+
+				case VIPS_ANGLE_D180:
+					sx = right - x;
+					sy = bottom - y;
+					break;
+
+				case VIPS_ANGLE_D270:
+					sx = right - y;
+					sy = top + x;
+					break;
+
+				default:
+					g_assert_not_reached();
+
+					/* Stop compiler warnings.
+					 */
+					sx = 0;
+					sy = 0;
+				}
+
+				if( sx >= 0 &&
+					sy >= 0 &&
+					sx < (int) comp->width_in_blocks &&
+					sy < (int) comp->height_in_blocks ) {
+					JBLOCKROW in = 
+						(*srcinfo->mem->access_virt_barray)
+						( (j_common_ptr) srcinfo, 
+						  src_coef[i], sy, 1, FALSE )[0];
+
+					jpegtran_block( out[x], in[sx], angle );
+				}
+				else
+					memset( out[x], 0, sizeof( JBLOCK ) );
+			}
+		}
+	}
+}
+
+/* Copy the APP and COM markers we saved, except for any JFIF and Adobe 
+ * markers libjpeg will write for us.
+ */
+static void
+jpegtran_markers( Jpegtran *tran )
+{
+	j_compress_ptr dstinfo = &tran->dstinfo;
+
+	jpeg_saved_marker_ptr marker;
+
+	for( marker = tran->srcinfo.marker_list; 
+		marker; marker = marker->next ) {
+		if( dstinfo->write_JFIF_header &&
+			marker->marker == JPEG_APP0 &&
+			marker->data_length >= 5 &&
+			memcmp( marker->data, "JFIF", 5 ) == 0 )
+			continue;
+		if( dstinfo->write_Adobe_marker &&
+			marker->marker == JPEG_APP0 + 14 &&
+			marker->data_length >= 5 &&
+			memcmp( marker->data, "Adobe", 5 ) == 0 )
+			continue;
+
+		jpeg_write_marker( dstinfo, marker->marker, 
+			marker->data, marker->data_length );
+	}
+}
+
+static void
+jpegtran_transpose_quant( JQUANT_TBL *table )
+{
+	int u, v;
+
+	for( v = 0; v < DCTSIZE; v++ )
+		for( u = v + 1; u < DCTSIZE; u++ )
+			VIPS_SWAP( UINT16, 
+				table->quantval[v * DCTSIZE + u],
+				table->quantval[u * DCTSIZE + v] );
+}
+
+static int
+jpegtran_transform( Jpegtran *tran )
+{
+	VipsForeignJpegtranSource *jpegtran = tran->jpegtran;
+	j_decompress_ptr srcinfo = &tran->srcinfo;
+	j_compress_ptr dstinfo = &tran->dstinfo;
+
+	jvirt_barray_ptr *src_coef;
+	int i;
+
+	if( vips_source_rewind( jpegtran->source ) )
+		return( -1 );
+	vips__jpeg_source_src( srcinfo, jpegtran->source );
+
+	if( !jpegtran->strip ) {
+		jpeg_save_markers( srcinfo, JPEG_COM, 0xffff );
+		for( i = 0; i < 16; i++ ) 
+			jpeg_save_markers( srcinfo, JPEG_APP0 + i, 0xffff );
+	}
+
+	jpeg_read_header( srcinfo, TRUE );
+	if( jpegtran_geometry( tran ) )
+		return( -1 );
+	jpegtran_request( tran );
+	src_coef = jpeg_read_coefficients( srcinfo );
+	jpegtran_blocks( tran, src_coef );
+
+	/* Same quant tables, colourspace and sampling as the input.
+	 */
+	jpeg_copy_critical_parameters( srcinfo, dstinfo );
+	if( SWAPS( jpegtran->angle ) ) {
+		dstinfo->image_width = tran->height;
+		dstinfo->image_height = tran->width;
+	}
+	else {
+		dstinfo->image_width = tran->width;
+		dstinfo->image_height = tran->height;
+	}
+	for( i = 0; i < dstinfo->num_components; i++ ) {
+		jpeg_component_info *comp = &dstinfo->comp_info[i];
+
+		if( dstinfo->num_components == 1 ) {
+			comp->h_samp_factor = 1;
+			comp->v_samp_factor = 1;
+		}
+		else if( SWAPS( jpegtran->angle ) )
+			VIPS_SWAP( int, comp->h_samp_factor, 
+				comp->v_samp_factor );
+	}
+
+	/* Transposed blocks need transposed quant tables. These are our
+	 * own copies, made by jpeg_copy_critical_parameters().
+	 */
+	if( SWAPS( jpegtran->angle ) )
+		for( i = 0; i < NUM_QUANT_TBLS; i++ ) 
+			if( dstinfo->quant_tbl_ptrs[i] )
+				jpegtran_transpose_quant( 
+					dstinfo->quant_tbl_ptrs[i] );
+
+	if( jpegtran->optimize_coding )
+		dstinfo->optimize_coding = TRUE;
+	if( jpegtran->interlace )
+		jpeg_simple_progression( dstinfo );
+
+	vips__jpeg_target_dest( dstinfo, jpegtran->target );
+	jpeg_write_coefficients( dstinfo, tran->dst_coef );
+	jpegtran_markers( tran );
+	jpeg_finish_compress( dstinfo );
+
+	(void) jpeg_finish_decompress( srcinfo );
+
+	return( 0 );
+}
+
+static void
+jpegtran_free( Jpegtran *tran )
+{
+	/* Harmless on objects which were never created, since Jpegtran is
+	 * zeroed on allocation.
+	 */
+	jpeg_destroy_compress( &tran->dstinfo );
+	jpeg_destroy_decompress( &tran->srcinfo );
+}
+
+static int
+vips_foreign_jpegtran_source_build( VipsObject *object )
+{
+	VipsForeignJpegtranSource *jpegtran = 
+		(VipsForeignJpegtranSource *) object;
+
+	Jpegtran *tran;
+	int result;
+
+	if( VIPS_OBJECT_CLASS( vips_foreign_jpegtran_source_parent_class )->
+		build( object ) )
+		return( -1 );
+
+	if( !(tran = VIPS_NEW( object, Jpegtran )) )
+		return( -1 );
+	tran->jpegtran = jpegtran;
+	tran->srcinfo.err = jpeg_std_error( &tran->eman.pub );
+	tran->dstinfo.err = &tran->eman.pub;
+	tran->eman.pub.error_exit = vips__new_error_exit;
+	tran->eman.pub.output_message = vips__new_output_message;
+	tran->eman.fp = NULL;
+
+	if( setjmp( tran->eman.jmp ) ) {
+		jpegtran_free( tran );
+
+		return( -1 );
+	}
+
+	jpeg_create_decompress( &tran->srcinfo );
+	jpeg_create_compress( &tran->dstinfo );
+	tran->srcinfo.client_data = NULL;
+	tran->dstinfo.client_data = NULL;
+
+	result = jpegtran_transform( tran );
+
+	jpegtran_free( tran );
+
+	return( result );
+}
+
+static void
+vips_foreign_jpegtran_source_class_init( 
+	VipsForeignJpegtranSourceClass *class )
+{
+	GObjectClass *gobject_class = G_OBJECT_CLASS( class );
+	VipsObjectClass *object_class = (VipsObjectClass *) class;
+	VipsOperationClass *operation_class = (VipsOperationClass *) class;
+
+	gobject_class->set_property = vips_object_set_property;
+	gobject_class->get_property = vips_object_get_property;
+
+	object_class->nickname = "jpegtran_source";
+	object_class->description = 
+		_( "losslessly crop and rotate a jpeg source to a target" );
+	object_class->build = vips_foreign_jpegtran_source_build;
+
+	/* We write to the target, so we must always run.
+	 */
+	operation_class->flags = VIPS_OPERATION_NOCACHE;
+
+	VIPS_ARG_OBJECT( class, "source", 1,
+		_( "Source" ),
+		_( "Source to load from" ),
+		VIPS_ARGUMENT_REQUIRED_INPUT, 
+		G_STRUCT_OFFSET( VipsForeignJpegtranSource, source ),
+		VIPS_TYPE_SOURCE );
+
+	VIPS_ARG_OBJECT( class, "target", 2,
+		_( "Target" ),
+		_( "Target to save to" ),
+		VIPS_ARGUMENT_REQUIRED_INPUT,
+		G_STRUCT_OFFSET( VipsForeignJpegtranSource, target ),
+		VIPS_TYPE_TARGET );
+
+	VIPS_ARG_ENUM( class, "angle", 3, 
+		_( "Angle" ), 
+		_( "Angle to rotate image" ),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET( VipsForeignJpegtranSource, angle ),
+		VIPS_TYPE_ANGLE, VIPS_ANGLE_D0 ); 
+
+	VIPS_ARG_INT( class, "left", 4, 
+		_( "Left" ), 
+		_( "Left edge of crop area" ),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET( VipsForeignJpegtranSource, left ),
+		0, VIPS_MAX_COORD, 0 );
+
+	VIPS_ARG_INT( class, "top", 5, 
+		_( "Top" ), 
+		_( "Top edge of crop area" ),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET( VipsForeignJpegtranSource, top ),
+		0, VIPS_MAX_COORD, 0 );
+
+	VIPS_ARG_INT( class, "width", 6, 
+		_( "Width" ), 
+		_( "Width of crop area, 0 for the right edge" ),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET( VipsForeignJpegtranSource, width ),
+		0, VIPS_MAX_COORD, 0 );
+
+	VIPS_ARG_INT( class, "height", 7, 
+		_( "Height" ), 
+		_( "Height of crop area, 0 for the bottom edge" ),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET( VipsForeignJpegtranSource, height ),
+		0, VIPS_MAX_COORD, 0 );
+
+	VIPS_ARG_BOOL( class, "strip", 8, 
+		_( "Strip" ), 
+		_( "Strip all metadata from image" ),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET( VipsForeignJpegtranSource, strip ),
+		FALSE );
+
+	VIPS_ARG_BOOL( class, "interlace", 9, 
+		_( "Interlace" ), 
+		_( "Generate an interlaced (progressive) jpeg" ),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET( VipsForeignJpegtranSource, interlace ),
+		FALSE );
+
+	VIPS_ARG_BOOL( class, "optimize_coding", 10, 
+		_( "Optimize coding" ), 
+		_( "Compute optimal Huffman coding tables" ),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET( VipsForeignJpegtranSource, optimize_coding ),
+		FALSE );
+}
+
+static void
+vips_foreign_jpegtran_source_init( VipsForeignJpegtranSource *jpegtran )
+{
+	jpegtran->angle = VIPS_ANGLE_D0;
+}
+
+#endif /*HAVE_JPEG*/
+
+/**
+ * vips_jpegtran_source:
+ * @source: source to load from
+ * @target: target to save to
+ * @...: %NULL-terminated list of optional named arguments
+ *
+ * Optional arguments:
+ *
+ * * @angle: #VipsAngle, rotate by this after cropping
+ * * @left: %gint, left edge of crop area
+ * * @top: %gint, top edge of crop area
+ * * @width: %gint, width of crop area
+ * * @height: %gint, height of crop area
+ * * @strip: %gboolean, remove all metadata from image
+ * * @interlace: %gboolean, write an interlaced (progressive) jpeg
+ * * @optimize_coding: %gboolean, compute optimal Huffman coding tables
+ *
+ * Crop and rotate a JPEG from @source and write the result to @target. This
+ * works on the DCT coefficients, like the jpegtran program, so it does not
+ * decompress the image and there is no generation loss. It is usually many
+ * times faster than vips_jpegload_source(), vips_crop(), vips_rot() and
+ * vips_jpegsave_target().
+ *
+ * The crop area is given by @left, @top, @width and @height in input
+ * coordinates, and is applied before the rotation by @angle. A @width or
+ * @height of zero means to the right or bottom edge. By default, the whole
+ * image is copied.
+ *
+ * Blocks can only be moved whole, so @left and @top are rounded down to the
+ * MCU grid (8 pixels for mono images, usually 16 for colour ones), and the
+ * crop area grows to match. Rotation moves the right or bottom edge of the
+ * crop area to the left or top, so those edges are trimmed back to a whole
+ * number of MCUs, as jpegtran -trim does. 
+ *
+ * Use @interlace to write a progressive file and @optimize_coding to compute
+ * optimal Huffman tables. Otherwise, the output is baseline with the
+ * standard tables, whatever the input was.
+ *
+ * APP and COM markers are copied unless you set @strip. Note that any EXIF
+ * orientation tag is copied unchanged.
+ *
+ * See also: vips_jpegload_source(), vips_rot().
+ *
+ * Returns: 0 on success, -1 on error.
+ */
+int
+vips_jpegtran_source( VipsSource *source, VipsTarget *target, ... )
+{
+	va_list ap;
+	int result;
+
+	va_start( ap, target );
+	result = vips_call_split( "jpegtran_source", ap, source, target );
+	va_end( ap );
+
+	return( result );
+}
@@ -168,7 +168,7 @@ int vips__jpeg_write_target( VipsImage *in, VipsTarget *target,
 	gboolean optimize_coding, gboolean progressive, gboolean strip,
 	gboolean trellis_quant, gboolean overshoot_deringing,
 	gboolean optimize_scans, int quant_table,
-	VipsForeignJpegSubsample subsample_mode );
+	VipsForeignJpegSubsample subsample_mode, int restart_interval );
 
 int vips__jpeg_read_source( VipsSource *source, VipsImage *out,
 	gboolean header_only, int shrink, int fail, gboolean autorotate );
@@ -186,6 +186,11 @@ int vips__png_write_target( VipsImage *in, VipsTarget *target,
 	VipsForeignPngFilter filter, gboolean strip,
 	gboolean palette, int Q, double dither,
 	int bitdepth );
+int vips__spng_write_target( VipsImage *in, VipsTarget *target,
+	int compress, int interlace, const char *profile,
+	VipsForeignPngFilter filter, gboolean strip,
+	gboolean palette, int Q, double dither,
+	int bitdepth );
 
 /* Map WEBP metadata names to vips names.
  */
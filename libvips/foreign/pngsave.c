@@ -8,6 +8,9 @@
  * 	- support png8 palette write with palette, colours, Q, dither
  * 24/6/20
  * 	- add @bitdepth, deprecate @colours
+ * 18/10/26
+ * 	- write with libspng, if we can
+ * 	- only use parallel libpng for large images
  */
 
 /*
@@ -55,7 +58,7 @@
 
 #include "pforeign.h"
 
-#ifdef HAVE_PNG
+#if defined(HAVE_PNG) || defined(HAVE_SPNG_ENCODE)
 
 typedef struct _VipsForeignSavePng {
 	VipsForeignSave parent_object;
@@ -96,6 +99,36 @@ vips_foreign_save_png_dispose( GObject *gobject )
 		dispose( gobject );
 }
 
+#ifdef HAVE_SPNG_ENCODE
+/* Our parallel libpng writer deflates in 128kb blocks. It needs a few 
+ * blocks per thread before it has a chance of beating libspng.
+ */
+#define VIPS_PNG_PARALLEL_BYTES_PER_THREAD (4 * 128 * 1024)
+
+/* Write with libspng, which has less per-line overhead than libpng. The 
+ * exception is large non-interlaced 8 and 16-bit images, where libpng plus 
+ * our parallel filter and deflate can use all the threads we have.
+ */
+static gboolean
+vips_foreign_save_png_use_spng( VipsForeignSavePng *png )
+{
+#if defined(HAVE_PNG) && defined(HAVE_ZLIB)
+	VipsForeignSave *save = (VipsForeignSave *) png;
+	int n_threads = vips_concurrency_get();
+
+	if( !png->interlace &&
+		png->bitdepth >= 8 &&
+		n_threads > 1 &&
+		VIPS_IMAGE_SIZEOF_IMAGE( save->ready ) >= 
+			(guint64) n_threads * 
+				VIPS_PNG_PARALLEL_BYTES_PER_THREAD )
+		return( FALSE );
+#endif /*defined(HAVE_PNG) && defined(HAVE_ZLIB)*/
+
+	return( TRUE );
+}
+#endif /*HAVE_SPNG_ENCODE*/
+
 static int
 vips_foreign_save_png_build( VipsObject *object )
 {
@@ -123,11 +156,25 @@ vips_foreign_save_png_build( VipsObject *object )
 		png->bitdepth < 8 )
 		png->palette = TRUE;
 
+#ifdef HAVE_SPNG_ENCODE
+	if( vips_foreign_save_png_use_spng( png ) ) {
+		if( vips__spng_write_target( save->ready, png->target,
+			png->compression, png->interlace, png->profile, 
+			png->filter, save->strip, png->palette, png->Q, 
+			png->dither, png->bitdepth ) )
+			return( -1 );
+
+		return( 0 );
+	}
+#endif /*HAVE_SPNG_ENCODE*/
+
+#ifdef HAVE_PNG
 	if( vips__png_write_target( save->ready, png->target,
 		png->compression, png->interlace, png->profile, png->filter,
 		save->strip, png->palette, png->Q, png->dither,
 		png->bitdepth ) )
 		return( -1 );
+#endif /*HAVE_PNG*/
 
 	return( 0 );
 }
@@ -150,6 +197,8 @@ static int bandfmt_png[10] = {
    UC, UC, US, US, US, US, UC, UC, UC, UC
 };
 
+static const char *vips_foreign_save_png_suffs[] = { ".png", NULL };
+
 static void
 vips_foreign_save_png_class_init( VipsForeignSavePngClass *class )
 {
@@ -166,7 +215,7 @@ vips_foreign_save_png_class_init( VipsForeignSavePngClass *class )
 	object_class->description = _( "save png" );
 	object_class->build = vips_foreign_save_png_build;
 
-	foreign_class->suffs = vips__png_suffs;
+	foreign_class->suffs = vips_foreign_save_png_suffs;
 
 	save_class->saveable = VIPS_SAVEABLE_RGBA;
 	save_class->format_table = bandfmt_png;
@@ -412,7 +461,7 @@ vips_foreign_save_png_buffer_init( VipsForeignSavePngBuffer *buffer )
 {
 }
 
-#endif /*HAVE_PNG*/
+#endif /*defined(HAVE_PNG) || defined(HAVE_SPNG_ENCODE)*/
 
 /**
  * vips_pngsave: (method)
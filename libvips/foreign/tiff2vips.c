@@ -201,6 +201,9 @@
  * 	- add subifd
  * 6/6/20 MathemanFlo
  * 	- support 2 and 4 bit greyscale load
+ * 18/10/26
+ * 	- read jpeg and deflate tiles raw inside a lock, then decompress in
+ * 	  parallel outside it
  */
 
 /*
@@ -245,6 +248,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <setjmp.h>
 
 #include <vips/vips.h>
 #include <vips/internal.h>
@@ -253,6 +257,14 @@
 #include "pforeign.h"
 #include "tiff.h"
 
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif /*HAVE_ZLIB*/
+
+#ifdef HAVE_JPEG
+#include "jpeg.h"
+#endif /*HAVE_JPEG*/
+
 /* What we read from the tiff dir to set our read strategy. For multipage
  * read, we need to read and compare lots of these, so it needs to be broken
  * out as a separate thing.
@@ -374,8 +386,36 @@ typedef struct _Rtiff {
 	/* The Y we are reading at. Used to verify strip read is sequential.
 	 */
 	int y_pos;
+
+	/* Tiled images are read from many threads. This lock keeps all
+	 * libtiff calls single-threaded.
+	 */
+	GMutex *lock;
 } Rtiff;
 
+/* How we decompress a tile. libtiff codecs keep their state in the TIFF 
+ * handle, so they must run inside the lock. For the common codecs, we can 
+ * fetch the compressed bytes inside the lock and decompress outside it.
+ */
+typedef enum {
+	RTIFF_DECODE_LIBTIFF,
+	RTIFF_DECODE_JPEG,
+	RTIFF_DECODE_DEFLATE
+} RtiffDecode;
+
+/* Per-thread state for tiled read.
+ */
+typedef struct _RtiffSeq {
+	/* Hold a tile for unpacking to vips format.
+	 */
+	tdata_t buf;
+
+	/* Compressed bytes for a tile, read from the file inside the lock.
+	 */
+	VipsPel *raw;
+	size_t raw_size;
+} RtiffSeq;
+
 /* Test for field exists.
  */
 static int
@@ -519,6 +559,7 @@ rtiff_free( Rtiff *rtiff )
 {
 	VIPS_FREEF( TIFFClose, rtiff->tiff );
 	VIPS_UNREF( rtiff->source );
+	VIPS_FREEF( vips_g_mutex_free, rtiff->lock );
 }
 
 static void
@@ -531,8 +572,8 @@ static void
 rtiff_minimise_cb( VipsImage *image, Rtiff *rtiff )
 {
 	/* We must not minimised tiled images. These can be read from many
-	 * threads, and this minimise handler is not inside the lock that our
-	 * tilecache is using to guarantee single-threaded access to our
+	 * threads, and this minimise handler is not inside the lock that 
+	 * rtiff_read_tile() uses to guarantee single-threaded access to our
 	 * source.
 	 */
 	if( !rtiff->header.tiled &&
@@ -565,6 +606,7 @@ rtiff_new( VipsSource *source, VipsImage *out,
 	rtiff->plane_buf = NULL;
 	rtiff->contig_buf = NULL;
 	rtiff->y_pos = 0;
+	rtiff->lock = vips_g_mutex_new();
 
 	g_signal_connect( out, "close", 
 		G_CALLBACK( rtiff_close_cb ), rtiff ); 
@@ -1708,22 +1750,363 @@ static void *
 rtiff_seq_start( VipsImage *out, void *a, void *b )
 {
 	Rtiff *rtiff = (Rtiff *) a;
-	tdata_t *buf;
+	RtiffSeq *seq;
 
-	if( !(buf = vips_malloc( NULL, rtiff->header.tile_size )) )
+	if( !(seq = VIPS_NEW( NULL, RtiffSeq )) )
+		return( NULL );
+	seq->raw = NULL;
+	seq->raw_size = 0;
+	if( !(seq->buf = vips_malloc( NULL, rtiff->header.tile_size )) ) {
+		g_free( seq );
 		return( NULL );
+	}
+
+	return( (void *) seq );
+}
+
+/* Pick a decoder for tiles in the current directory. Anything we can't
+ * handle ourselves goes back to libtiff. 
+ */
+static RtiffDecode
+rtiff_tile_decode( Rtiff *rtiff, uint16 *predictor )
+{
+	uint16 compression;
+
+	*predictor = PREDICTOR_NONE;
 
-	return( (void *) buf );
+	if( rtiff->header.bits_per_sample % 8 != 0 ||
+		!TIFFGetFieldDefaulted( rtiff->tiff, 
+			TIFFTAG_COMPRESSION, &compression ) )
+		return( RTIFF_DECODE_LIBTIFF );
+
+#ifdef HAVE_JPEG
+	if( compression == COMPRESSION_JPEG &&
+		rtiff->header.bits_per_sample == 8 ) 
+		return( RTIFF_DECODE_JPEG );
+#endif /*HAVE_JPEG*/
+
+#ifdef HAVE_ZLIB
+	if( (compression == COMPRESSION_ADOBE_DEFLATE ||
+		compression == COMPRESSION_DEFLATE) &&
+		TIFFGetFieldDefaulted( rtiff->tiff, 
+			TIFFTAG_PREDICTOR, predictor ) &&
+		(*predictor == PREDICTOR_NONE ||
+		 (*predictor == PREDICTOR_HORIZONTAL &&
+		  rtiff->header.bits_per_sample <= 32)) )
+		return( RTIFF_DECODE_DEFLATE );
+#endif /*HAVE_ZLIB*/
+
+	return( RTIFF_DECODE_LIBTIFF );
 }
 
+/* Read the compressed bytes for the tile at x, y to seq->raw. For JPEG, 
+ * the tables from the directory are merged in to make a complete JPEG 
+ * stream.
+ *
+ * Must be called inside the lock.
+ */
 static int
-rtiff_read_tile( Rtiff *rtiff, tdata_t *buf, int x, int y )
+rtiff_read_raw_tile( Rtiff *rtiff, RtiffSeq *seq, RtiffDecode decode,
+	int x, int y, size_t *length )
 {
+	ttile_t tile = TIFFComputeTile( rtiff->tiff, x, y, 0, 0 );
+
+	toff_t *byte_counts;
+	uint32 table_count;
+	VipsPel *tables;
+	size_t table_length;
+	size_t tile_length;
+
+	if( tile >= TIFFNumberOfTiles( rtiff->tiff ) ||
+		!TIFFGetField( rtiff->tiff, 
+			TIFFTAG_TILEBYTECOUNTS, &byte_counts ) ||
+		byte_counts[tile] < 2 ) {
+		vips_error( "tiff2vips", "%s", _( "read error" ) );
+		return( -1 );
+	}
+	tile_length = byte_counts[tile];
+
+	/* JPEGTABLES is a complete SOI ... EOI stream. Drop the EOI, then
+	 * drop the SOI from the start of the tile.
+	 */
+	table_length = 0;
+	tables = NULL;
+	if( decode == RTIFF_DECODE_JPEG &&
+		TIFFGetField( rtiff->tiff, 
+			TIFFTAG_JPEGTABLES, &table_count, &tables ) &&
+		table_count >= 4 )
+		table_length = table_count - 2;
+
+	if( seq->raw_size < table_length + tile_length ) {
+		VIPS_FREE( seq->raw );
+		seq->raw_size = 0;
+		if( !(seq->raw = vips_malloc( NULL, 
+			table_length + tile_length )) )
+			return( -1 );
+		seq->raw_size = table_length + tile_length;
+	}
+
+	if( table_length > 0 )
+		memcpy( seq->raw, tables, table_length );
+
+	if( (size_t) TIFFReadRawTile( rtiff->tiff, tile, 
+		seq->raw + table_length, tile_length ) != tile_length ) {
+		vips_error( "tiff2vips", "%s", _( "read error" ) );
+		return( -1 );
+	}
+
+	if( table_length > 0 ) {
+		memmove( seq->raw + table_length, 
+			seq->raw + table_length + 2, tile_length - 2 );
+		tile_length -= 2;
+	}
+
+	*length = table_length + tile_length;
+
+	return( 0 );
+}
+
+#ifdef HAVE_JPEG
+static void
+rtiff_jpeg_init_source( j_decompress_ptr cinfo )
+{
+}
+
+static jboolean
+rtiff_jpeg_fill_input_buffer( j_decompress_ptr cinfo )
+{
+	static const JOCTET eoi[2] = { 0xff, JPEG_EOI };
+
+	/* Truncated ... insert a fake EOI, like libjpeg's own memory source.
+	 */
+	WARNMS( cinfo, JWRN_JPEG_EOF );
+	cinfo->src->next_input_byte = eoi;
+	cinfo->src->bytes_in_buffer = 2;
+
+	return( TRUE );
+}
+
+static void
+rtiff_jpeg_skip_input_data( j_decompress_ptr cinfo, long num_bytes )
+{
+	struct jpeg_source_mgr *src = cinfo->src;
+
+	if( num_bytes > 0 ) {
+		num_bytes = VIPS_MIN( num_bytes, (long) src->bytes_in_buffer );
+		src->next_input_byte += num_bytes;
+		src->bytes_in_buffer -= num_bytes;
+	}
+}
+
+static void
+rtiff_jpeg_term_source( j_decompress_ptr cinfo )
+{
+}
+
+/* Decompress a JPEG tile, converting YCbCr to RGB in the same way as
+ * JPEGCOLORMODE_RGB.
+ */
+static int
+rtiff_decode_jpeg( Rtiff *rtiff, VipsPel *raw, size_t length, tdata_t buf )
+{
+	struct jpeg_decompress_struct cinfo;
+	struct jpeg_source_mgr src;
+	ErrorManager eman;
+	JSAMPROW row;
+
+	cinfo.err = jpeg_std_error( &eman.pub );
+	eman.pub.error_exit = vips__new_error_exit;
+	eman.pub.output_message = vips__new_output_message;
+	eman.fp = NULL;
+
+	/* Here for longjmp() from vips__new_error_exit().
+	 */
+	if( setjmp( eman.jmp ) ) {
+		jpeg_destroy_decompress( &cinfo );
+		return( -1 );
+	}
+
+	jpeg_create_decompress( &cinfo );
+
+	src.init_source = rtiff_jpeg_init_source;
+	src.fill_input_buffer = rtiff_jpeg_fill_input_buffer;
+	src.skip_input_data = rtiff_jpeg_skip_input_data;
+	src.resync_to_restart = jpeg_resync_to_restart;
+	src.term_source = rtiff_jpeg_term_source;
+	src.next_input_byte = raw;
+	src.bytes_in_buffer = length;
+	cinfo.src = &src;
+
+	jpeg_read_header( &cinfo, TRUE );
+
+	if( rtiff->header.photometric_interpretation == PHOTOMETRIC_YCBCR ) {
+		cinfo.jpeg_color_space = JCS_YCbCr;
+		cinfo.out_color_space = JCS_RGB;
+	}
+	else {
+		cinfo.jpeg_color_space = JCS_UNKNOWN;
+		cinfo.out_color_space = JCS_UNKNOWN;
+	}
+
+	jpeg_start_decompress( &cinfo );
+
+	if( cinfo.output_width != rtiff->header.tile_width ||
+		cinfo.output_height != rtiff->header.tile_height ||
+		(tsize_t) (cinfo.output_width * cinfo.output_components) != 
+			rtiff->header.tile_row_size ) {
+		vips_error( "tiff2vips", "%s", _( "improper JPEG tile size" ) );
+		jpeg_destroy_decompress( &cinfo );
+		return( -1 );
+	}
+
+	while( cinfo.output_scanline < cinfo.output_height ) {
+		row = (VipsPel *) buf + 
+			cinfo.output_scanline * rtiff->header.tile_row_size;
+		jpeg_read_scanlines( &cinfo, &row, 1 );
+	}
+
+	jpeg_finish_decompress( &cinfo );
+	jpeg_destroy_decompress( &cinfo );
+
+	return( 0 );
+}
+#endif /*HAVE_JPEG*/
+
+#ifdef HAVE_ZLIB
+/* Undo horizontal differencing.
+ */
+#define HORIZONTAL_ACCUMULATE( TYPE ) { \
+	TYPE *p = (TYPE *) line; \
+	\
+	for( x = stride; x < n; x++ ) \
+		p[x] += p[x - stride]; \
+}
+
+/* Decompress a deflate tile, with optional byteswap and predictor, as 
+ * libtiff would.
+ */
+static int
+rtiff_decode_deflate( Rtiff *rtiff, VipsPel *raw, size_t length, 
+	tdata_t buf, gboolean swab, uint16 predictor )
+{
+	int bits_per_sample = rtiff->header.bits_per_sample;
+	int stride = rtiff->header.samples_per_pixel;
+	int n = rtiff->header.tile_row_size / (bits_per_sample / 8);
+	size_t tile_size = rtiff->header.tile_size;
+
+	uLongf dest_length;
+	int x, y;
+
+	dest_length = tile_size;
+	if( uncompress( (Bytef *) buf, &dest_length, raw, length ) != Z_OK ||
+		dest_length != tile_size ) {
+		vips_error( "tiff2vips", "%s", _( "deflate decode error" ) );
+		return( -1 );
+	}
+
+	if( swab )
+		switch( bits_per_sample ) {
+		case 16:
+			TIFFSwabArrayOfShort( (uint16 *) buf, tile_size / 2 );
+			break;
+
+		case 32:
+			TIFFSwabArrayOfLong( (uint32 *) buf, tile_size / 4 );
+			break;
+
+		case 64:
+			TIFFSwabArrayOfDouble( (double *) buf, tile_size / 8 );
+			break;
+
+		default:
+			break;
+		}
+
+	if( predictor == PREDICTOR_HORIZONTAL )
+		for( y = 0; y < rtiff->header.tile_height; y++ ) {
+			VipsPel *line = (VipsPel *) buf + 
+				y * rtiff->header.tile_row_size;
+
+			switch( bits_per_sample ) {
+			case 8:
+				HORIZONTAL_ACCUMULATE( unsigned char );
+				break;
+
+			case 16:
+				HORIZONTAL_ACCUMULATE( unsigned short );
+				break;
+
+			case 32:
+				HORIZONTAL_ACCUMULATE( unsigned int );
+				break;
+
+			default:
+				g_assert_not_reached();
+			}
+		}
+
+	return( 0 );
+}
+#endif /*HAVE_ZLIB*/
+
+/* Read and decompress a tile. Only the file read happens inside the lock, 
+ * if we can.
+ */
+static int
+rtiff_read_tile( Rtiff *rtiff, RtiffSeq *seq, tdata_t *buf, 
+	int page, int x, int y )
+{
+	RtiffDecode decode;
+	uint16 predictor;
+	gboolean swab;
+	size_t length;
+	int result;
+
 #ifdef DEBUG_VERBOSE
 	printf( "rtiff_read_tile: x = %d, y = %d\n", x, y ); 
 #endif /*DEBUG_VERBOSE*/
 
-	if( TIFFReadTile( rtiff->tiff, buf, x, y, 0, 0 ) < 0 ) { 
+	g_mutex_lock( rtiff->lock );
+
+	if( rtiff_set_page( rtiff, page ) ) {
+		g_mutex_unlock( rtiff->lock );
+		return( -1 );
+	}
+
+	decode = rtiff_tile_decode( rtiff, &predictor );
+	swab = TIFFIsByteSwapped( rtiff->tiff );
+
+	length = 0;
+	if( decode == RTIFF_DECODE_LIBTIFF ) 
+		result = TIFFReadTile( rtiff->tiff, buf, x, y, 0, 0 ) < 0 ?
+			-1 : 0;
+	else
+		result = rtiff_read_raw_tile( rtiff, seq, decode, 
+			x, y, &length );
+
+	g_mutex_unlock( rtiff->lock );
+
+	if( !result )
+		switch( decode ) {
+#ifdef HAVE_JPEG
+		case RTIFF_DECODE_JPEG:
+			result = rtiff_decode_jpeg( rtiff, 
+				seq->raw, length, buf );
+			break;
+#endif /*HAVE_JPEG*/
+
+#ifdef HAVE_ZLIB
+		case RTIFF_DECODE_DEFLATE:
+			result = rtiff_decode_deflate( rtiff, 
+				seq->raw, length, buf, swab, predictor );
+			break;
+#endif /*HAVE_ZLIB*/
+
+		default:
+			break;
+		}
+
+	if( result ) {
 		vips_foreign_load_invalidate( rtiff->out );
 		return( -1 ); 
 	}
@@ -1758,10 +2141,9 @@ rtiff_fill_region_aligned( VipsRegion *out,
 
 	/* Read that tile directly into the vips tile.
 	 */
-	if( rtiff_set_page( rtiff, rtiff->page + page_no ) ||
-		rtiff_read_tile( rtiff,
-			(tdata_t *) VIPS_REGION_ADDR( out, r->left, r->top ), 
-		r->left, page_y ) ) 
+	if( rtiff_read_tile( rtiff, (RtiffSeq *) seq,
+		(tdata_t *) VIPS_REGION_ADDR( out, r->left, r->top ), 
+		rtiff->page + page_no, r->left, page_y ) ) 
 		return( -1 );
 
 	return( 0 );
@@ -1773,7 +2155,8 @@ static int
 rtiff_fill_region_unaligned( VipsRegion *out, 
 	void *seq, void *a, void *b, gboolean *stop )
 {
-	tdata_t *buf = (tdata_t *) seq;
+	RtiffSeq *rseq = (RtiffSeq *) seq;
+	tdata_t *buf = (tdata_t *) rseq->buf;
 	Rtiff *rtiff = (Rtiff *) a;
 	int tile_width = rtiff->header.tile_width;
 	int tile_height = rtiff->header.tile_height;
@@ -1810,8 +2193,8 @@ rtiff_fill_region_unaligned( VipsRegion *out,
 			int xs = ((r->left + x) / tile_width) * tile_width;
 			int ys = (page_y / tile_height) * tile_height;
 
-			if( rtiff_set_page( rtiff, rtiff->page + page_no ) ||
-				rtiff_read_tile( rtiff, buf, xs, ys ) )  
+			if( rtiff_read_tile( rtiff, rseq, buf, 
+				rtiff->page + page_no, xs, ys ) )  
 				return( -1 );
 
 			/* Position of tile on the page. 
@@ -1926,7 +2309,11 @@ rtiff_fill_region( VipsRegion *out,
 static int
 rtiff_seq_stop( void *seq, void *a, void *b )
 {
-	g_free( seq );
+	RtiffSeq *rseq = (RtiffSeq *) seq;
+
+	VIPS_FREE( rseq->buf );
+	VIPS_FREE( rseq->raw );
+	g_free( rseq );
 
 	return( 0 );
 }
@@ -2010,6 +2397,9 @@ rtiff_read_tilewise( Rtiff *rtiff, VipsImage *out )
         vips_image_pipelinev( t[0], VIPS_DEMAND_STYLE_THINSTRIP, NULL );
 
 	/* Generate to out, adding a cache. Enough tiles for two complete rows.
+	 *
+	 * The cache is threaded: rtiff_read_tile() locks around libtiff 
+	 * itself, so tiles can decompress in parallel.
 	 */
 	if( 
 		vips_image_generate( t[0], 
@@ -2019,6 +2409,7 @@ rtiff_read_tilewise( Rtiff *rtiff, VipsImage *out )
 			"tile_width", tile_width,
 			"tile_height", tile_height,
 			"max_tiles", 2 * (1 + t[0]->Xsize / tile_width),
+			"threaded", TRUE,
 			NULL ) ||
 		rtiff_unpremultiply( rtiff, t[1], &t[2] ) )
 		return( -1 );
@@ -96,6 +96,8 @@
  * 	- add subsample_mode, deprecate no_subsample
  * 13/9/20
  * 	- only write JFIF resolution if we don't have EXIF
+ * 18/10/26
+ * 	- add restart_interval, and compress bands in parallel
  */
 
 /*
@@ -207,6 +209,13 @@ typedef struct {
         ErrorManager eman;
 	JSAMPROW *row_pointer;
 	VipsImage *inverted;
+
+	/* For parallel write, the target, the headers from cinfo, and 
+	 * any options we need to copy to the encoder for each band.
+	 */
+	VipsTarget *target;
+	VipsDbuf header;
+	gboolean overshoot_deringing;
 } Write;
 
 static void
@@ -216,6 +225,7 @@ write_destroy( Write *write )
 	VIPS_FREE( write->row_pointer );
 	VIPS_UNREF( write->inverted );
 	VIPS_UNREF( write->in );
+	vips_dbuf_destroy( &write->header );
 
 	g_free( write );
 }
@@ -236,6 +246,8 @@ write_new( VipsImage *in )
 	write->eman.pub.output_message = vips__new_output_message;
 	write->eman.fp = NULL;
 	write->inverted = NULL;
+	write->target = NULL;
+	vips_dbuf_init( &write->header );
 
 	/* Make a copy of the input image since we may modify it with
 	 * vips__exif_update() etc.
@@ -533,6 +545,420 @@ write_jpeg_block( VipsRegion *region, VipsRect *area, void *a )
 	return( 0 );
 }
 
+/* Compress bands at least this many lines high. Each band has its own 
+ * libjpeg, so they need to be large enough to hide the setup cost.
+ */
+#define BAND_HEIGHT (256)
+
+#define DBUF_BUFFER_SIZE (4096)
+
+/* A destination which appends to a VipsDbuf.
+ */
+typedef struct {
+	struct jpeg_destination_mgr pub;
+
+	VipsDbuf *dbuf;
+	unsigned char buf[DBUF_BUFFER_SIZE];
+} DbufDest;
+
+static void
+dbuf_init_destination( j_compress_ptr cinfo )
+{
+	DbufDest *dest = (DbufDest *) cinfo->dest;
+
+	dest->pub.next_output_byte = dest->buf;
+	dest->pub.free_in_buffer = DBUF_BUFFER_SIZE;
+}
+
+static jboolean
+dbuf_empty_output_buffer( j_compress_ptr cinfo )
+{
+	DbufDest *dest = (DbufDest *) cinfo->dest;
+
+	if( !vips_dbuf_write( dest->dbuf, dest->buf, DBUF_BUFFER_SIZE ) )
+		ERREXIT( cinfo, JERR_FILE_WRITE );
+
+	dest->pub.next_output_byte = dest->buf;
+	dest->pub.free_in_buffer = DBUF_BUFFER_SIZE;
+
+	return( TRUE );
+}
+
+static void
+dbuf_term_destination( j_compress_ptr cinfo )
+{
+	DbufDest *dest = (DbufDest *) cinfo->dest;
+
+	if( !vips_dbuf_write( dest->dbuf, 
+		dest->buf, DBUF_BUFFER_SIZE - dest->pub.free_in_buffer ) )
+		ERREXIT( cinfo, JERR_FILE_WRITE );
+
+	dest->pub.next_output_byte = dest->buf;
+	dest->pub.free_in_buffer = DBUF_BUFFER_SIZE;
+}
+
+static void
+dbuf_dest( j_compress_ptr cinfo, VipsDbuf *dbuf )
+{
+	DbufDest *dest;
+
+	cinfo->dest = (struct jpeg_destination_mgr *)
+		(*cinfo->mem->alloc_small) 
+			( (j_common_ptr) cinfo, JPOOL_PERMANENT,
+			  sizeof( DbufDest ) );
+
+	dest = (DbufDest *) cinfo->dest;
+	dest->pub.init_destination = dbuf_init_destination;
+	dest->pub.empty_output_buffer = dbuf_empty_output_buffer;
+	dest->pub.term_destination = dbuf_term_destination;
+	dest->dbuf = dbuf;
+}
+
+/* A set of bands being compressed in parallel.
+ */
+typedef struct _WriteBands {
+	Write *write;
+	VipsImage *in;
+
+	/* Lines in each band, the number of bands, and the next band to 
+	 * compress.
+	 */
+	int band_height;
+	int n_bands;
+	int band;
+
+	/* Compressed bands waiting to be written, and the next band to 
+	 * write. Bands can finish out of order.
+	 */
+	GMutex *lock;
+	VipsPel **buf;
+	size_t *length;
+	int n_written;
+
+	/* Pixels written so far, for progress feedback.
+	 */
+	guint64 processed;
+} WriteBands;
+
+/* Set up @cinfo to compress a band of @write, @height lines high. We copy
+ * everything which affects the entropy-coded data, but write no JFIF or
+ * Adobe markers, since the headers come from @write.
+ */
+static void
+write_band_setup( Write *write, j_compress_ptr cinfo, int height )
+{
+	int i;
+
+	cinfo->image_width = write->cinfo.image_width;
+	cinfo->image_height = height;
+	cinfo->input_components = write->cinfo.input_components;
+	cinfo->in_color_space = write->cinfo.in_color_space;
+
+#ifdef HAVE_JPEG_EXT_PARAMS
+	if( jpeg_c_int_param_supported( cinfo, JINT_COMPRESS_PROFILE ) )
+		jpeg_c_set_int_param( cinfo, 
+			JINT_COMPRESS_PROFILE, JCP_FASTEST );
+#endif /*HAVE_JPEG_EXT_PARAMS*/
+
+	jpeg_set_defaults( cinfo );
+
+#ifdef HAVE_JPEG_EXT_PARAMS
+	if( write->overshoot_deringing &&
+		jpeg_c_bool_param_supported( cinfo, 
+			JBOOLEAN_OVERSHOOT_DERINGING ) ) 
+		jpeg_c_set_bool_param( cinfo, 
+			JBOOLEAN_OVERSHOOT_DERINGING, TRUE );
+#endif /*HAVE_JPEG_EXT_PARAMS*/
+
+	for( i = 0; i < NUM_QUANT_TBLS; i++ ) 
+		if( write->cinfo.quant_tbl_ptrs[i] ) {
+			if( !cinfo->quant_tbl_ptrs[i] )
+				cinfo->quant_tbl_ptrs[i] = 
+					jpeg_alloc_quant_table( 
+						(j_common_ptr) cinfo );
+			memcpy( cinfo->quant_tbl_ptrs[i]->quantval,
+				write->cinfo.quant_tbl_ptrs[i]->quantval,
+				sizeof( cinfo->quant_tbl_ptrs[i]->quantval ) );
+		}
+
+	for( i = 0; i < cinfo->num_components; i++ ) {
+		jpeg_component_info *from = &write->cinfo.comp_info[i];
+		jpeg_component_info *to = &cinfo->comp_info[i];
+
+		to->h_samp_factor = from->h_samp_factor;
+		to->v_samp_factor = from->v_samp_factor;
+		to->quant_tbl_no = from->quant_tbl_no;
+	}
+
+	cinfo->dct_method = write->cinfo.dct_method;
+	cinfo->restart_interval = write->cinfo.restart_interval;
+	cinfo->write_JFIF_header = FALSE;
+	cinfo->write_Adobe_marker = FALSE;
+}
+
+/* Find the end of the SOS header in a JPEG we have made.
+ */
+static size_t
+write_band_find_sos( VipsPel *buf, size_t length )
+{
+	size_t i;
+
+	for( i = 2; i + 4 <= length; ) {
+		size_t marker_length = (buf[i + 2] << 8) | buf[i + 3];
+
+		g_assert( buf[i] == 0xff );
+
+		if( buf[i + 1] == 0xda )
+			return( i + 2 + marker_length );
+
+		i += 2 + marker_length;
+	}
+
+	g_assert_not_reached();
+
+	return( length );
+}
+
+/* Write any bands we can, in order. Each band has its own SOI, headers and
+ * EOI, which we strip. The scan data is joined with RST7: bands always
+ * start on a restart interval which is a multiple of eight, so the RSTn
+ * markers libjpeg wrote within each band are already correct.
+ */
+static int
+write_band_flush( WriteBands *bands )
+{
+	VipsTarget *target = bands->write->target;
+
+	while( bands->n_written < bands->n_bands &&
+		bands->buf[bands->n_written] ) {
+		static const VipsPel rst7[2] = { 0xff, 0xd7 };
+
+		int i = bands->n_written;
+		VipsPel *buf = bands->buf[i];
+		size_t length = bands->length[i];
+		size_t start = write_band_find_sos( buf, length );
+
+		g_assert( buf[length - 2] == 0xff && 
+			buf[length - 1] == 0xd9 );
+
+		if( (i > 0 &&
+			vips_target_write( target, rst7, 2 )) ||
+			vips_target_write( target, 
+				buf + start, length - start - 2 ) )
+			return( -1 );
+
+		VIPS_FREE( bands->buf[i] );
+		bands->n_written += 1;
+	}
+
+	return( 0 );
+}
+
+static int
+write_band_allocate( VipsThreadState *state, void *a, gboolean *stop )
+{
+	WriteBands *bands = (WriteBands *) a;
+
+	if( bands->band >= bands->n_bands ) {
+		*stop = TRUE;
+		return( 0 );
+	}
+
+	state->x = bands->band;
+	bands->band += 1;
+
+	return( 0 );
+}
+
+/* Compute and compress one band.
+ */
+static int
+write_band_work( VipsThreadState *state, void *a )
+{
+	WriteBands *bands = (WriteBands *) a;
+	Write *write = bands->write;
+	VipsImage *in = bands->in;
+
+	VipsRect area;
+	struct jpeg_compress_struct cinfo;
+	ErrorManager eman;
+	VipsDbuf dbuf;
+	VipsPel *buf;
+	size_t length;
+	int result;
+	int y;
+
+	area.left = 0;
+	area.top = state->x * bands->band_height;
+	area.width = in->Xsize;
+	area.height = VIPS_MIN( bands->band_height, in->Ysize - area.top );
+	if( vips_region_prepare( state->reg, &area ) )
+		return( -1 );
+
+	VIPS_GATE_START( "write_band_work: work" );
+
+	vips_dbuf_init( &dbuf );
+	cinfo.err = jpeg_std_error( &eman.pub );
+	cinfo.client_data = NULL;
+	eman.pub.error_exit = vips__new_error_exit;
+	eman.pub.output_message = vips__new_output_message;
+	eman.fp = NULL;
+
+	/* Here for longjmp() from vips__new_error_exit().
+	 */
+	if( setjmp( eman.jmp ) ) {
+		VIPS_GATE_STOP( "write_band_work: work" );
+		jpeg_destroy_compress( &cinfo );
+		vips_dbuf_destroy( &dbuf );
+
+		return( -1 );
+	}
+
+	jpeg_create_compress( &cinfo );
+	dbuf_dest( &cinfo, &dbuf );
+	write_band_setup( write, &cinfo, area.height );
+	jpeg_start_compress( &cinfo, TRUE );
+
+	for( y = 0; y < area.height; y++ ) {
+		JSAMPROW row_pointer[1];
+
+		row_pointer[0] = (JSAMPROW) 
+			VIPS_REGION_ADDR( state->reg, 0, area.top + y );
+		jpeg_write_scanlines( &cinfo, &row_pointer[0], 1 );
+	}
+
+	jpeg_finish_compress( &cinfo );
+	jpeg_destroy_compress( &cinfo );
+
+	buf = vips_dbuf_steal( &dbuf, &length );
+
+	VIPS_GATE_STOP( "write_band_work: work" );
+
+	g_mutex_lock( bands->lock );
+	bands->buf[state->x] = buf;
+	bands->length[state->x] = length;
+	bands->processed += (guint64) area.width * area.height;
+	result = write_band_flush( bands );
+	g_mutex_unlock( bands->lock );
+
+	return( result );
+}
+
+static int
+write_band_progress( void *a )
+{
+	WriteBands *bands = (WriteBands *) a;
+
+	vips_image_eval( bands->in, bands->processed );
+	if( vips_image_iskilled( bands->in ) )
+		return( -1 );
+
+	return( 0 );
+}
+
+/* Write the headers from @write->cinfo, then compress bands of @in in 
+ * parallel and join them with restart markers.
+ *
+ * Each band must start on a restart boundary, and, so we don't need to
+ * renumber RSTn markers, on a multiple of eight restart intervals.
+ */
+static int
+write_jpeg_parallel( Write *write, VipsImage *in )
+{
+	static const VipsPel eoi[2] = { 0xff, 0xd9 };
+
+	j_compress_ptr cinfo = &write->cinfo;
+
+	int mcu_height;
+	int a, b;
+	int step;
+	int band_rows;
+	WriteBands bands;
+	const VipsPel *header;
+	size_t length;
+	int result;
+	int i;
+
+	/* Catch any longjmp()s from libjpeg here.
+	 */
+	if( setjmp( write->eman.jmp ) ) 
+		return( -1 );
+
+	/* Writing no lines makes libjpeg output the frame and scan headers. 
+	 * Flush them to the target.
+	 */
+	jpeg_write_scanlines( cinfo, write->row_pointer, 0 );
+	(*cinfo->dest->term_destination)( cinfo );
+	header = vips_dbuf_string( &write->header, &length );
+	if( vips_target_write( write->target, header, length ) )
+		return( -1 );
+
+	/* The first MCU row we can start a band on which is also on a
+	 * restart boundary is @step rows down.
+	 */
+	mcu_height = cinfo->comps_in_scan > 1 ? 
+		DCTSIZE * cinfo->max_v_samp_factor : DCTSIZE;
+	a = cinfo->restart_interval;
+	b = cinfo->MCUs_per_row;
+	while( b ) {
+		int t = a % b;
+
+		a = b;
+		b = t;
+	}
+	step = cinfo->restart_interval / a;
+	band_rows = VIPS_ROUND_UP( BAND_HEIGHT, mcu_height ) / mcu_height;
+	band_rows = VIPS_ROUND_UP( band_rows, 8 * step );
+
+	bands.write = write;
+	bands.in = in;
+	bands.band_height = band_rows * mcu_height;
+	bands.n_bands = VIPS_ROUND_UP( in->Ysize, bands.band_height ) / 
+		bands.band_height;
+	bands.band = 0;
+	bands.n_written = 0;
+	bands.processed = 0;
+	bands.lock = vips_g_mutex_new();
+	bands.buf = VIPS_ARRAY( NULL, bands.n_bands, VipsPel * );
+	bands.length = VIPS_ARRAY( NULL, bands.n_bands, size_t );
+	if( !bands.buf ||
+		!bands.length ) {
+		VIPS_FREE( bands.buf );
+		VIPS_FREE( bands.length );
+		VIPS_FREEF( vips_g_mutex_free, bands.lock );
+		return( -1 );
+	}
+	for( i = 0; i < bands.n_bands; i++ )
+		bands.buf[i] = NULL;
+
+#ifdef DEBUG
+	printf( "write_jpeg_parallel: %d bands of %d lines\n", 
+		bands.n_bands, bands.band_height );
+#endif /*DEBUG*/
+
+	vips_image_preeval( in );
+
+	result = vips_threadpool_run( in, 
+		vips_thread_state_new, write_band_allocate, write_band_work, 
+		write_band_progress, &bands );
+
+	vips_image_posteval( in );
+
+	for( i = 0; i < bands.n_bands; i++ ) 
+		VIPS_FREE( bands.buf[i] );
+	VIPS_FREE( bands.buf );
+	VIPS_FREE( bands.length );
+	VIPS_FREEF( vips_g_mutex_free, bands.lock );
+
+	if( result ||
+		vips_target_write( write->target, eoi, 2 ) )
+		return( -1 );
+
+	vips_target_finish( write->target );
+
+	return( 0 );
+}
+
 /* Write a VIPS image to a JPEG compress struct.
  */
 static int
@@ -540,10 +966,11 @@ write_vips( Write *write, int qfac, const char *profile,
 	gboolean optimize_coding, gboolean progressive, gboolean strip, 
 	gboolean trellis_quant, gboolean overshoot_deringing,
 	gboolean optimize_scans, int quant_table,
-	VipsForeignJpegSubsample subsample_mode )
+	VipsForeignJpegSubsample subsample_mode, int restart_interval )
 {
 	VipsImage *in;
 	J_COLOR_SPACE space;
+	gboolean parallel;
 
 	/* The image we'll be writing ... can change, see CMYK.
 	 */
@@ -698,6 +1125,18 @@ write_vips( Write *write, int qfac, const char *profile,
 		}
 	}
 
+	/* Restart markers let us compress bands in parallel, as long as
+	 * the entropy coder has fixed tables and a single scan.
+	 */
+	write->cinfo.restart_interval = restart_interval;
+	write->overshoot_deringing = overshoot_deringing;
+	parallel = restart_interval > 0 &&
+		!progressive &&
+		!write->cinfo.optimize_coding &&
+		vips_concurrency_get() > 1;
+	if( parallel )
+		dbuf_dest( &write->cinfo, &write->header );
+
 	/* Only write the JFIF headers if we are not stripping and we have no
 	 * EXIF. Some readers get confused if you set both.
 	 */
@@ -740,6 +1179,9 @@ write_vips( Write *write, int qfac, const char *profile,
 		}
 	}
 
+	if( parallel )
+		return( write_jpeg_parallel( write, in ) );
+
 	/* Write data. Note that the write function grabs the longjmp()!
 	 */
 	if( vips_sink_disc( in, write_jpeg_block, write ) )
@@ -819,10 +1261,10 @@ term_destination( j_compress_ptr cinfo )
 	vips_target_finish( dest->target );
 }
 
-/* Set dest to one of our objects.
+/* Set dest to one of our objects. jpegtran uses this too.
  */
-static void
-target_dest( j_compress_ptr cinfo, VipsTarget *target )
+void
+vips__jpeg_target_dest( j_compress_ptr cinfo, VipsTarget *target )
 {
 	Dest *dest;
 
@@ -846,12 +1288,14 @@ vips__jpeg_write_target( VipsImage *in, VipsTarget *target,
 	gboolean optimize_coding, gboolean progressive,
 	gboolean strip, gboolean trellis_quant,
 	gboolean overshoot_deringing, gboolean optimize_scans,
-	int quant_table, VipsForeignJpegSubsample subsample_mode)
+	int quant_table, VipsForeignJpegSubsample subsample_mode,
+	int restart_interval )
 {
 	Write *write;
 
 	if( !(write = write_new( in )) )
 		return( -1 );
+	write->target = target;
 
 	/* Make jpeg compression object.
  	 */
@@ -866,14 +1310,14 @@ vips__jpeg_write_target( VipsImage *in, VipsTarget *target,
 
 	/* Attach output.
 	 */
-        target_dest( &write->cinfo, target );
+        vips__jpeg_target_dest( &write->cinfo, target );
 
 	/* Convert! Write errors come back here as an error return.
 	 */
 	if( write_vips( write, 
 		Q, profile, optimize_coding, progressive, strip,
 		trellis_quant, overshoot_deringing, optimize_scans, 
-		quant_table, subsample_mode ) ) {
+		quant_table, subsample_mode, restart_interval ) ) {
 		write_destroy( write );
 		return( -1 );
 	}
@@ -0,0 +1,547 @@
+/* save PNG with libspng
+ *
+ * 18/10/26
+ * 	- from vipspng.c
+ * 	- keep the profile= blob until the encode is done
+ */
+
+/*
+
+    This file is part of VIPS.
+
+    VIPS is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301  USA
+
+ */
+
+/*
+
+    These files are distributed with VIPS - http://www.vips.ecs.soton.ac.uk
+
+ */
+
+/*
+#define DEBUG
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /*HAVE_CONFIG_H*/
+#include <vips/intl.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vips/vips.h>
+#include <vips/internal.h>
+
+#include "pforeign.h"
+
+#ifdef HAVE_SPNG_ENCODE
+
+#include <spng.h>
+
+/* What we track during a PNG write.
+ */
+typedef struct {
+	VipsImage *in;
+	VipsImage *memory;
+
+	VipsTarget *target;
+
+	spng_ctx *ctx;
+	int bitdepth;
+
+	/* Bytes in an encoded line, and a buffer to pack 1, 2 and 4 bit
+	 * lines into.
+	 */
+	size_t sizeof_line;
+	VipsPel *line;
+
+	/* Text chunks we are building. libspng may refer to these until
+	 * the write is done.
+	 */
+	GArray *text;
+
+	/* The profile= ICC blob. libspng refers to this until the write is
+	 * done too.
+	 */
+	VipsBlob *profile;
+} Write;
+
+static void
+write_finish( Write *write )
+{
+	VIPS_UNREF( write->memory );
+	if( write->target )
+		vips_target_finish( write->target );
+	VIPS_UNREF( write->target );
+	VIPS_FREEF( spng_ctx_free, write->ctx );
+	if( write->profile ) {
+		vips_area_unref( (VipsArea *) write->profile );
+		write->profile = NULL;
+	}
+	VIPS_FREE( write->line );
+	if( write->text ) {
+		guint i;
+
+		for( i = 0; i < write->text->len; i++ )
+			g_free( g_array_index( write->text,
+				struct spng_text, i ).text );
+		VIPS_FREEF( g_array_unref, write->text );
+	}
+	VIPS_FREE( write );
+}
+
+static int
+write_stream( spng_ctx *ctx, void *user, void *data, size_t length )
+{
+	Write *write = (Write *) user;
+
+	if( vips_target_write( write->target, data, length ) )
+		return( SPNG_IO_ERROR );
+
+	return( 0 );
+}
+
+static Write *
+write_new( VipsImage *in, VipsTarget *target )
+{
+	Write *write;
+
+	if( !(write = VIPS_NEW( NULL, Write )) )
+		return( NULL );
+	memset( write, 0, sizeof( Write ) );
+	write->in = in;
+	write->memory = NULL;
+	write->target = target;
+	g_object_ref( target );
+	write->text = g_array_new( FALSE, TRUE, sizeof( struct spng_text ) );
+
+	if( !(write->ctx = spng_ctx_new( SPNG_CTX_ENCODER )) ) {
+		vips_error( "vips2spng", "%s", _( "unable to create encoder" ) );
+		write_finish( write );
+		return( NULL );
+	}
+
+	if( spng_set_png_stream( write->ctx, write_stream, write ) ) {
+		vips_error( "vips2spng", "%s", _( "unable to set stream" ) );
+		write_finish( write );
+		return( NULL );
+	}
+
+	return( write );
+}
+
+/* Queue a tEXt chunk.
+ */
+static void
+write_add_text( Write *write, const char *key, const char *value )
+{
+	struct spng_text text;
+
+	memset( &text, 0, sizeof( text ) );
+	vips_strncpy( text.keyword, key, sizeof( text.keyword ) );
+	text.type = SPNG_TEXT;
+	text.length = strlen( value );
+	text.text = g_strdup( value );
+
+	g_array_append_val( write->text, text );
+}
+
+static void *
+write_png_comment( VipsImage *image,
+	const char *field, GValue *value, void *data )
+{
+	Write *write = (Write *) data;
+
+	if( vips_isprefix( "png-comment-", field ) ) {
+		const char *str;
+		int i;
+		char key[256];
+
+		if( vips_image_get_string( write->in, field, &str ) )
+			return( image );
+
+		if( strlen( field ) > 256 ||
+			sscanf( field, "png-comment-%d-%80s", &i, key ) != 2 ) {
+			vips_error( "vips2spng",
+				"%s", _( "bad png comment key" ) );
+			return( image );
+		}
+
+		write_add_text( write, key, str );
+	}
+
+	return( NULL );
+}
+
+/* Pack 1, 2 and 4 bit pixels into bytes, MSB first, as libpng does.
+ */
+static VipsPel *
+write_pack_line( Write *write, VipsPel *p )
+{
+	const int bitdepth = write->bitdepth;
+	const int mask = (1 << bitdepth) - 1;
+	const int n = write->in->Xsize * write->in->Bands;
+
+	int i;
+
+	if( bitdepth >= 8 )
+		return( p );
+
+	memset( write->line, 0, write->sizeof_line );
+	for( i = 0; i < n; i++ ) {
+		int bit = i * bitdepth;
+
+		write->line[bit >> 3] |=
+			(p[i] & mask) << (8 - bitdepth - (bit & 7));
+	}
+
+	return( write->line );
+}
+
+static int
+write_png_block( VipsRegion *region, VipsRect *area, void *a )
+{
+	Write *write = (Write *) a;
+
+	int y;
+
+	/* The area to write is always a set of complete scanlines.
+	 */
+	g_assert( area->left == 0 );
+	g_assert( area->width == region->im->Xsize );
+	g_assert( area->top + area->height <= region->im->Ysize );
+
+	for( y = 0; y < area->height; y++ ) {
+		VipsPel *line = write_pack_line( write,
+			VIPS_REGION_ADDR( region, 0, area->top + y ) );
+		int error;
+
+		/* The final line returns SPNG_EOI.
+		 */
+		error = spng_encode_row( write->ctx, line, write->sizeof_line );
+		if( error &&
+			error != SPNG_EOI ) {
+			vips_error( "vips2spng", "%s", spng_strerror( error ) );
+			return( -1 );
+		}
+	}
+
+	return( 0 );
+}
+
+/* Interlaced images are written pass by pass, so we need the whole image in
+ * memory. libspng asks for each line as it needs it.
+ */
+static int
+write_interlaced( Write *write, VipsImage *in )
+{
+	int error;
+
+	do {
+		struct spng_row_info row_info;
+		VipsPel *line;
+
+		if( (error = spng_get_row_info( write->ctx, &row_info )) )
+			break;
+
+		line = write_pack_line( write,
+			VIPS_IMAGE_ADDR( in, 0, row_info.row_num ) );
+		error = spng_encode_row( write->ctx, line, write->sizeof_line );
+	} while( !error );
+
+	if( error != SPNG_EOI ) {
+		vips_error( "vips2spng", "%s", spng_strerror( error ) );
+		return( -1 );
+	}
+
+	return( 0 );
+}
+
+/* Write a VIPS image to PNG.
+ */
+static int
+write_vips( Write *write,
+	int compress, int interlace, const char *profile,
+	VipsForeignPngFilter filter, gboolean strip,
+	gboolean palette, int Q, double dither,
+	int bitdepth )
+{
+	VipsImage *in = write->in;
+
+	struct spng_ihdr ihdr;
+	struct spng_phys phys;
+	int error;
+
+        g_assert( in->BandFmt == VIPS_FORMAT_UCHAR ||
+		in->BandFmt == VIPS_FORMAT_USHORT );
+	g_assert( in->Coding == VIPS_CODING_NONE );
+        g_assert( in->Bands > 0 && in->Bands < 5 );
+
+	/* Interlaced images need 7 passes over the image, so we must have it
+	 * in memory.
+	 */
+	if( interlace ) {
+		if( !(write->memory = vips_image_copy_memory( in )) )
+			return( -1 );
+		in = write->memory;
+	}
+	else {
+		if( vips_image_pio_input( in ) )
+			return( -1 );
+	}
+	if( compress < 0 || compress > 9 ) {
+		vips_error( "vips2spng",
+			"%s", _( "compress should be in [0,9]" ) );
+		return( -1 );
+	}
+
+	memset( &ihdr, 0, sizeof( ihdr ) );
+	ihdr.width = in->Xsize;
+	ihdr.height = in->Ysize;
+	ihdr.bit_depth = bitdepth;
+
+	switch( in->Bands ) {
+	case 1: ihdr.color_type = SPNG_COLOR_TYPE_GRAYSCALE; break;
+	case 2: ihdr.color_type = SPNG_COLOR_TYPE_GRAYSCALE_ALPHA; break;
+	case 3: ihdr.color_type = SPNG_COLOR_TYPE_TRUECOLOR; break;
+	case 4: ihdr.color_type = SPNG_COLOR_TYPE_TRUECOLOR_ALPHA; break;
+
+	default:
+		vips_error( "vips2spng",
+			_( "can't save %d band image as png" ), in->Bands );
+		return( -1 );
+	}
+
+#ifdef HAVE_IMAGEQUANT
+	/* Enable image quantisation to paletted 8bpp PNG if colours is set.
+	 */
+	if( palette )
+		ihdr.color_type = SPNG_COLOR_TYPE_INDEXED;
+#else
+	if( palette )
+		g_warning( "%s",
+			_( "ignoring palette (no quantisation support)" ) );
+#endif /*HAVE_IMAGEQUANT*/
+
+	ihdr.interlace_method = interlace ?
+		SPNG_INTERLACE_ADAM7 : SPNG_INTERLACE_NONE;
+
+	if( (error = spng_set_ihdr( write->ctx, &ihdr )) ) {
+		vips_error( "vips2spng", "%s", spng_strerror( error ) );
+		return( -1 );
+	}
+
+	spng_set_option( write->ctx, SPNG_IMG_COMPRESSION_LEVEL, compress );
+	spng_set_option( write->ctx, SPNG_FILTER_CHOICE, filter );
+
+	/* Set resolution. PNG uses pixels per meter.
+	 */
+	phys.ppu_x = VIPS_RINT( in->Xres * 1000 );
+	phys.ppu_y = VIPS_RINT( in->Yres * 1000 );
+	phys.unit_specifier = 1;
+	spng_set_phys( write->ctx, &phys );
+
+	/* Metadata
+	 */
+	if( !strip ) {
+		if( profile ) {
+			if( vips_profile_load( profile, 
+				&write->profile, NULL ) )
+				return( -1 );
+			if( write->profile ) {
+				struct spng_iccp iccp;
+				size_t length;
+				const void *data = vips_blob_get( 
+					write->profile, &length );
+
+				memset( &iccp, 0, sizeof( iccp ) );
+				vips_strncpy( iccp.profile_name, "icc",
+					sizeof( iccp.profile_name ) );
+				iccp.profile_len = length;
+				iccp.profile = (char *) data;
+				error = spng_set_iccp( write->ctx, &iccp );
+				if( error ) {
+					vips_error( "vips2spng",
+						"%s", spng_strerror( error ) );
+					return( -1 );
+				}
+			}
+		}
+		else if( vips_image_get_typeof( in, VIPS_META_ICC_NAME ) ) {
+			struct spng_iccp iccp;
+			const void *data;
+			size_t length;
+
+			if( vips_image_get_blob( in, VIPS_META_ICC_NAME,
+				&data, &length ) )
+				return( -1 );
+
+			memset( &iccp, 0, sizeof( iccp ) );
+			vips_strncpy( iccp.profile_name, "icc",
+				sizeof( iccp.profile_name ) );
+			iccp.profile_len = length;
+			iccp.profile = (char *) data;
+
+			/* We want to drop incompatible profiles rather than
+			 * simply failing.
+			 */
+			if( spng_set_iccp( write->ctx, &iccp ) )
+				g_warning( "bad ICC profile not saved" );
+		}
+
+		if( vips_image_get_typeof( in, VIPS_META_XMP_NAME ) ) {
+			const void *data;
+			size_t length;
+			char *str;
+
+			/* XMP is attached as a BLOB with no null-termination.
+			 * We must re-add this.
+			 */
+			if( vips_image_get_blob( in,
+				VIPS_META_XMP_NAME, &data, &length ) )
+				return( -1 );
+
+			str = g_malloc( length + 1 );
+			vips_strncpy( str, data, length + 1 );
+			write_add_text( write, "XML:com.adobe.xmp", str );
+			g_free( str );
+		}
+
+		if( vips_image_map( in, write_png_comment, write ) )
+			return( -1 );
+
+		if( write->text->len > 0 &&
+			(error = spng_set_text( write->ctx,
+				(struct spng_text *) write->text->data,
+				write->text->len )) ) {
+			vips_error( "vips2spng", "%s", spng_strerror( error ) );
+			return( -1 );
+		}
+	}
+
+#ifdef HAVE_IMAGEQUANT
+	if( palette ) {
+		VipsImage *im_index;
+		VipsImage *im_palette;
+		struct spng_plte plte;
+		struct spng_trns trns;
+		int i;
+
+		if( vips__quantise_image( in, &im_index, &im_palette,
+			1 << bitdepth, Q, dither ) )
+			return( -1 );
+
+		memset( &plte, 0, sizeof( plte ) );
+		memset( &trns, 0, sizeof( trns ) );
+		plte.n_entries = im_palette->Xsize;
+
+		g_assert( plte.n_entries <= 256 );
+
+		for( i = 0; i < im_palette->Xsize; i++ ) {
+			VipsPel *p = (VipsPel *)
+				VIPS_IMAGE_ADDR( im_palette, i, 0 );
+
+			plte.entries[i].red = p[0];
+			plte.entries[i].green = p[1];
+			plte.entries[i].blue = p[2];
+			trns.type3_alpha[i] = p[3];
+			if( p[3] != 255 )
+				trns.n_type3_entries = i + 1;
+		}
+
+#ifdef DEBUG
+		printf( "write_vips: attaching %d color palette\n",
+			plte.n_entries );
+#endif /*DEBUG*/
+
+		spng_set_plte( write->ctx, &plte );
+		if( trns.n_type3_entries )
+			spng_set_trns( write->ctx, &trns );
+
+		VIPS_UNREF( im_palette );
+
+		VIPS_UNREF( write->memory );
+		write->memory = im_index;
+		in = write->memory;
+	}
+#endif /*HAVE_IMAGEQUANT*/
+
+	write->bitdepth = bitdepth;
+	write->sizeof_line =
+		VIPS_ROUND_UP( (size_t) in->Xsize * in->Bands * bitdepth, 8 ) /
+			8;
+	if( bitdepth < 8 &&
+		!(write->line = vips_malloc( NULL, write->sizeof_line )) )
+		return( -1 );
+
+	/* We need write->in to be the image we are sending, for
+	 * write_pack_line().
+	 */
+	write->in = in;
+
+	/* SPNG_FMT_PNG means lines are in the PNG's format, but with 16-bit
+	 * samples in host byte order.
+	 */
+	if( (error = spng_encode_image( write->ctx, NULL, 0, SPNG_FMT_PNG,
+		SPNG_ENCODE_PROGRESSIVE | SPNG_ENCODE_FINALIZE )) ) {
+		vips_error( "vips2spng", "%s", spng_strerror( error ) );
+		return( -1 );
+	}
+
+	if( interlace ) {
+		if( write_interlaced( write, in ) )
+			return( -1 );
+	}
+	else {
+		if( vips_sink_disc( in, write_png_block, write ) )
+			return( -1 );
+	}
+
+	vips_target_finish( write->target );
+
+	return( 0 );
+}
+
+int
+vips__spng_write_target( VipsImage *in, VipsTarget *target,
+	int compression, int interlace,
+	const char *profile, VipsForeignPngFilter filter, gboolean strip,
+	gboolean palette, int Q, double dither,
+	int bitdepth )
+{
+	Write *write;
+
+	if( !(write = write_new( in, target )) )
+		return( -1 );
+
+	if( write_vips( write,
+		compression, interlace, profile, filter, strip, palette,
+		Q, dither, bitdepth ) ) {
+		write_finish( write );
+		vips_error( "vips2spng", _( "unable to write to target %s" ),
+			vips_connection_nick( VIPS_CONNECTION( target ) ) );
+		return( -1 );
+	}
+
+	write_finish( write );
+
+	return( 0 );
+}
+
+#endif /*HAVE_SPNG_ENCODE*/
@@ -197,6 +197,11 @@
  * 	- add support for subifd pyramid layers
  * 6/6/20 MathemanFlo
  * 	- add bitdepth support for 2 and 4 bit greyscale images
+ * 18/10/26
+ * 	- deflate tiles in parallel and write with TIFFWriteRawTile()
+ * 	- write pyramid layers to memory, not temp files, and gather them
+ * 	  with a raw tile copy
+ * 	- layers larger than the disc threshold still go to temp files
  */
 
 /*
@@ -251,6 +256,10 @@
 #include "pforeign.h"
 #include "tiff.h"
 
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif /*HAVE_ZLIB*/
+
 /* TODO:
  *
  * - add a flag for plane-separate write
@@ -278,7 +287,8 @@ typedef struct _Wtiff Wtiff;
 struct _Layer {
 	Wtiff *wtiff;			/* Main wtiff struct */
 
-	/* The filename for this layer, for file output.
+	/* The filename for this layer, for file output, or the temp file
+	 * for a large smaller layer.
 	 */
 	char *lname;			
 
@@ -445,25 +455,31 @@ wtiff_layer_init( Wtiff *wtiff, Layer **layer, Layer *above,
 		(*layer)->below = NULL;
 		(*layer)->above = above;
 
-		/* The name for the top layer is the output filename.
+		/* The name for the top layer is the output filename. 
+		 * Smaller layers are written to memory, then appended
+		 * by wtiff_gather(). Layers larger than the disc threshold 
+		 * go to a temp file instead, so huge pyramids don't need 
+		 * huge amounts of memory.
 		 *
 		 * We need lname to be freed automatically: it has to stay 
 		 * alive until after wtiff_gather().
 		 */
-		if( wtiff->filename ) { 
-			if( !above ) 
+		if( !above ) {
+			if( wtiff->filename ) 
 				(*layer)->lname = vips_strdup( 
 					VIPS_OBJECT( wtiff->ready ),
 					wtiff->filename );
-			else {
-				char *lname;
-
-				lname = vips__temp_name( "%s.tif" );
-				(*layer)->lname = vips_strdup( 
-					VIPS_OBJECT( wtiff->ready ),
-					lname );
-				g_free( lname );
-			}
+		}
+		else if( (guint64) width * height * 
+			VIPS_IMAGE_SIZEOF_PEL( wtiff->ready ) > 
+			vips_get_disc_threshold() ) {
+			char *lname;
+
+			lname = vips__temp_name( "%s.tif" );
+			(*layer)->lname = vips_strdup( 
+				VIPS_OBJECT( wtiff->ready ),
+				lname );
+			g_free( lname );
 		}
 
 		/*
@@ -925,29 +941,33 @@ wtiff_allocate_layers( Wtiff *wtiff )
 	return( 0 );
 }
 
-/* Delete any temp files we wrote.
+/* Free the memory and delete any temp files we wrote the smaller pyramid 
+ * layers to.
  */
 static void
-wtiff_delete_temps( Wtiff *wtiff )
+wtiff_free_buffers( Wtiff *wtiff )
 {
 	Layer *layer;
 
-	/* Don't delete the top layer: that's the output file.
+	/* Don't free the top layer: that's the output.
 	 */
 	if( wtiff->layer &&
 		wtiff->layer->below )
-		for( layer = wtiff->layer->below; layer; layer = layer->below ) 
+		for( layer = wtiff->layer->below; layer; 
+			layer = layer->below ) {
+			VIPS_FREE( layer->buf );
+
 			if( layer->lname ) {
 #ifndef DEBUG
 				unlink( layer->lname );
-				VIPS_FREE( layer->buf );
 #else
-				printf( "wtiff_delete_temps: leaving %s\n", 
+				printf( "wtiff_free_buffers: leaving %s\n", 
 					layer->lname );
 #endif /*DEBUG*/
 
 				layer->lname = NULL;
 			}
+		}
 }
 
 /* Free a single pyramid layer.
@@ -976,7 +996,7 @@ layer_free_all( Layer *layer )
 static void
 wtiff_free( Wtiff *wtiff )
 {
-	wtiff_delete_temps( wtiff );
+	wtiff_free_buffers( wtiff );
 
 	VIPS_UNREF( wtiff->ready );
 	VIPS_FREE( wtiff->tbuf );
@@ -1482,6 +1502,244 @@ wtiff_pack2tiff( Wtiff *wtiff, Layer *layer,
 	}
 }
 
+#ifdef HAVE_ZLIB
+/* A line of tiles being deflated in parallel.
+ */
+typedef struct _WtiffStrip {
+	Wtiff *wtiff;
+	Layer *layer;
+	VipsRegion *strip;
+
+	/* Geometry, fetched from libtiff before we start. 
+	 */
+	tsize_t tile_size;
+	int bytes_per_sample;
+	int samples_per_pixel;
+	uint16 predictor;
+
+	/* Tiles across, and the next one to allocate.
+	 */
+	int tiles_across;
+	int x;
+
+	/* Compressed bytes for each tile.
+	 */
+	VipsPel **buf;
+	size_t *length;
+} WtiffStrip;
+
+/* We can only deflate ourselves if we can apply the predictor too.
+ */
+static gboolean
+wtiff_layer_can_deflate( Wtiff *wtiff, Layer *layer )
+{
+	uint16 bits_per_sample;
+	uint16 predictor;
+
+	if( wtiff->compression != COMPRESSION_ADOBE_DEFLATE ||
+		!TIFFGetFieldDefaulted( layer->tif, 
+			TIFFTAG_BITSPERSAMPLE, &bits_per_sample ) ||
+		!TIFFGetFieldDefaulted( layer->tif, 
+			TIFFTAG_PREDICTOR, &predictor ) )
+		return( FALSE );
+
+	if( predictor == PREDICTOR_NONE )
+		return( TRUE );
+
+	if( predictor == PREDICTOR_HORIZONTAL &&
+		(bits_per_sample == 8 || 
+		 bits_per_sample == 16 || 
+		 bits_per_sample == 32) )
+		return( TRUE );
+
+	return( FALSE );
+}
+
+static int
+wtiff_strip_allocate( VipsThreadState *state, void *a, gboolean *stop )
+{
+	WtiffStrip *strip = (WtiffStrip *) a;
+
+	if( strip->x >= strip->tiles_across ) {
+		*stop = TRUE;
+		return( 0 );
+	}
+
+	state->x = strip->x;
+	strip->x += 1;
+
+	return( 0 );
+}
+
+/* Apply horizontal differencing, as the libtiff predictor would.
+ */
+#define HORIZONTAL_DIFFERENCE( TYPE ) { \
+	TYPE *p = (TYPE *) line; \
+	\
+	for( x = n - 1; x >= stride; x-- ) \
+		p[x] -= p[x - stride]; \
+}
+
+static void
+wtiff_strip_predict( WtiffStrip *strip, VipsPel *tbuf )
+{
+	Wtiff *wtiff = strip->wtiff;
+	int stride = strip->samples_per_pixel;
+	int n = wtiff->tls / strip->bytes_per_sample;
+
+	int x, y;
+
+	for( y = 0; y < wtiff->tileh; y++ ) {
+		VipsPel *line = tbuf + y * wtiff->tls;
+
+		switch( strip->bytes_per_sample ) {
+		case 1:
+			HORIZONTAL_DIFFERENCE( unsigned char );
+			break;
+
+		case 2:
+			HORIZONTAL_DIFFERENCE( unsigned short );
+			break;
+
+		case 4:
+			HORIZONTAL_DIFFERENCE( unsigned int );
+			break;
+
+		default:
+			g_assert_not_reached();
+		}
+	}
+}
+
+/* Pack and deflate one tile.
+ */
+static int
+wtiff_strip_work( VipsThreadState *state, void *a )
+{
+	WtiffStrip *strip = (WtiffStrip *) a;
+	Wtiff *wtiff = strip->wtiff;
+	Layer *layer = strip->layer;
+	VipsImage *im = layer->image;
+
+	VipsRect tile;
+	VipsRect image;
+	VipsPel *tbuf;
+	VipsPel *out;
+	uLongf length;
+
+	image.left = 0;
+	image.top = 0;
+	image.width = im->Xsize;
+	image.height = im->Ysize;
+
+	tile.left = state->x * wtiff->tilew;
+	tile.top = strip->strip->valid.top;
+	tile.width = wtiff->tilew;
+	tile.height = wtiff->tileh;
+	vips_rect_intersectrect( &tile, &image, &tile );
+
+	if( !(tbuf = vips_malloc( NULL, strip->tile_size )) )
+		return( -1 );
+
+	/* Zero edge tiles, so they always compress in the same way.
+	 */
+	if( tile.width < wtiff->tilew || 
+		tile.height < wtiff->tileh )
+		memset( tbuf, 0, strip->tile_size );
+
+	wtiff_pack2tiff( wtiff, layer, strip->strip, &tile, tbuf );
+
+	if( strip->predictor == PREDICTOR_HORIZONTAL )
+		wtiff_strip_predict( strip, tbuf );
+
+	length = compressBound( strip->tile_size );
+	if( !(out = vips_malloc( NULL, length )) ) {
+		g_free( tbuf );
+		return( -1 );
+	}
+
+	if( compress2( out, &length, tbuf, strip->tile_size, 
+		Z_DEFAULT_COMPRESSION ) != Z_OK ) {
+		vips_error( "vips2tiff", "%s", _( "deflate failed" ) );
+		g_free( out );
+		g_free( tbuf );
+		return( -1 );
+	}
+	g_free( tbuf );
+
+	strip->buf[state->x] = out;
+	strip->length[state->x] = length;
+
+	return( 0 );
+}
+
+/* Deflate a set of tiles across the strip in parallel, then write them in
+ * order with TIFFWriteRawTile(). Only the write needs to be single-threaded.
+ */
+static int
+wtiff_layer_deflate_tile( Wtiff *wtiff, Layer *layer, VipsRegion *region )
+{
+	WtiffStrip strip;
+	uint16 bits_per_sample;
+	uint16 samples_per_pixel;
+	int result;
+	int x;
+
+	TIFFGetFieldDefaulted( layer->tif, 
+		TIFFTAG_BITSPERSAMPLE, &bits_per_sample );
+	TIFFGetFieldDefaulted( layer->tif, 
+		TIFFTAG_SAMPLESPERPIXEL, &samples_per_pixel );
+
+	strip.wtiff = wtiff;
+	strip.layer = layer;
+	strip.strip = region;
+	strip.tile_size = TIFFTileSize( layer->tif );
+	strip.bytes_per_sample = VIPS_MAX( 1, bits_per_sample / 8 );
+	strip.samples_per_pixel = samples_per_pixel;
+	TIFFGetFieldDefaulted( layer->tif, 
+		TIFFTAG_PREDICTOR, &strip.predictor );
+	strip.tiles_across = 
+		VIPS_ROUND_UP( layer->image->Xsize, wtiff->tilew ) / 
+			wtiff->tilew;
+	strip.x = 0;
+	strip.buf = VIPS_ARRAY( NULL, strip.tiles_across, VipsPel * );
+	strip.length = VIPS_ARRAY( NULL, strip.tiles_across, size_t );
+	if( !strip.buf ||
+		!strip.length ) {
+		VIPS_FREE( strip.buf );
+		VIPS_FREE( strip.length );
+		return( -1 );
+	}
+	for( x = 0; x < strip.tiles_across; x++ )
+		strip.buf[x] = NULL;
+
+	result = vips_threadpool_run( layer->image, 
+		vips_thread_state_new, wtiff_strip_allocate, wtiff_strip_work, 
+		NULL, &strip );
+
+	for( x = 0; x < strip.tiles_across; x++ ) {
+		if( !result ) {
+			ttile_t tile = TIFFComputeTile( layer->tif,
+				x * wtiff->tilew, region->valid.top, 0, 0 );
+
+			if( TIFFWriteRawTile( layer->tif, tile, 
+				strip.buf[x], strip.length[x] ) < 0 ) {
+				vips_error( "vips2tiff", 
+					"%s", _( "TIFF write tile failed" ) );
+				result = -1;
+			}
+		}
+
+		VIPS_FREE( strip.buf[x] );
+	}
+
+	VIPS_FREE( strip.buf );
+	VIPS_FREE( strip.length );
+
+	return( result );
+}
+#endif /*HAVE_ZLIB*/
+
 /* Write a set of tiles across the strip.
  */
 static int
@@ -1493,6 +1751,11 @@ wtiff_layer_write_tile( Wtiff *wtiff, Layer *layer, VipsRegion *strip )
 	VipsRect image;
 	int x;
 
+#ifdef HAVE_ZLIB
+	if( wtiff_layer_can_deflate( wtiff, layer ) )
+		return( wtiff_layer_deflate_tile( wtiff, layer, strip ) );
+#endif /*HAVE_ZLIB*/
+
 	image.left = 0;
 	image.top = 0;
 	image.width = im->Xsize;
@@ -1798,7 +2061,11 @@ wtiff_copy_tiff( Wtiff *wtiff, TIFF *out, TIFF *in )
 	uint16 ui16;
 	uint16 ui16_2;
 	float f;
+	float *fa;
+	void *v;
+	toff_t *byte_counts;
 	tdata_t buf;
+	tsize_t buf_size;
 	ttile_t tile;
 	ttile_t n;
 	uint16 *a;
@@ -1821,6 +2088,7 @@ wtiff_copy_tiff( Wtiff *wtiff, TIFF *out, TIFF *in )
 	CopyField( TIFFTAG_TILELENGTH, ui32 );
 	CopyField( TIFFTAG_ROWSPERSTRIP, ui32 );
 	CopyField( TIFFTAG_SUBFILETYPE, ui32 );
+	CopyField( TIFFTAG_PREDICTOR, ui16 );
 
 	if( TIFFGetField( in, TIFFTAG_EXTRASAMPLES, &ui16, &a ) ) 
 		TIFFSetField( out, TIFFTAG_EXTRASAMPLES, ui16, a );
@@ -1828,6 +2096,16 @@ wtiff_copy_tiff( Wtiff *wtiff, TIFF *out, TIFF *in )
 	if( TIFFGetField( in, TIFFTAG_PAGENUMBER, &ui16, &ui16_2 ) ) 
 		TIFFSetField( out, TIFFTAG_PAGENUMBER, ui16, ui16_2 );
 
+	/* We copy tiles raw, so we need the fields the JPEG compressor set 
+	 * up on the layer as well.
+	 */
+	if( TIFFGetField( in, TIFFTAG_JPEGTABLES, &ui32, &v ) ) 
+		TIFFSetField( out, TIFFTAG_JPEGTABLES, ui32, v );
+	if( TIFFGetField( in, TIFFTAG_YCBCRSUBSAMPLING, &ui16, &ui16_2 ) ) 
+		TIFFSetField( out, TIFFTAG_YCBCRSUBSAMPLING, ui16, ui16_2 );
+	if( TIFFGetField( in, TIFFTAG_REFERENCEBLACKWHITE, &fa ) ) 
+		TIFFSetField( out, TIFFTAG_REFERENCEBLACKWHITE, fa );
+
 	/* TIFFTAG_JPEGQUALITY is a pesudo-tag, so we can't copy it.
 	 * Set explicitly from Wtiff.
 	 */
@@ -1837,22 +2115,11 @@ wtiff_copy_tiff( Wtiff *wtiff, TIFF *out, TIFF *in )
 		/* Only for three-band, 8-bit images.
 		 */
 		if( wtiff->ready->Bands == 3 &&
-			wtiff->ready->BandFmt == VIPS_FORMAT_UCHAR ) { 
-			/* Enable rgb->ycbcr conversion in the jpeg write. 
-			 */
-			if( !wtiff->rgbjpeg &&
-				wtiff->Q < 90 ) 
-				TIFFSetField( out, 
-					TIFFTAG_JPEGCOLORMODE, 
-						JPEGCOLORMODE_RGB );
-
-			/* And we want ycbcr expanded to rgb on read. Otherwise
-			 * TIFFTileSize() will give us the size of a chrominance
-			 * subsampled tile.
-			 */
-			TIFFSetField( in, 
+			wtiff->ready->BandFmt == VIPS_FORMAT_UCHAR &&
+			!wtiff->rgbjpeg &&
+			wtiff->Q < 90 ) 
+			TIFFSetField( out, 
 				TIFFTAG_JPEGCOLORMODE, JPEGCOLORMODE_RGB );
-		}
 	}
 
 #ifdef HAVE_TIFF_COMPRESSION_WEBP
@@ -1876,18 +2143,27 @@ wtiff_copy_tiff( Wtiff *wtiff, TIFF *out, TIFF *in )
 			wtiff_embed_imagedescription( wtiff, out ) )
 			return( -1 );
 
-	buf = vips_malloc( NULL, TIFFTileSize( in ) );
+	/* Copy the compressed tiles, so there's no decompress and 
+	 * recompress, and no extra loss for JPEG. Compressed tiles can be 
+	 * larger than TIFFTileSize(), so size the buffer from the byte 
+	 * counts.
+	 */
+	if( !TIFFGetField( in, TIFFTAG_TILEBYTECOUNTS, &byte_counts ) ) {
+		vips_error( "vips2tiff", "%s", _( "no tile byte counts" ) );
+		return( -1 );
+	}
 	n = TIFFNumberOfTiles( in );
+	buf_size = 0;
+	for( tile = 0; tile < n; tile++ ) 
+		buf_size = VIPS_MAX( buf_size, byte_counts[tile] );
+	if( !(buf = vips_malloc( NULL, VIPS_MAX( 1, buf_size ) )) )
+		return( -1 );
 	for( tile = 0; tile < n; tile++ ) {
 		tsize_t len;
 
-		/* It'd be good to use TIFFReadRawTile()/TIFFWtiffRawTile() 
-		 * here to save compression/decompression, but sadly it seems
-		 * not to work :-( investigate at some point.
-		 */
-		len = TIFFReadEncodedTile( in, tile, buf, -1 );
+		len = TIFFReadRawTile( in, tile, buf, buf_size );
 		if( len < 0 ||
-			TIFFWriteEncodedTile( out, tile, buf, len ) < 0 ) {
+			TIFFWriteRawTile( out, tile, buf, len ) < 0 ) {
 			g_free( buf );
 			return( -1 );
 		}
@@ -1912,7 +2188,7 @@ wtiff_gather( Wtiff *wtiff )
 			TIFF *in;
 
 #ifdef DEBUG
-			printf( "appending layer %s ...\n", layer->lname );
+			printf( "appending layer sub = %d ...\n", layer->sub );
 #endif /*DEBUG*/
 
 			if( layer->lname ) {
@@ -2002,8 +2278,9 @@ wtiff_write_page( Wtiff *wtiff, VipsImage *page )
 	 */
 	if( wtiff->layer->below ) {
 		/* Free any lower pyramid resources ... this will 
-		 * TIFFClose() (but not delete) the smaller layers 
-		 * ready for us to read from them again.
+		 * TIFFClose() the smaller layers and leave their bytes in
+		 * layer->buf or the temp file ready for us to read from them 
+		 * again.
 		 */
 		layer_free_all( wtiff->layer->below );
 
@@ -2012,9 +2289,10 @@ wtiff_write_page( Wtiff *wtiff, VipsImage *page )
 		if( wtiff_gather( wtiff ) ) 
 			return( -1 );
 
-		/* We can delete any temps now ready for the next page.
+		/* We can free the layer buffers and delete any temps now 
+		 * ready for the next page.
 		 */
-		wtiff_delete_temps( wtiff );
+		wtiff_free_buffers( wtiff );
 
 		/* And free all lower pyr layers ready to be rebuilt for the
 		 * next page.
@@ -79,6 +79,8 @@
  * 	- revise for connection IO
  * 11/5/20
  * 	- only warn for saving bad profiles, don't fail
+ * 18/10/26
+ * 	- filter and deflate non-interlaced images in parallel
  */
 
 /*
@@ -132,6 +134,10 @@
 
 #include <png.h>
 
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif /*HAVE_ZLIB*/
+
 #if PNG_LIBPNG_VER < 10003
 #error "PNG library too old."
 #endif
@@ -776,8 +782,47 @@ typedef struct {
 	png_structp pPng;
 	png_infop pInfo;
 	png_bytep *row_pointer;
+
+#ifdef HAVE_ZLIB
+	/* Set if we are filtering and deflating ourselves. libpng just 
+	 * writes the header chunks.
+	 */
+	gboolean parallel;
+	int compress;
+	VipsForeignPngFilter filter;
+	int bytes_per_sample;
+	int bytes_per_pixel;
+	size_t line_size;
+
+	/* The previous line, packed, or zero at the top of the image.
+	 */
+	VipsPel *last_line;
+
+	/* The filtered lines for this area, with a window of the previous 
+	 * filtered data in front to prime the deflate dictionary.
+	 */
+	VipsPel *filtered;
+	size_t filtered_size;
+	size_t window;
+
+	/* zlib stream state. 
+	 */
+	gboolean started;
+	uLong adler;
+
+	/* The area we are writing, cut into blocks for the threadpool.
+	 */
+	VipsRegion *region;
+	struct _WriteBlock *blocks;
+	int n_blocks;
+	int next;
+#endif /*HAVE_ZLIB*/
 } Write;
 
+#ifdef HAVE_ZLIB
+static void write_blocks_free( Write *write );
+#endif /*HAVE_ZLIB*/
+
 static void
 write_finish( Write *write )
 {
@@ -788,6 +833,11 @@ write_finish( Write *write )
 	if( write->pPng )
 		png_destroy_write_struct( &write->pPng, &write->pInfo );
 	VIPS_FREE( write->row_pointer );
+#ifdef HAVE_ZLIB
+	write_blocks_free( write );
+	VIPS_FREE( write->last_line );
+	VIPS_FREE( write->filtered );
+#endif /*HAVE_ZLIB*/
 	VIPS_FREE( write );
 }
 
@@ -848,6 +898,473 @@ write_new( VipsImage *in, VipsTarget *target )
 	return( write );
 }
 
+#ifdef HAVE_ZLIB
+/* Lines are filtered and deflated in blocks of about this many bytes. 
+ */
+#define WRITE_BLOCK_SIZE (128 * 1024)
+
+/* Each block's deflate is primed with this much of the filtered data before 
+ * it, so blocks can refer back into the previous one.
+ */
+#define WRITE_WINDOW_SIZE (32 * 1024)
+
+/* A set of lines being filtered and deflated.
+ */
+typedef struct _WriteBlock {
+	/* Lines, relative to the top of the area.
+	 */
+	int top;
+	int height;
+
+	/* Compressed result, and the adler32 of the uncompressed bytes.
+	 */
+	VipsPel *buf;
+	size_t length;
+	uLong adler;
+} WriteBlock;
+
+/* Free the block array and any compressed buffers. libpng can longjmp out 
+ * of the IDAT write, so this is called from write_finish() too.
+ */
+static void
+write_blocks_free( Write *write )
+{
+	if( write->blocks ) {
+		int i;
+
+		for( i = 0; i < write->n_blocks; i++ ) 
+			VIPS_FREE( write->blocks[i].buf );
+		VIPS_FREE( write->blocks );
+	}
+}
+
+/* Pack a line of the region into PNG byte order. 8-bit lines are used in 
+ * place.
+ */
+static VipsPel *
+write_pack_line( Write *write, int y, VipsPel *buf )
+{
+	VipsPel *p = VIPS_REGION_ADDR( write->region, 0, y );
+
+	if( write->bytes_per_sample == 2 &&
+		!vips_amiMSBfirst() ) {
+		size_t i;
+
+		for( i = 0; i < write->line_size; i += 2 ) {
+			buf[i] = p[i + 1];
+			buf[i + 1] = p[i];
+		}
+
+		return( buf );
+	}
+	else
+		return( p );
+}
+
+static int
+write_paeth( int a, int b, int c )
+{
+	int p = a + b - c;
+	int pa = abs( p - a );
+	int pb = abs( p - b );
+	int pc = abs( p - c );
+
+	if( pa <= pb && 
+		pa <= pc )
+		return( a );
+	else if( pb <= pc )
+		return( b );
+	else
+		return( c );
+}
+
+/* Filter a line with one of the five PNG filter types. @prev is the line
+ * above, or zeros.
+ */
+static void
+write_filter_apply( int type, int bpp, size_t n,
+	const VipsPel * restrict prev, const VipsPel * restrict cur, 
+	VipsPel * restrict out )
+{
+	const size_t b = bpp;
+
+	size_t i;
+
+	switch( type ) {
+	case 0:
+		memcpy( out, cur, n );
+		break;
+
+	case 1:
+		for( i = 0; i < b; i++ )
+			out[i] = cur[i];
+		for( ; i < n; i++ )
+			out[i] = cur[i] - cur[i - b];
+		break;
+
+	case 2:
+		for( i = 0; i < n; i++ )
+			out[i] = cur[i] - prev[i];
+		break;
+
+	case 3:
+		for( i = 0; i < b; i++ )
+			out[i] = cur[i] - (prev[i] >> 1);
+		for( ; i < n; i++ )
+			out[i] = cur[i] - ((cur[i - b] + prev[i]) >> 1);
+		break;
+
+	case 4:
+		for( i = 0; i < b; i++ )
+			out[i] = cur[i] - prev[i];
+		for( ; i < n; i++ )
+			out[i] = cur[i] - write_paeth( cur[i - b], 
+				prev[i], prev[i - b] );
+		break;
+
+	default:
+		g_assert_not_reached();
+	}
+}
+
+/* The libpng heuristic for adaptive filtering: the sum of the residuals 
+ * as signed bytes.
+ */
+static size_t
+write_filter_cost( const VipsPel *out, size_t n )
+{
+	size_t sum;
+	size_t i;
+
+	sum = 0;
+	for( i = 0; i < n; i++ )
+		sum += abs( (signed char) out[i] );
+
+	return( sum );
+}
+
+/* Filter a line into @out, with the filter type byte first. If more than 
+ * one filter is enabled, pick the one with the lowest cost. @scratch is 
+ * a line of workspace.
+ */
+static void
+write_filter_line( Write *write, 
+	const VipsPel *prev, const VipsPel *cur, 
+	VipsPel *out, VipsPel *scratch )
+{
+	const size_t n = write->line_size;
+	const int bpp = write->bytes_per_pixel;
+
+	int type;
+	int best_type;
+	size_t best_cost;
+
+	best_type = -1;
+	best_cost = 0;
+	for( type = 0; type < 5; type++ ) {
+		size_t cost;
+
+		if( !(write->filter & (VIPS_FOREIGN_PNG_FILTER_NONE << type)) )
+			continue;
+
+		/* Build candidates in scratch, and copy the best to out.
+		 */
+		write_filter_apply( type, bpp, n, prev, cur, scratch );
+		cost = write_filter_cost( scratch, n );
+		if( best_type == -1 ||
+			cost < best_cost ) {
+			memcpy( out + 1, scratch, n );
+			best_type = type;
+			best_cost = cost;
+		}
+	}
+
+	/* No filters enabled means no filtering.
+	 */
+	if( best_type == -1 ) {
+		best_type = 0;
+		memcpy( out + 1, cur, n );
+	}
+
+	out[0] = best_type;
+}
+
+static int
+write_block_allocate( VipsThreadState *state, void *a, gboolean *stop )
+{
+	Write *write = (Write *) a;
+
+	if( write->next >= write->n_blocks ) {
+		*stop = TRUE;
+		return( 0 );
+	}
+
+	state->x = write->next;
+	write->next += 1;
+
+	return( 0 );
+}
+
+/* Filter the lines in one block.
+ */
+static int
+write_block_filter( VipsThreadState *state, void *a )
+{
+	Write *write = (Write *) a;
+	WriteBlock *block = &write->blocks[state->x];
+	VipsRect *area = &write->region->valid;
+	size_t stride = write->line_size + 1;
+
+	VipsPel *lines;
+	VipsPel *prev_buf;
+	VipsPel *cur_buf;
+	VipsPel *scratch;
+	const VipsPel *prev;
+	int y;
+
+	if( !(lines = vips_malloc( NULL, 3 * write->line_size )) )
+		return( -1 );
+	prev_buf = lines;
+	cur_buf = prev_buf + write->line_size;
+	scratch = cur_buf + write->line_size;
+
+	if( block->top == 0 )
+		prev = write->last_line;
+	else 
+		prev = write_pack_line( write, 
+			area->top + block->top - 1, prev_buf );
+
+	for( y = 0; y < block->height; y++ ) {
+		VipsPel *cur = write_pack_line( write, 
+			area->top + block->top + y, cur_buf );
+
+		write_filter_line( write, prev, cur,
+			write->filtered + WRITE_WINDOW_SIZE + 
+				(block->top + y) * stride, 
+			scratch );
+
+		/* The next line's prev is this line, so swap buffers if 
+		 * we packed.
+		 */
+		if( cur == cur_buf ) {
+			cur_buf = prev_buf;
+			prev_buf = cur;
+		}
+		prev = cur;
+	}
+
+	g_free( lines );
+
+	return( 0 );
+}
+
+/* Deflate the filtered lines in one block. The zlib stream is made of raw 
+ * deflate blocks ending on a sync flush, and only the final block sets 
+ * Z_FINISH, so the pieces can simply be joined.
+ */
+static int
+write_block_deflate( VipsThreadState *state, void *a )
+{
+	Write *write = (Write *) a;
+	WriteBlock *block = &write->blocks[state->x];
+	VipsRect *area = &write->region->valid;
+	size_t stride = write->line_size + 1;
+	size_t start = WRITE_WINDOW_SIZE + block->top * stride;
+	size_t length = block->height * stride;
+	size_t valid_start = WRITE_WINDOW_SIZE - write->window;
+	gboolean last = state->x == write->n_blocks - 1 &&
+		VIPS_RECT_BOTTOM( area ) == write->region->im->Ysize;
+
+	z_stream stream;
+	size_t dict_length;
+	size_t buf_length;
+	int result;
+
+	memset( &stream, 0, sizeof( stream ) );
+	if( deflateInit2( &stream, write->compress, Z_DEFLATED, -MAX_WBITS, 8, 
+		write->filter == VIPS_FOREIGN_PNG_FILTER_NONE ? 
+			Z_DEFAULT_STRATEGY : Z_FILTERED ) != Z_OK ) {
+		vips_error( "vips2png", "%s", _( "deflate failed" ) );
+		return( -1 );
+	}
+
+	dict_length = VIPS_MIN( WRITE_WINDOW_SIZE, start - valid_start );
+	if( dict_length > 0 &&
+		deflateSetDictionary( &stream, 
+			write->filtered + start - dict_length, 
+			dict_length ) != Z_OK ) {
+		deflateEnd( &stream );
+		vips_error( "vips2png", "%s", _( "deflate failed" ) );
+		return( -1 );
+	}
+
+	/* A sync flush adds an empty stored block. 
+	 */
+	buf_length = deflateBound( &stream, length ) + 16;
+	if( !(block->buf = vips_malloc( NULL, buf_length )) ) {
+		deflateEnd( &stream );
+		return( -1 );
+	}
+
+	stream.next_in = write->filtered + start;
+	stream.avail_in = length;
+	stream.next_out = block->buf;
+	stream.avail_out = buf_length;
+	result = deflate( &stream, last ? Z_FINISH : Z_SYNC_FLUSH );
+	block->length = stream.total_out;
+	deflateEnd( &stream );
+
+	if( (last && result != Z_STREAM_END) ||
+		(!last && (result != Z_OK || stream.avail_out == 0)) ) {
+		vips_error( "vips2png", "%s", _( "deflate failed" ) );
+		return( -1 );
+	}
+
+	block->adler = adler32( adler32( 0L, Z_NULL, 0 ), 
+		write->filtered + start, length );
+
+	return( 0 );
+}
+
+/* Write the blocks as IDAT chunks, with the zlib header at the start of the 
+ * first and the adler32 at the end of the last.
+ */
+static void
+write_block_idat( Write *write )
+{
+	VipsRect *area = &write->region->valid;
+	size_t stride = write->line_size + 1;
+
+	int i;
+
+	for( i = 0; i < write->n_blocks; i++ ) {
+		WriteBlock *block = &write->blocks[i];
+		gboolean first = !write->started;
+		gboolean last = i == write->n_blocks - 1 &&
+			VIPS_RECT_BOTTOM( area ) == write->region->im->Ysize;
+
+		png_write_chunk_start( write->pPng, (png_bytep) "IDAT",
+			block->length + (first ? 2 : 0) + (last ? 4 : 0) );
+
+		if( first ) {
+			int level = write->compress;
+			int flevel = level < 2 ? 0 : level < 6 ? 1 : 
+				level == 6 ? 2 : 3;
+			int header = (0x78 << 8) | (flevel << 6);
+			png_byte buf[2];
+
+			header += 31 - header % 31;
+			buf[0] = header >> 8;
+			buf[1] = header & 0xff;
+			png_write_chunk_data( write->pPng, buf, 2 );
+
+			write->adler = adler32( 0L, Z_NULL, 0 );
+			write->started = TRUE;
+		}
+
+		png_write_chunk_data( write->pPng, block->buf, block->length );
+		write->adler = adler32_combine( write->adler, block->adler, 
+			block->height * stride );
+
+		if( last ) {
+			png_byte buf[4];
+
+			buf[0] = (write->adler >> 24) & 0xff;
+			buf[1] = (write->adler >> 16) & 0xff;
+			buf[2] = (write->adler >> 8) & 0xff;
+			buf[3] = write->adler & 0xff;
+			png_write_chunk_data( write->pPng, buf, 4 );
+		}
+
+		png_write_chunk_end( write->pPng );
+	}
+}
+
+/* Filter and deflate an area in parallel, then write it. Only the final 
+ * write needs to be single-threaded.
+ */
+static int
+write_png_block_parallel( VipsRegion *region, VipsRect *area, Write *write )
+{
+	size_t stride = write->line_size + 1;
+	size_t length = area->height * stride;
+	int block_height = VIPS_MAX( 1, WRITE_BLOCK_SIZE / stride );
+
+	VipsPel *p;
+	size_t window;
+	int result;
+	int i;
+
+	if( !write->last_line ) {
+		if( !(write->last_line = vips_malloc( NULL, write->line_size )) )
+			return( -1 );
+		memset( write->last_line, 0, write->line_size );
+	}
+
+	/* Grow the filter buffer, keeping the window at the front.
+	 */
+	if( WRITE_WINDOW_SIZE + length > write->filtered_size ) {
+		VipsPel *filtered;
+
+		if( !(filtered = g_try_realloc( write->filtered, 
+			WRITE_WINDOW_SIZE + length )) ) {
+			vips_error( "vips2png", "%s", _( "out of memory" ) );
+			return( -1 );
+		}
+		write->filtered = filtered;
+		write->filtered_size = WRITE_WINDOW_SIZE + length;
+	}
+
+	write->region = region;
+	write->n_blocks = VIPS_ROUND_UP( area->height, block_height ) / 
+		block_height;
+	if( !(write->blocks = VIPS_ARRAY( NULL, write->n_blocks, WriteBlock )) )
+		return( -1 );
+	for( i = 0; i < write->n_blocks; i++ ) {
+		write->blocks[i].top = i * block_height;
+		write->blocks[i].height = VIPS_MIN( block_height, 
+			area->height - i * block_height );
+		write->blocks[i].buf = NULL;
+	}
+
+	write->next = 0;
+	result = vips_threadpool_run( region->im, 
+		vips_thread_state_new, write_block_allocate, write_block_filter,
+		NULL, write );
+
+	if( !result ) {
+		write->next = 0;
+		result = vips_threadpool_run( region->im, 
+			vips_thread_state_new, 
+			write_block_allocate, write_block_deflate,
+			NULL, write );
+	}
+
+	if( !result ) 
+		write_block_idat( write );
+
+	write_blocks_free( write );
+
+	if( result )
+		return( -1 );
+
+	/* The last line and the end of the filtered data prime the next area.
+	 */
+	p = write_pack_line( write, VIPS_RECT_BOTTOM( area ) - 1, 
+		write->last_line );
+	if( p != write->last_line )
+		memcpy( write->last_line, p, write->line_size );
+
+	window = VIPS_MIN( WRITE_WINDOW_SIZE, write->window + length );
+	memmove( write->filtered + WRITE_WINDOW_SIZE - window,
+		write->filtered + WRITE_WINDOW_SIZE + length - window,
+		window );
+	write->window = window;
+
+	return( 0 );
+}
+#endif /*HAVE_ZLIB*/
+
 static int
 write_png_block( VipsRegion *region, VipsRect *area, void *a )
 {
@@ -866,6 +1383,11 @@ write_png_block( VipsRegion *region, VipsRect *area, void *a )
 	if( setjmp( png_jmpbuf( write->pPng ) ) ) 
 		return( -1 );
 
+#ifdef HAVE_ZLIB
+	if( write->parallel )
+		return( write_png_block_parallel( region, area, write ) );
+#endif /*HAVE_ZLIB*/
+
 	for( i = 0; i < area->height; i++ ) 
 		write->row_pointer[i] = (png_bytep)
 			VIPS_REGION_ADDR( region, 0, area->top + i );
@@ -1163,6 +1685,21 @@ write_vips( Write *write,
 
 	png_write_info( write->pPng, write->pInfo );
 
+#ifdef HAVE_ZLIB
+	/* We can filter and deflate 8 and 16-bit images ourselves, in 
+	 * parallel. Interlaced images need libpng to make the passes.
+	 */
+	if( !interlace &&
+		bitdepth >= 8 ) {
+		write->parallel = TRUE;
+		write->compress = compress;
+		write->filter = filter;
+		write->bytes_per_sample = bitdepth / 8;
+		write->bytes_per_pixel = write->bytes_per_sample * in->Bands;
+		write->line_size = (size_t) write->bytes_per_pixel * in->Xsize;
+	}
+#endif /*HAVE_ZLIB*/
+
 	/* If we're an intel byte order CPU and this is a 16bit image, we need
 	 * to swap bytes.
 	 */
@@ -1190,7 +1727,15 @@ write_vips( Write *write,
 	if( setjmp( png_jmpbuf( write->pPng ) ) ) 
 		return( -1 );
 
-	png_write_end( write->pPng, write->pInfo );
+#ifdef HAVE_ZLIB
+	/* libpng won't end a file it didn't write the IDAT for, and all the 
+	 * metadata went before the image, so we just need IEND.
+	 */
+	if( write->parallel )
+		png_write_chunk( write->pPng, (png_bytep) "IEND", NULL, 0 );
+	else
+#endif /*HAVE_ZLIB*/
+		png_write_end( write->pPng, write->pInfo );
 
 	vips_target_finish( write->target );
 
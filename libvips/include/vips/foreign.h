@@ -395,6 +395,9 @@ int vips_jpegsave_buffer( VipsImage *in, void **buf, size_t *len, ... )
 int vips_jpegsave_mime( VipsImage *in, ... )
 	__attribute__((sentinel));
 
+int vips_jpegtran_source( VipsSource *source, VipsTarget *target, ... )
+	__attribute__((sentinel));
+
 /**
  * VipsForeignWebpPreset:
  * @VIPS_FOREIGN_WEBP_PRESET_DEFAULT: default preset
@@ -206,10 +206,17 @@ void vips__draw_circle_direct( VipsImage *image, int cx, int cy, int r,
 int vips__insert_just_one( VipsRegion *out, VipsRegion *in, int x, int y );
 int vips__insert_paste_region( VipsRegion *out, VipsRegion *in, VipsRect *pos );
 
+void vips__rot_transpose( VipsPel *q, int qls, VipsPel *p, int dx, int dy, 
+	int width, int height, int ps );
+
 /* Register base vips interpolators, called during startup.
  */
 void vips__interpolate_init( void );
 
+/* Free the shared reduce mask tables and vector programs.
+ */
+void vips__reduce_shutdown( void );
+
 /* Start up various packages.
  */
 void vips_arithmetic_operation_init( void );
@@ -16,6 +16,8 @@
  * 	- fmt to error_exit() may be NULL
  * 12/9/19 [dineshkannaa]
  * 	- add vips_error_buffer_copy()
+ * 18/10/26
+ * 	- vips_error_buffer_copy() no longer relocks the global lock
  */
 
 /*
@@ -200,7 +202,7 @@ vips_error_buffer_copy( void )
 
 	g_mutex_lock( vips__global_lock );
 	msg = g_strdup( vips_buf_all( &vips_error_buf ) );
-	vips_error_clear();
+	vips_buf_rewind( &vips_error_buf );
 	g_mutex_unlock( vips__global_lock );
 
 	return( msg );
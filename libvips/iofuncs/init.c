@@ -738,6 +738,8 @@ vips_shutdown( void )
 
 	vips__render_shutdown();
 
+	vips__reduce_shutdown();
+
 	vips_thread_shutdown();
 
 	vips__thread_profile_stop();
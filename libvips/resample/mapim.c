@@ -7,6 +7,9 @@
  * 	- a bit quicker
  * 17/12/18
  * 	- we were not offsetting pixel fetches by window_offset
+ * 18/10/26
+ * 	- split output tiles which need large, sparse input areas
+ * 	- cache index bounds per cell, so splitting doesn't rescan the index
  */
 
 /*
@@ -75,6 +78,13 @@ typedef VipsResampleClass VipsMapimClass;
 
 G_DEFINE_TYPE( VipsMapim, vips_mapim, VIPS_TYPE_RESAMPLE );
 
+/* Only try to split output areas which need more than this many times 
+ * their own area from the input. We find index bounds for cells of this 
+ * size, and don't split below it.
+ */
+#define VIPS_MAPIM_SPLIT_RATIO (4)
+#define VIPS_MAPIM_CELL (8)
+
 /* Minmax of a line of pixels. Pass in a thing to convert back to int 
  * coordinates.
  */
@@ -261,17 +271,85 @@ vips_mapim_region_minmax( VipsRegion *region, VipsRect *r, VipsRect *bounds )
 	} \
 }
 
-static int
-vips_mapim_gen( VipsRegion *or, void *seq, void *a, void *b, gboolean *stop )
+/* The index bounds of each VIPS_MAPIM_CELL square of an output tile. We 
+ * scan the index once per tile, and the bounds of any block of cells is 
+ * then a cheap union.
+ */
+typedef struct _VipsMapimGrid {
+	VipsRect area;
+	int n_x;
+	int n_y;
+	VipsRect *cells;
+} VipsMapimGrid;
+
+/* The part of the output tile covered by a block of cells.
+ */
+static void
+vips_mapim_grid_rect( VipsMapimGrid *grid, 
+	int cx, int cy, int cw, int ch, VipsRect *r )
+{
+	r->left = grid->area.left + cx * VIPS_MAPIM_CELL;
+	r->top = grid->area.top + cy * VIPS_MAPIM_CELL;
+	r->width = VIPS_MIN( cw * VIPS_MAPIM_CELL, 
+		VIPS_RECT_RIGHT( &grid->area ) - r->left );
+	r->height = VIPS_MIN( ch * VIPS_MAPIM_CELL, 
+		VIPS_RECT_BOTTOM( &grid->area ) - r->top );
+}
+
+/* Find the area of @in we need to make a block of cells, including enough 
+ * for the interpolation stencil, clipped against the expanded image.
+ */
+static void
+vips_mapim_grid_need( const VipsMapim *mapim, VipsMapimGrid *grid, 
+	int cx, int cy, int cw, int ch, VipsRect *need )
 {
-	VipsRect *r = &or->valid;
-	VipsRegion **ir = (VipsRegion **) seq;
-	const VipsImage **in_array = (const VipsImage **) a;
-	const VipsMapim *mapim = (VipsMapim *) b; 
-	const VipsResample *resample = VIPS_RESAMPLE( mapim );
-	const VipsImage *in = in_array[0];
 	const int window_size = 
 		vips_interpolate_get_window_size( mapim->interpolate );
+	const VipsImage *in = mapim->in_array[0];
+
+	VipsRect bounds, image;
+	int x, y;
+
+	bounds = grid->cells[cy * grid->n_x + cx];
+	for( y = cy; y < cy + ch; y++ )
+		for( x = cx; x < cx + cw; x++ )
+			vips_rect_unionrect( &bounds, 
+				&grid->cells[y * grid->n_x + x], &bounds );
+
+	bounds.width += window_size - 1;
+	bounds.height += window_size - 1;
+
+	image.left = 0;
+	image.top = 0;
+	image.width = in->Xsize;
+	image.height = in->Ysize;
+	vips_rect_intersectrect( &bounds, &image, need );
+}
+
+static guint64
+vips_mapim_area( VipsRect *r )
+{
+	return( vips_rect_isempty( r ) ? 
+		0 : (guint64) r->width * r->height );
+}
+
+/* Generate a block of cells of @or, given that we will need @need from the 
+ * input.
+ *
+ * Strongly curved warps can need a huge input area for a single output 
+ * tile, most of which is never used. If splitting the block in two will 
+ * substantially reduce the amount of input we need, we recurse and make 
+ * each half separately. This keeps input regions small, and stops output 
+ * tiles which need disjoint parts of the input forcing a fetch of the whole 
+ * area between them.
+ */
+static int
+vips_mapim_gen_rect( VipsRegion *or, VipsRegion **ir, 
+	const VipsMapim *mapim, VipsMapimGrid *grid, 
+	int cx, int cy, int cw, int ch, VipsRect *need )
+{
+	const VipsResample *resample = VIPS_RESAMPLE( mapim );
+	const VipsImage *in = mapim->in_array[0];
 	const int window_offset = 
 		vips_interpolate_get_window_offset( mapim->interpolate );
 	const VipsInterpolateMethod interpolate = 
@@ -279,63 +357,67 @@ vips_mapim_gen( VipsRegion *or, void *seq, void *a, void *b, gboolean *stop )
 	const int ps = VIPS_IMAGE_SIZEOF_PEL( in );
 	const int clip_width = resample->in->Xsize;
 	const int clip_height = resample->in->Ysize;
+	const guint64 need_area = vips_mapim_area( need );
 
-	VipsRect bounds, image, clipped;
+	VipsRect area;
+	VipsRect *r;
 	int x, y, z;
-	
-#ifdef DEBUG_VERBOSE
-	printf( "vips_mapim_gen: "
-		"generating left=%d, top=%d, width=%d, height=%d\n", 
-		r->left,
-		r->top,
-		r->width,
-		r->height );
-#endif /*DEBUG_VERBOSE*/
-
-	/* Fetch the chunk of the mapim image we need, and find the max/min in
-	 * x and y.
-	 */
-	if( vips_region_prepare( ir[1], r ) )
-		return( -1 );
 
-	VIPS_GATE_START( "vips_mapim_gen: work" ); 
-
-	vips_mapim_region_minmax( ir[1], r, &bounds ); 
-
-	VIPS_GATE_STOP( "vips_mapim_gen: work" ); 
-
-	/* The bounding box of that area is what we will need from @in. Add
-	 * enough for the interpolation stencil as well.
-	 * 
-	 */
-	bounds.width += window_size - 1;
-	bounds.height += window_size - 1;
+	vips_mapim_grid_rect( grid, cx, cy, cw, ch, &area );
+	r = &area;
+
+	if( need_area > VIPS_MAPIM_SPLIT_RATIO * vips_mapim_area( r ) &&
+		VIPS_MAX( cw, ch ) >= 2 ) {
+		int ax, ay, aw, ah;
+		int bx, by, bw, bh;
+		VipsRect need_a, need_b;
+
+		ax = bx = cx;
+		ay = by = cy;
+		aw = bw = cw;
+		ah = bh = ch;
+		if( cw >= ch ) {
+			aw = cw / 2;
+			bx = cx + aw;
+			bw = cw - aw;
+		}
+		else {
+			ah = ch / 2;
+			by = cy + ah;
+			bh = ch - ah;
+		}
 
-	/* Clip against the expanded image.
-	 */
-	image.left = 0;
-	image.top = 0;
-	image.width = in->Xsize;
-	image.height = in->Ysize;
-	vips_rect_intersectrect( &bounds, &image, &clipped );
+		vips_mapim_grid_need( mapim, grid, ax, ay, aw, ah, &need_a );
+		vips_mapim_grid_need( mapim, grid, bx, by, bw, bh, &need_b );
+
+		/* Only split if we'll save at least a quarter of the input.
+		 * Plain downsizing, for example, gains nothing.
+		 */
+		if( 4 * (vips_mapim_area( &need_a ) + 
+			vips_mapim_area( &need_b )) < 3 * need_area ) 
+			return( vips_mapim_gen_rect( or, ir, mapim, grid,
+					ax, ay, aw, ah, &need_a ) ||
+				vips_mapim_gen_rect( or, ir, mapim, grid,
+					bx, by, bw, bh, &need_b ) );
+	}
 
 #ifdef DEBUG_VERBOSE
-	printf( "vips_mapim_gen: "
+	printf( "vips_mapim_gen_rect: "
 		"preparing left=%d, top=%d, width=%d, height=%d\n", 
-		clipped.left,
-		clipped.top,
-		clipped.width,
-		clipped.height );
+		need->left,
+		need->top,
+		need->width,
+		need->height );
 #endif /*DEBUG_VERBOSE*/
 
-	if( vips_rect_isempty( &clipped ) ) {
-		vips_region_black( or );
+	if( vips_rect_isempty( need ) ) {
+		vips_region_paint( or, r, 0 );
 		return( 0 );
 	}
-	if( vips_region_prepare( ir[0], &clipped ) )
+	if( vips_region_prepare( ir[0], need ) )
 		return( -1 );
 
-	VIPS_GATE_START( "vips_mapim_gen: work" ); 
+	VIPS_GATE_START( "vips_mapim_gen_rect: work" ); 
 
 	/* Resample! x/y loop over pixels in the output image (5).
 	 */
@@ -373,11 +455,69 @@ vips_mapim_gen( VipsRegion *or, void *seq, void *a, void *b, gboolean *stop )
 		}
 	}
 
-	VIPS_GATE_STOP( "vips_mapim_gen: work" ); 
+	VIPS_GATE_STOP( "vips_mapim_gen_rect: work" ); 
 
 	return( 0 );
 }
 
+static int
+vips_mapim_gen( VipsRegion *or, void *seq, void *a, void *b, gboolean *stop )
+{
+	VipsRect *r = &or->valid;
+	VipsRegion **ir = (VipsRegion **) seq;
+	const VipsMapim *mapim = (VipsMapim *) b; 
+
+	VipsMapimGrid grid;
+	VipsRect need;
+	int x, y;
+	int result;
+	
+#ifdef DEBUG_VERBOSE
+	printf( "vips_mapim_gen: "
+		"generating left=%d, top=%d, width=%d, height=%d\n", 
+		r->left,
+		r->top,
+		r->width,
+		r->height );
+#endif /*DEBUG_VERBOSE*/
+
+	/* Fetch the chunk of the mapim image we need, and find the max/min in
+	 * x and y for each cell.
+	 */
+	if( vips_region_prepare( ir[1], r ) )
+		return( -1 );
+
+	grid.area = *r;
+	grid.n_x = VIPS_ROUND_UP( r->width, VIPS_MAPIM_CELL ) / 
+		VIPS_MAPIM_CELL;
+	grid.n_y = VIPS_ROUND_UP( r->height, VIPS_MAPIM_CELL ) / 
+		VIPS_MAPIM_CELL;
+	if( !(grid.cells = VIPS_ARRAY( NULL, grid.n_x * grid.n_y, VipsRect )) )
+		return( -1 );
+
+	VIPS_GATE_START( "vips_mapim_gen: minmax" ); 
+
+	for( y = 0; y < grid.n_y; y++ )
+		for( x = 0; x < grid.n_x; x++ ) {
+			VipsRect cell;
+
+			vips_mapim_grid_rect( &grid, x, y, 1, 1, &cell );
+			vips_mapim_region_minmax( ir[1], &cell, 
+				&grid.cells[y * grid.n_x + x] ); 
+		}
+
+	VIPS_GATE_STOP( "vips_mapim_gen: minmax" ); 
+
+	vips_mapim_grid_need( mapim, &grid, 
+		0, 0, grid.n_x, grid.n_y, &need );
+	result = vips_mapim_gen_rect( or, ir, mapim, &grid, 
+		0, 0, grid.n_x, grid.n_y, &need );
+
+	g_free( grid.cells );
+
+	return( result );
+}
+
 static int
 vips_mapim_build( VipsObject *object )
 {
@@ -73,6 +73,39 @@ int vips_reduce_get_points( VipsKernel kernel, double shrink );
 void vips_reduce_make_mask( double *c, 
 	VipsKernel kernel, double shrink, double x );
 
+/* Precalculated interpolation matrices for a kernel and shrink factor. int
+ * (used for pel sizes up to short), double (for all others), and 2.6 fixed
+ * point for orc. We go to scale + 1 so we can round-to-nearest safely.
+ *
+ * These are shared between all reduce operations, see 
+ * vips_reduce_mask_get().
+ */
+typedef struct _VipsReduceMask {
+	int ref_count;
+
+	VipsKernel kernel;
+	double shrink;
+	int n_point;
+
+	int *matrixi[VIPS_TRANSFORM_SCALE + 1];
+	double *matrixf[VIPS_TRANSFORM_SCALE + 1];
+	int *matrixo[VIPS_TRANSFORM_SCALE + 1];
+} VipsReduceMask;
+
+VipsReduceMask *vips_reduce_mask_get( VipsKernel kernel, double shrink );
+void vips_reduce_mask_unref( VipsReduceMask *mask );
+
+/* vips_resize() leaves between this and twice this for the kernel by 
+ * default.
+ */
+#define VIPS_RESIZE_GAP (2.0)
+
+int vips__resize_int_shrink( double scale, double gap );
+int vips__resize_size( int size, double scale, double gap );
+
+void vips__reduce_mask_shutdown( void );
+void vips__reducev_program_shutdown( void );
+
 #ifdef __cplusplus
 }
 #endif /*__cplusplus*/
@@ -140,6 +140,13 @@ typedef VipsResampleClass VipsReduceClass;
 
 G_DEFINE_TYPE( VipsReduce, vips_reduce, VIPS_TYPE_RESAMPLE );
 
+void
+vips__reduce_shutdown( void )
+{
+	vips__reduce_mask_shutdown();
+	vips__reducev_program_shutdown();
+}
+
 static int
 vips_reduce_build( VipsObject *object )
 {
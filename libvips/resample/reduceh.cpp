@@ -11,6 +11,8 @@
  * 6/6/20 kleisauke
  * 	- deprecate @centre option, it's now always on
  * 	- fix pixel shift
+ * 18/10/26
+ * 	- share mask tables between operations
  */
 
 /*
@@ -56,10 +58,16 @@
 #include <vips/vips.h>
 #include <vips/debug.h>
 #include <vips/internal.h>
+#include <vips/vector.h>
 
 #include "presample.h"
 #include "templates.h"
 
+/* Don't cache more than this many masks, and don't cache large masks at all.
+ */
+#define VIPS_REDUCE_MASK_MAX (100)
+#define VIPS_REDUCE_MASK_MAX_POINT (100)
+
 typedef struct _VipsReduceh {
 	VipsResample parent_instance;
 
@@ -77,12 +85,9 @@ typedef struct _VipsReduceh {
 	 */
 	double hoffset;
 
-	/* Precalculated interpolation matrices. int (used for pel
-	 * sizes up to short), and double (for all others). We go to
-	 * scale + 1 so we can round-to-nearest safely.
+	/* Precalculated interpolation matrices.
 	 */
-	int *matrixi[VIPS_TRANSFORM_SCALE + 1];
-	double *matrixf[VIPS_TRANSFORM_SCALE + 1];
+	VipsReduceMask *mask;
 
 	/* Deprecated.
 	 */
@@ -167,6 +172,155 @@ vips_reduce_make_mask( double *c, VipsKernel kernel, double shrink, double x )
 	}
 }
 
+static void
+vips_reduce_mask_free( VipsReduceMask *mask )
+{
+	for( int i = 0; i < VIPS_TRANSFORM_SCALE + 1; i++ ) {
+		VIPS_FREE( mask->matrixi[i] );
+		VIPS_FREE( mask->matrixf[i] );
+		VIPS_FREE( mask->matrixo[i] );
+	}
+	g_free( mask );
+}
+
+static VipsReduceMask *
+vips_reduce_mask_new( VipsKernel kernel, double shrink )
+{
+	VipsReduceMask *mask;
+
+	mask = g_new0( VipsReduceMask, 1 );
+	mask->ref_count = 1;
+	mask->kernel = kernel;
+	mask->shrink = shrink;
+	mask->n_point = vips_reduce_get_points( kernel, shrink ); 
+
+	for( int x = 0; x < VIPS_TRANSFORM_SCALE + 1; x++ ) {
+		mask->matrixf[x] = VIPS_ARRAY( NULL, mask->n_point, double ); 
+		mask->matrixi[x] = VIPS_ARRAY( NULL, mask->n_point, int ); 
+		mask->matrixo[x] = VIPS_ARRAY( NULL, mask->n_point, int ); 
+		if( !mask->matrixf[x] ||
+			!mask->matrixi[x] ||
+			!mask->matrixo[x] ) {
+			vips_reduce_mask_free( mask );
+			return( NULL ); 
+		}
+
+		vips_reduce_make_mask( mask->matrixf[x], kernel, shrink, 
+			(float) x / VIPS_TRANSFORM_SCALE );
+
+		for( int i = 0; i < mask->n_point; i++ )
+			mask->matrixi[x][i] = mask->matrixf[x][i] * 
+				VIPS_INTERPOLATE_SCALE;
+
+		vips_vector_to_fixed_point( mask->matrixf[x], 
+			mask->matrixo[x], mask->n_point, 64 );
+
+#ifdef DEBUG
+		printf( "vips_reduce_mask_new: mask %d\n    ", x );
+		for( int i = 0; i < mask->n_point; i++ )
+			printf( "%d ", mask->matrixi[x][i] );
+		printf( "\n" ); 
+#endif /*DEBUG*/
+	}
+
+	return( mask );
+}
+
+void
+vips_reduce_mask_unref( VipsReduceMask *mask )
+{
+	if( g_atomic_int_dec_and_test( &mask->ref_count ) )
+		vips_reduce_mask_free( mask );
+}
+
+/* All the masks we've made, keyed by kernel and shrink. 
+ */
+static GHashTable *vips_reduce_mask_table = NULL;
+static GMutex *vips_reduce_mask_lock = NULL;
+
+static guint
+vips_reduce_mask_hash( gconstpointer key )
+{
+	VipsReduceMask *mask = (VipsReduceMask *) key;
+
+	return( g_double_hash( &mask->shrink ) ^ mask->kernel );
+}
+
+static gboolean
+vips_reduce_mask_equal( gconstpointer a, gconstpointer b )
+{
+	VipsReduceMask *mask1 = (VipsReduceMask *) a;
+	VipsReduceMask *mask2 = (VipsReduceMask *) b;
+
+	return( mask1->kernel == mask2->kernel &&
+		mask1->shrink == mask2->shrink );
+}
+
+static void *
+vips_reduce_mask_init( void *client )
+{
+	vips_reduce_mask_table = g_hash_table_new_full( 
+		vips_reduce_mask_hash, vips_reduce_mask_equal, 
+		NULL, (GDestroyNotify) vips_reduce_mask_unref );
+	vips_reduce_mask_lock = vips_g_mutex_new();
+
+	return( NULL );
+}
+
+/* Get a ref to the mask tables for a kernel and shrink. Servers tend to
+ * resize to the same few sizes over and over, so we keep masks in a
+ * process-wide table and share them between operations. 
+ *
+ * Unref the result with vips_reduce_mask_unref().
+ */
+VipsReduceMask *
+vips_reduce_mask_get( VipsKernel kernel, double shrink )
+{
+	static GOnce once = G_ONCE_INIT;
+
+	VipsReduceMask key;
+	VipsReduceMask *mask;
+
+	VIPS_ONCE( &once, vips_reduce_mask_init, NULL );
+
+	key.kernel = kernel;
+	key.shrink = shrink;
+
+	g_mutex_lock( vips_reduce_mask_lock );
+
+	if( (mask = (VipsReduceMask *) 
+		g_hash_table_lookup( vips_reduce_mask_table, &key )) ) 
+		g_atomic_int_inc( &mask->ref_count );
+	else if( (mask = vips_reduce_mask_new( kernel, shrink )) &&
+		mask->n_point <= VIPS_REDUCE_MASK_MAX_POINT ) {
+		/* Table full? Just start again, any masks in use will be
+		 * freed on their last unref.
+		 */
+		if( g_hash_table_size( vips_reduce_mask_table ) >= 
+			VIPS_REDUCE_MASK_MAX )
+			g_hash_table_remove_all( vips_reduce_mask_table );
+
+		/* One ref for the table, one for the caller.
+		 */
+		g_atomic_int_inc( &mask->ref_count );
+		g_hash_table_insert( vips_reduce_mask_table, mask, mask );
+	}
+
+	g_mutex_unlock( vips_reduce_mask_lock );
+
+	if( !mask )
+		vips_error( "reduce", "%s", _( "unable to make mask" ) );
+
+	return( mask );
+}
+
+void
+vips__reduce_mask_shutdown( void )
+{
+	if( vips_reduce_mask_table ) 
+		g_hash_table_remove_all( vips_reduce_mask_table );
+}
+
 template <typename T, int max_value>
 static void inline
 reduceh_unsigned_int_tab( VipsReduceh *reduceh,
@@ -353,8 +507,8 @@ vips_reduceh_gen( VipsRegion *out_region, void *seq,
 			const int sx = X * VIPS_TRANSFORM_SCALE * 2;
 			const int six = sx & (VIPS_TRANSFORM_SCALE * 2 - 1);
 			const int tx = (six + 1) >> 1;
-			const int *cxi = reduceh->matrixi[tx];
-			const double *cxf = reduceh->matrixf[tx];
+			const int *cxi = reduceh->mask->matrixi[tx];
+			const double *cxf = reduceh->mask->matrixf[tx];
 
 			switch( in->BandFmt ) {
 			case VIPS_FORMAT_UCHAR:
@@ -428,6 +582,16 @@ vips_reduceh_gen( VipsRegion *out_region, void *seq,
 	return( 0 );
 }
 
+static void
+vips_reduceh_finalize( GObject *gobject )
+{
+	VipsReduceh *reduceh = (VipsReduceh *) gobject; 
+
+	VIPS_FREEF( vips_reduce_mask_unref, reduceh->mask );
+
+	G_OBJECT_CLASS( vips_reduceh_parent_class )->finalize( gobject );
+}
+
 static int
 vips_reduceh_build( VipsObject *object )
 {
@@ -482,32 +646,11 @@ vips_reduceh_build( VipsObject *object )
 	 */
 	reduceh->hoffset = (1 + extra_pixels) / 2.0 - 1;
 
-	/* Build the tables of pre-computed coefficients.
+	/* Get the tables of pre-computed coefficients.
 	 */
-	for( int x = 0; x < VIPS_TRANSFORM_SCALE + 1; x++ ) {
-		reduceh->matrixf[x] = 
-			VIPS_ARRAY( object, reduceh->n_point, double ); 
-		reduceh->matrixi[x] = 
-			VIPS_ARRAY( object, reduceh->n_point, int ); 
-		if( !reduceh->matrixf[x] ||
-			!reduceh->matrixi[x] )
-			return( -1 ); 
-
-		vips_reduce_make_mask( reduceh->matrixf[x], 
-			reduceh->kernel, reduceh->hshrink, 
-			(float) x / VIPS_TRANSFORM_SCALE );
-
-		for( int i = 0; i < reduceh->n_point; i++ )
-			reduceh->matrixi[x][i] = reduceh->matrixf[x][i] * 
-				VIPS_INTERPOLATE_SCALE;
-
-#ifdef DEBUG
-		printf( "vips_reduceh_build: mask %d\n    ", x );
-		for( int i = 0; i < reduceh->n_point; i++ )
-			printf( "%d ", reduceh->matrixi[x][i] );
-		printf( "\n" ); 
-#endif /*DEBUG*/
-	}
+	if( !(reduceh->mask = 
+		vips_reduce_mask_get( reduceh->kernel, reduceh->hshrink )) )
+		return( -1 );
 
 	/* Unpack for processing.
 	 */
@@ -569,6 +712,7 @@ vips_reduceh_class_init( VipsReducehClass *reduceh_class )
 
 	VIPS_DEBUG_MSG( "vips_reduceh_class_init\n" );
 
+	gobject_class->finalize = vips_reduceh_finalize;
 	gobject_class->set_property = vips_object_set_property;
 	gobject_class->get_property = vips_object_get_property;
 
@@ -21,6 +21,8 @@
  * 	- deprecate @centre option, it's now always on
  * 	- fix pixel shift
  * 	- speed up the mask construction for uchar/ushort images
+ * 18/10/26
+ * 	- share mask tables and orc programs between operations
  */
 
 /*
@@ -99,6 +101,19 @@ typedef struct {
         VipsVector *vector;
 } Pass;
 
+/* The orc program for a mask. Coefficients are passed as parameters, so 
+ * this only depends on the number of points in the mask and we can share 
+ * programs between all reducev operations.
+ */
+typedef struct {
+	int n_point;
+
+	/* The passes we generate for this mask.
+	 */
+	int n_pass;	
+	Pass pass[MAX_PASS];
+} Program;
+
 typedef struct _VipsReducev {
 	VipsResample parent_instance;
 
@@ -116,21 +131,13 @@ typedef struct _VipsReducev {
 	 */
 	double voffset;
 
-	/* Precalculated interpolation matrices. int (used for pel
-	 * sizes up to short), and double (for all others). We go to
-	 * scale + 1 so we can round-to-nearest safely.
+	/* Precalculated interpolation matrices.
 	 */
-	int *matrixi[VIPS_TRANSFORM_SCALE + 1];
-	double *matrixf[VIPS_TRANSFORM_SCALE + 1];
+	VipsReduceMask *mask;
 
-	/* And another set for orc: we want 2.6 precision.
+	/* The vector program for this mask, or NULL for the C path.
 	 */
-	int *matrixo[VIPS_TRANSFORM_SCALE + 1];
-
-	/* The passes we generate for this mask.
-	 */
-	int n_pass;	
-	Pass pass[MAX_PASS];
+	Program *program;
 
 	/* Deprecated.
 	 */
@@ -151,14 +158,7 @@ vips_reducev_finalize( GObject *gobject )
 {
 	VipsReducev *reducev = (VipsReducev *) gobject; 
 
-	for( int i = 0; i < reducev->n_pass; i++ )
-		VIPS_FREEF( vips_vector_free, reducev->pass[i].vector );
-	reducev->n_pass = 0;
-	for( int i = 0; i < VIPS_TRANSFORM_SCALE + 1; i++ ) {
-		VIPS_FREE( reducev->matrixf[i] );
-		VIPS_FREE( reducev->matrixi[i] );
-		VIPS_FREE( reducev->matrixo[i] );
-	}
+	VIPS_FREEF( vips_reduce_mask_unref, reducev->mask );
 
 	G_OBJECT_CLASS( vips_reducev_parent_class )->finalize( gobject );
 }
@@ -178,7 +178,7 @@ vips_reducev_finalize( GObject *gobject )
  * 0 for success, -1 on error.
  */
 static int
-vips_reducev_compile_section( VipsReducev *reducev, Pass *pass, gboolean first )
+vips_reducev_compile_section( Program *program, Pass *pass, gboolean first )
 {
 	VipsVector *v;
 	int i;
@@ -216,7 +216,7 @@ vips_reducev_compile_section( VipsReducev *reducev, Pass *pass, gboolean first )
 	else 
 		ASM2( "loadw", "sum", "r" );
 
-	for( i = pass->first; i < reducev->n_point; i++ ) {
+	for( i = pass->first; i < program->n_point; i++ ) {
 		char source[256];
 		char coeff[256];
 
@@ -262,7 +262,7 @@ vips_reducev_compile_section( VipsReducev *reducev, Pass *pass, gboolean first )
 	/* If this is the end of the mask, we write the 8-bit result to the
 	 * image, otherwise write the 16-bit intermediate to our temp buffer. 
 	 */
-	if( pass->last >= reducev->n_point - 1 ) {
+	if( pass->last >= program->n_point - 1 ) {
 		char c32[256];
 		char c6[256];
 		char c0[256];
@@ -298,36 +298,104 @@ vips_reducev_compile_section( VipsReducev *reducev, Pass *pass, gboolean first )
 	return( 0 );
 }
 
-static int
-vips_reducev_compile( VipsReducev *reducev )
+static void
+vips_reducev_program_free( Program *program )
 {
+	for( int i = 0; i < program->n_pass; i++ )
+		VIPS_FREEF( vips_vector_free, program->pass[i].vector );
+	g_free( program );
+}
+
+static Program *
+vips_reducev_compile( int n_point )
+{
+	Program *program;
 	Pass *pass;
 
+	program = g_new0( Program, 1 );
+	program->n_point = n_point;
+
 	/* Generate passes until we've used up the whole mask.
 	 */
 	for( int i = 0;; ) {
 		/* Allocate space for another pass.
 		 */
-		if( reducev->n_pass == MAX_PASS ) 
-			return( -1 );
-		pass = &reducev->pass[reducev->n_pass];
-		reducev->n_pass += 1;
+		if( program->n_pass == MAX_PASS ) {
+			vips_reducev_program_free( program );
+			return( NULL );
+		}
+		pass = &program->pass[program->n_pass];
+		program->n_pass += 1;
 
 		pass->first = i;
 		pass->r = -1;
 		pass->d2 = -1;
 		pass->n_param = 0;
 
-		if( vips_reducev_compile_section( reducev,
-			pass, reducev->n_pass == 1 ) )
-			return( -1 );
+		if( vips_reducev_compile_section( program,
+			pass, program->n_pass == 1 ) ) {
+			vips_reducev_program_free( program );
+			return( NULL );
+		}
 		i = pass->last + 1;
 
-		if( i >= reducev->n_point )
+		if( i >= n_point )
 			break;
 	}
 
-	return( 0 );
+	return( program );
+}
+
+/* Compiled programs, indexed by n_point. Programs are never freed (until
+ * shutdown), and we remember which sizes failed to compile.
+ */
+static Program *vips_reducev_programs[MAX_POINT + 1];
+static gboolean vips_reducev_failed[MAX_POINT + 1];
+static GMutex *vips_reducev_program_lock = NULL;
+
+static void *
+vips_reducev_program_init( void *client )
+{
+	vips_reducev_program_lock = vips_g_mutex_new();
+
+	return( NULL );
+}
+
+/* Get the shared vector program for an n_point mask, or NULL if we can't 
+ * make one and must use the C path. 
+ */
+static Program *
+vips_reducev_program_get( int n_point )
+{
+	static GOnce once = G_ONCE_INIT;
+
+	Program *program;
+
+	VIPS_ONCE( &once, vips_reducev_program_init, NULL );
+
+	g_mutex_lock( vips_reducev_program_lock );
+
+	if( !vips_reducev_programs[n_point] &&
+		!vips_reducev_failed[n_point] ) {
+		vips_reducev_programs[n_point] = vips_reducev_compile( n_point );
+		if( !vips_reducev_programs[n_point] )
+			vips_reducev_failed[n_point] = TRUE;
+	}
+	program = vips_reducev_programs[n_point];
+
+	g_mutex_unlock( vips_reducev_program_lock );
+
+	return( program );
+}
+
+void
+vips__reducev_program_shutdown( void )
+{
+	for( int i = 0; i < MAX_POINT + 1; i++ ) {
+		VIPS_FREEF( vips_reducev_program_free, 
+			vips_reducev_programs[i] );
+		vips_reducev_failed[i] = FALSE;
+	}
 }
 
 /* Our sequence value.
@@ -562,8 +630,8 @@ vips_reducev_gen( VipsRegion *out_region, void *vseq,
 		const int sy = Y * VIPS_TRANSFORM_SCALE * 2;
 		const int siy = sy & (VIPS_TRANSFORM_SCALE * 2 - 1);
 		const int ty = (siy + 1) >> 1;
-		const int *cyi = reducev->matrixi[ty];
-		const double *cyf = reducev->matrixf[ty];
+		const int *cyi = reducev->mask->matrixi[ty];
+		const double *cyf = reducev->mask->matrixf[ty];
 		const int lskip = VIPS_REGION_LSKIP( ir );
 
 		switch( in->BandFmt ) {
@@ -644,6 +712,7 @@ vips_reducev_vector_gen( VipsRegion *out_region, void *vseq,
 {
 	VipsImage *in = (VipsImage *) a;
 	VipsReducev *reducev = (VipsReducev *) b;
+	Program *program = reducev->program;
 	Sequence *seq = (Sequence *) vseq;
 	VipsRegion *ir = seq->ir;
 	VipsRect *r = &out_region->valid;
@@ -669,9 +738,9 @@ vips_reducev_vector_gen( VipsRegion *out_region, void *vseq,
 		s.width, s.height, s.left, s.top ); 
 #endif /*DEBUG_PIXELS*/
 
-	for( int i = 0; i < reducev->n_pass; i++ ) 
+	for( int i = 0; i < program->n_pass; i++ ) 
 		vips_executor_set_program( &executor[i], 
-			reducev->pass[i].vector, ne );
+			program->pass[i].vector, ne );
 
 	VIPS_GATE_START( "vips_reducev_vector_gen: work" ); 
 
@@ -685,7 +754,7 @@ vips_reducev_vector_gen( VipsRegion *out_region, void *vseq,
 		const int sy = Y * VIPS_TRANSFORM_SCALE * 2;
 		const int siy = sy & (VIPS_TRANSFORM_SCALE * 2 - 1);
 		const int ty = (siy + 1) >> 1;
-		const int *cyo = reducev->matrixo[ty];
+		const int *cyo = reducev->mask->matrixo[ty];
 
 #ifdef DEBUG_PIXELS
 		printf( "starting row %d\n", y + r->top ); 
@@ -700,8 +769,8 @@ vips_reducev_vector_gen( VipsRegion *out_region, void *vseq,
 
 		/* We run our n passes to generate this scanline.
 		 */
-		for( int i = 0; i < reducev->n_pass; i++ ) {
-			Pass *pass = &reducev->pass[i]; 
+		for( int i = 0; i < program->n_pass; i++ ) {
+			Pass *pass = &program->pass[i]; 
 
 			vips_executor_set_scanline( &executor[i], 
 				ir, r->left, py );
@@ -741,27 +810,13 @@ vips_reducev_raw( VipsReducev *reducev, VipsImage *in, VipsImage **out )
 
 	VipsGenerateFn generate;
 
-	/* We need an 2.6 version if we will use the vector path.
-	 */
-	if( in->BandFmt == VIPS_FORMAT_UCHAR &&
-		vips_vector_isenabled() ) 
-		for( int y = 0; y < VIPS_TRANSFORM_SCALE + 1; y++ ) {
-			reducev->matrixo[y] = 
-				VIPS_ARRAY( NULL, reducev->n_point, int ); 
-			if( !reducev->matrixo[y] )
-				return( -1 ); 
-
-			vips_vector_to_fixed_point( 
-				reducev->matrixf[y], reducev->matrixo[y], 
-				reducev->n_point, 64 );
-		}
-
-	/* Try to build a vector version, if we can.
+	/* Try to use a vector version, if we can.
 	 */
 	generate = vips_reducev_gen;
 	if( in->BandFmt == VIPS_FORMAT_UCHAR &&
 		vips_vector_isenabled() &&
-		!vips_reducev_compile( reducev ) ) {
+		(reducev->program = 
+			vips_reducev_program_get( reducev->n_point )) ) {
 		g_info( "reducev: using vector path" ); 
 		generate = vips_reducev_vector_gen;
 	}
@@ -855,32 +910,11 @@ vips_reducev_build( VipsObject *object )
 	 */
 	reducev->voffset = (1 + extra_pixels) / 2.0 - 1;
 
-	/* Build the tables of pre-computed coefficients.
+	/* Get the tables of pre-computed coefficients.
 	 */
-	for( int y = 0; y < VIPS_TRANSFORM_SCALE + 1; y++ ) {
-		reducev->matrixf[y] = 
-			VIPS_ARRAY( NULL, reducev->n_point, double ); 
-		reducev->matrixi[y] = 
-			VIPS_ARRAY( NULL, reducev->n_point, int ); 
-		if( !reducev->matrixf[y] ||
-			!reducev->matrixi[y] )
-			return( -1 ); 
-
-		vips_reduce_make_mask( reducev->matrixf[y],
-			reducev->kernel, reducev->vshrink, 
-			(float) y / VIPS_TRANSFORM_SCALE ); 
-
-		for( int i = 0; i < reducev->n_point; i++ )
-			reducev->matrixi[y][i] = reducev->matrixf[y][i] *
-				VIPS_INTERPOLATE_SCALE;
-
-#ifdef DEBUG
-		printf( "vips_reducev_build: mask %d\n    ", y );
-		for( int i = 0; i < reducev->n_point; i++ ) 
-			printf( "%d ", reducev->matrixi[y][i] );
-		printf( "\n" ); 
-#endif /*DEBUG*/
-	}
+	if( !(reducev->mask = 
+		vips_reduce_mask_get( reducev->kernel, reducev->vshrink )) )
+		return( -1 );
 
 	/* Unpack for processing.
 	 */
@@ -35,6 +35,9 @@
  * 	- don't let either axis drop below 1px
  * 12/7/20
  * 	- much better handling of "nearest"
+ * 18/10/26
+ * 	- add @gap
+ * 	- @gap between 0 and 1 is an error
  */
 
 /*
@@ -93,6 +96,7 @@ typedef struct _VipsResize {
 	double scale;
 	double vscale;
 	VipsKernel kernel;
+	double gap;
 
 	/* Deprecated.
 	 */
@@ -128,9 +132,45 @@ vips_resize_interpolate( VipsKernel kernel )
 	}
 }
 
+/* The int part of our shrink. We box shrink until there's at most @gap left
+ * for the kernel to do, 0 means all reduce. @gap must be 0, or 1 or more.
+ */
+int
+vips__resize_int_shrink( double scale, double gap )
+{
+	g_assert( gap == 0.0 || gap >= 1.0 );
+
+	if( gap == 0.0 )
+		return( 1 );
+
+	return( VIPS_MAX( 1, VIPS_FLOOR( 1.0 / (scale * gap) ) ) );
+}
+
+/* The size we will make when downsizing an axis of @size pixels by @scale
+ * with @gap. This must match the rounding in shrink and reduce. 
+ * vips_thumbnail() uses this to size its fast path.
+ */
+int
+vips__resize_size( int size, double scale, double gap )
+{
+	int int_shrink = vips__resize_int_shrink( scale, gap );
+
+	if( int_shrink > 1 ) {
+		size = VIPS_ROUND_UINT( (double) size / int_shrink );
+		scale *= int_shrink;
+	}
+
+	scale = VIPS_MAX( scale, 1.0 / size );
+	if( scale < 1.0 )
+		size = VIPS_ROUND_UINT( size / (1.0 / scale) );
+
+	return( size );
+}
+
 static int
 vips_resize_build( VipsObject *object )
 {
+	VipsObjectClass *class = VIPS_OBJECT_GET_CLASS( object );
 	VipsResample *resample = VIPS_RESAMPLE( object );
 	VipsResize *resize = (VipsResize *) object;
 
@@ -147,6 +187,15 @@ vips_resize_build( VipsObject *object )
 
 	in = resample->in;
 
+	/* A gap of less than 1 would ask the block shrink to overshoot.
+	 */
+	if( resize->gap > 0.0 &&
+		resize->gap < 1.0 ) {
+		vips_error( class->nickname, 
+			"%s", _( "gap must be 0, or 1 or more" ) );
+		return( -1 );
+	}
+
 	/* Updated below when we do the int part of our shrink.
 	 */
 	hscale = resize->scale;
@@ -155,10 +204,11 @@ vips_resize_build( VipsObject *object )
 	else
 		vscale = resize->scale;
 
-	/* The int part of our scale. Leave the final 200 - 300% to reduce.
+	/* The int part of our scale. By default, leave the final 200 - 300% 
+	 * to reduce.
 	 */
-	int_hshrink = VIPS_MAX( 1, VIPS_FLOOR( 1.0 / (hscale * 2) ) );
-	int_vshrink = VIPS_MAX( 1, VIPS_FLOOR( 1.0 / (vscale * 2) ) );
+	int_hshrink = vips__resize_int_shrink( hscale, resize->gap );
+	int_vshrink = vips__resize_int_shrink( vscale, resize->gap );
 
 	/* Unpack for processing.
 	 */
@@ -342,6 +392,13 @@ vips_resize_class_init( VipsResizeClass *class )
 		G_STRUCT_OFFSET( VipsResize, kernel ),
 		VIPS_TYPE_KERNEL, VIPS_KERNEL_LANCZOS3 );
 
+	VIPS_ARG_DOUBLE( class, "gap", 4, 
+		_( "Gap" ), 
+		_( "Reducing gap" ),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET( VipsResize, gap ),
+		0.0, 1000000.0, VIPS_RESIZE_GAP );
+
 	/* We used to let people set the input offset so you could pick centre
 	 * or corner interpolation, but it's not clear this was useful. 
 	 */
@@ -382,6 +439,7 @@ static void
 vips_resize_init( VipsResize *resize )
 {
 	resize->kernel = VIPS_KERNEL_LANCZOS3;
+	resize->gap = VIPS_RESIZE_GAP;
 }
 
 /**
@@ -395,6 +453,7 @@ vips_resize_init( VipsResize *resize )
  *
  * * @vscale: %gdouble vertical scale factor
  * * @kernel: #VipsKernel to reduce with 
+ * * @gap: reducing gap to use (default: 2.0)
  *
  * Resize an image. 
  *
@@ -408,6 +467,14 @@ vips_resize_init( VipsResize *resize )
  * vips_resize() normally uses #VIPS_KERNEL_LANCZOS3 for the final reduce, you
  * can change this with @kernel.
  *
+ * Use @gap to trade quality for speed. The image is block-shrunk until 
+ * there's a factor of between @gap and 2 * @gap left for vips_reduce(). 
+ * The default of 2.0 gives high quality. A @gap of 1.0 is a good fast mode 
+ * for previews, since the kernel then only ever has to reduce by less than 
+ * 2x, and the block shrink is very cheap. Set 0 to disable the block shrink 
+ * and do all of the work with @kernel. This is the most accurate, but also 
+ * the slowest. Values between 0 and 1 are an error.
+ *
  * When upsizing (@scale > 1), the operation uses vips_affine() with
  * a #VipsInterpolate selected depending on @kernel. It will use
  * #VipsInterpolateBicubic for #VIPS_KERNEL_CUBIC and above. It adds a
@@ -30,6 +30,11 @@
  * 	- add thumbnail_source
  * 2/6/20
  * 	- add subifd pyr support
+ * 18/10/26
+ * 	- add a fused fast path for tiny outputs
+ * 	- the fast path streams through a region, and only runs for small 
+ * 	  shrinks
+ * 	- the fast path is opt-in with @fast, since it uses a box filter
  */
 
 /*
@@ -70,11 +75,21 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 
 #include <vips/vips.h>
 #include <vips/internal.h>
 
+#include "presample.h"
+
+/* With @fast, outputs with both axes this size or smaller take the fused 
+ * fast path, as long as shrink-on-load has left no more than this much to 
+ * do. Larger shrinks are better done by the threaded pipeline.
+ */
+#define VIPS_THUMBNAIL_SMALL (64)
+#define VIPS_THUMBNAIL_SMALL_SHRINK (3.0)
+
 #define VIPS_TYPE_THUMBNAIL (vips_thumbnail_get_type())
 #define VIPS_THUMBNAIL( obj ) \
 	(G_TYPE_CHECK_INSTANCE_CAST( (obj), VIPS_TYPE_THUMBNAIL, VipsThumbnail ))
@@ -108,6 +123,7 @@ typedef struct _VipsThumbnail {
 	char *export_profile;
 	char *import_profile;
 	VipsIntent intent;
+	gboolean fast;
 
 	/* Bits of info we read from the input image when we get the header of
 	 * the original.
@@ -616,6 +632,180 @@ vips_thumbnail_open( VipsThumbnail *thumbnail )
 	return( im ); 
 }
 
+/* Box filter line @p of @in down to @width pixels. Colour is premultiplied
+ * by alpha, if there is one.
+ */
+static void
+vips_thumbnail_small_line( VipsImage *in, VipsPel *p, gboolean hasalpha,
+	int width, double *line )
+{
+	const int bands = in->Bands;
+	const double hshrink = (double) in->Xsize / width;
+
+	int x, ix, b;
+
+	memset( line, 0, width * bands * sizeof( double ) );
+
+	for( x = 0; x < width; x++ ) {
+		double *q = line + x * bands;
+		double x0 = x * hshrink;
+		double x1 = VIPS_MIN( x0 + hshrink, in->Xsize );
+
+		for( ix = x0; ix < x1; ix++ ) {
+			VipsPel *s = p + ix * bands;
+			double wx = VIPS_MIN( x1, ix + 1 ) - VIPS_MAX( x0, ix );
+
+			if( hasalpha ) {
+				double wa = wx * s[bands - 1] / 255.0;
+
+				for( b = 0; b < bands - 1; b++ )
+					q[b] += wa * s[b];
+				q[bands - 1] += wx * s[bands - 1];
+			}
+			else 
+				for( b = 0; b < bands; b++ )
+					q[b] += wx * s[b];
+		}
+	}
+}
+
+/* Shrink the uchar image @in to @width x @height in one pass. This
+ * does the job of premultiply / resize / unpremultiply / cast, but with a 
+ * box filter and without building a pipeline. We read the few input lines 
+ * each output line needs through a region, top to bottom, so sequential 
+ * loaders stream and we never hold the whole input.
+ */
+static VipsImage *
+vips_thumbnail_small( VipsImage *in, int width, int height )
+{
+	const int bands = in->Bands;
+	const gboolean hasalpha = vips_image_hasalpha( in );
+	const double vshrink = (double) in->Ysize / height;
+	const double scale = 
+		1.0 / (vshrink * ((double) in->Xsize / width));
+
+	VipsImage *out;
+	VipsRegion *region;
+	double *line;
+	double *sum;
+	VipsPel *buf;
+	int x, y, iy, b;
+
+	out = vips_image_new_memory();
+	if( vips_image_pipelinev( out, VIPS_DEMAND_STYLE_ANY, in, NULL ) ) {
+		VIPS_UNREF( out );
+		return( NULL );
+	}
+	out->Xsize = width;
+	out->Ysize = height;
+
+	line = VIPS_ARRAY( out, width * bands, double );
+	sum = VIPS_ARRAY( out, width * bands, double );
+	buf = VIPS_ARRAY( out, VIPS_IMAGE_SIZEOF_LINE( out ), VipsPel );
+	if( !line ||
+		!sum ||
+		!buf ||
+		!(region = vips_region_new( in )) ) {
+		VIPS_UNREF( out );
+		return( NULL );
+	}
+
+	for( y = 0; y < height; y++ ) {
+		double y0 = y * vshrink;
+		double y1 = VIPS_MIN( y0 + vshrink, in->Ysize );
+		VipsRect lines;
+
+		lines.left = 0;
+		lines.top = y0;
+		lines.width = in->Xsize;
+		lines.height = VIPS_CEIL( y1 ) - lines.top;
+		if( vips_region_prepare( region, &lines ) ) {
+			VIPS_UNREF( region );
+			VIPS_UNREF( out );
+			return( NULL );
+		}
+
+		memset( sum, 0, width * bands * sizeof( double ) );
+
+		for( iy = y0; iy < y1; iy++ ) {
+			double wy = VIPS_MIN( y1, iy + 1 ) - VIPS_MAX( y0, iy );
+
+			vips_thumbnail_small_line( in, 
+				VIPS_REGION_ADDR( region, 0, iy ), hasalpha, 
+				width, line );
+			for( x = 0; x < width * bands; x++ )
+				sum[x] += wy * line[x];
+		}
+
+		for( x = 0; x < width; x++ ) {
+			double *p = sum + x * bands;
+			VipsPel *q = buf + x * bands;
+
+			if( hasalpha ) {
+				double alpha = p[bands - 1] * scale;
+				double factor = alpha > 0 ? 
+					255.0 / alpha : 0.0;
+
+				for( b = 0; b < bands - 1; b++ ) {
+					double v = p[b] * scale * factor;
+
+					q[b] = VIPS_CLIP( 0, VIPS_RINT( v ), 255 );
+				}
+				q[bands - 1] = 
+					VIPS_CLIP( 0, VIPS_RINT( alpha ), 255 );
+			}
+			else 
+				for( b = 0; b < bands; b++ ) {
+					double v = p[b] * scale;
+
+					q[b] = VIPS_CLIP( 0, VIPS_RINT( v ), 255 );
+				}
+		}
+
+		if( vips_image_write_line( out, y, buf ) ) {
+			VIPS_UNREF( region );
+			VIPS_UNREF( out );
+			return( NULL );
+		}
+	}
+
+	VIPS_UNREF( region );
+
+	return( out );
+}
+
+/* Can we use the fused fast path? It must be enabled with @fast, and we 
+ * need a single-page, downsizing, uchar image with a small output. 
+ * Shrink-on-load must have already done most of the work. 
+ *
+ * The output size must match the vips_resize() in the slow path, so we 
+ * use the same gap.
+ */
+static gboolean
+vips_thumbnail_small_ok( VipsThumbnail *thumbnail, VipsImage *in, 
+	double hshrink, double vshrink, int *width, int *height )
+{
+	if( !thumbnail->fast ||
+		in->Coding != VIPS_CODING_NONE ||
+		in->BandFmt != VIPS_FORMAT_UCHAR ||
+		in->Bands > 4 ||
+		thumbnail->n_loaded_pages > 1 ||
+		hshrink < 1.0 ||
+		vshrink < 1.0 ||
+		hshrink > VIPS_THUMBNAIL_SMALL_SHRINK ||
+		vshrink > VIPS_THUMBNAIL_SMALL_SHRINK ||
+		(hshrink == 1.0 && vshrink == 1.0) )
+		return( FALSE );
+
+	*width = vips__resize_size( in->Xsize, 1.0 / hshrink, 
+		VIPS_RESIZE_GAP );
+	*height = vips__resize_size( in->Ysize, 1.0 / vshrink, 
+		VIPS_RESIZE_GAP );
+
+	return( *width <= VIPS_THUMBNAIL_SMALL &&
+		*height <= VIPS_THUMBNAIL_SMALL );
+}
+
 static int
 vips_thumbnail_build( VipsObject *object )
 {
@@ -626,6 +816,8 @@ vips_thumbnail_build( VipsObject *object )
 	int preshrunk_page_height;
 	double hshrink;
 	double vshrink;
+	int small_width;
+	int small_height;
 	VipsInterpretation interpretation;
 
 	/* TRUE if we've done the import of an ICC transform and still need to
@@ -753,53 +945,65 @@ vips_thumbnail_build( VipsObject *object )
 		vshrink = (double) in->Ysize / target_image_height;
 	}
 
-	/* If there's an alpha, we have to premultiply before shrinking. See
-	 * https://github.com/libvips/libvips/issues/291
-	 */
-	have_premultiplied = FALSE;
-	if( vips_image_hasalpha( in ) && 
-	 	hshrink != 1.0 &&
-		vshrink != 1.0  ) { 
-		g_info( "premultiplying alpha" ); 
-		if( vips_premultiply( in, &t[3], NULL ) ) 
+	if( vips_thumbnail_small_ok( thumbnail, in, hshrink, vshrink,
+		&small_width, &small_height ) ) {
+		g_info( "fast path to %dx%d", small_width, small_height ); 
+		if( !(t[4] = vips_thumbnail_small( in, 
+			small_width, small_height )) )
 			return( -1 );
-		have_premultiplied = TRUE;
-
-		/* vips_premultiply() makes a float image. When we
-		 * vips_unpremultiply() below, we need to cast back to the
-		 * pre-premultiply format.
-		 */
-		unpremultiplied_format = in->BandFmt;
-		in = t[3];
+		in = t[4];
 	}
+	else {
+		/* If there's an alpha, we have to premultiply before shrinking. See
+		 * https://github.com/libvips/libvips/issues/291
+		 */
+		have_premultiplied = FALSE;
+		if( vips_image_hasalpha( in ) && 
+		 	hshrink != 1.0 &&
+			vshrink != 1.0  ) { 
+			g_info( "premultiplying alpha" ); 
+			if( vips_premultiply( in, &t[3], NULL ) ) 
+				return( -1 );
+			have_premultiplied = TRUE;
+
+			/* vips_premultiply() makes a float image. When we
+			 * vips_unpremultiply() below, we need to cast back to 
+			 * the pre-premultiply format.
+			 */
+			unpremultiplied_format = in->BandFmt;
+			in = t[3];
+		}
 
-	if( vips_resize( in, &t[4], 1.0 / hshrink, 
-		"vscale", 1.0 / vshrink, 
-		NULL ) ) 
-		return( -1 );
-	in = t[4];
+		if( vips_resize( in, &t[4], 1.0 / hshrink, 
+			"vscale", 1.0 / vshrink, 
+			"gap", VIPS_RESIZE_GAP,
+			NULL ) ) 
+			return( -1 );
+		in = t[4];
 
-	/* Only set page-height if we have more than one page, or this could
-	 * accidentally turn into an animated image later.
-	 */
-	if( thumbnail->n_loaded_pages > 1 ) {
-		int output_page_height = 
-			VIPS_RINT( preshrunk_page_height / vshrink );
+		/* Only set page-height if we have more than one page, or 
+		 * this could accidentally turn into an animated image later.
+		 */
+		if( thumbnail->n_loaded_pages > 1 ) {
+			int output_page_height = 
+				VIPS_RINT( preshrunk_page_height / vshrink );
 
-		if( vips_copy( in, &t[13], NULL ) )
-			return( -1 );
-		in = t[13];
+			if( vips_copy( in, &t[13], NULL ) )
+				return( -1 );
+			in = t[13];
 
-		vips_image_set_int( in, 
-			VIPS_META_PAGE_HEIGHT, output_page_height );
-	}
+			vips_image_set_int( in, 
+				VIPS_META_PAGE_HEIGHT, output_page_height );
+		}
 
-	if( have_premultiplied ) {
-		g_info( "unpremultiplying alpha" ); 
-		if( vips_unpremultiply( in, &t[5], NULL ) || 
-			vips_cast( t[5], &t[6], unpremultiplied_format, NULL ) )
-			return( -1 );
-		in = t[6];
+		if( have_premultiplied ) {
+			g_info( "unpremultiplying alpha" ); 
+			if( vips_unpremultiply( in, &t[5], NULL ) || 
+				vips_cast( t[5], &t[6], 
+					unpremultiplied_format, NULL ) )
+				return( -1 );
+			in = t[6];
+		}
 	}
 
 	/* Colour management.
@@ -974,6 +1178,13 @@ vips_thumbnail_class_init( VipsThumbnailClass *class )
 		G_STRUCT_OFFSET( VipsThumbnail, intent ),
 		VIPS_TYPE_INTENT, VIPS_INTENT_RELATIVE );
 
+	VIPS_ARG_BOOL( class, "fast", 122, 
+		_( "Fast" ), 
+		_( "Use a box filter for very small outputs" ),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET( VipsThumbnail, fast ),
+		FALSE ); 
+
 	/* BOOL args which default TRUE arguments don't work with the 
 	 * command-line -- GOption does not allow --auto-rotate=false.
 	 *
@@ -1140,6 +1351,7 @@ vips_thumbnail_file_init( VipsThumbnailFile *file )
  * * @import_profile: %gchararray, fallback import ICC profile
  * * @export_profile: %gchararray, export ICC profile
  * * @intent: #VipsIntent, rendering intent
+ * * @fast: %gboolean, use a box filter for very small outputs
  *
  * Make a thumbnail from a file. Shrinking is done in three stages: using any
  * shrink-on-load features available in the file import library, using a block
@@ -1147,6 +1359,14 @@ vips_thumbnail_file_init( VipsThumbnailFile *file )
  * lanczos3. The output should be high quality, and the operation should be
  * quick. 
  *
+ * If you set @fast, very small 8-bit outputs (64 x 64 pixels or less) skip 
+ * the lanczos3 stage if shrink-on-load has brought the image to within 3x 
+ * of the target size. They are made with a single box filter pass, streamed 
+ * from the shrunk-on-load image. This is lower latency for things like 
+ * avatars and icons, but since the kernel is a box rather than lanczos3, 
+ * these thumbnails are softer. Colour management still runs as a separate 
+ * step on the small output.
+ *
  * See vips_thumbnail_buffer() to thumbnail from a memory source. 
  *
  * The output image will fit within a square of size @width x @width. You can
@@ -1368,6 +1588,7 @@ vips_thumbnail_buffer_init( VipsThumbnailBuffer *buffer )
  * * @import_profile: %gchararray, fallback import ICC profile
  * * @export_profile: %gchararray, export ICC profile
  * * @intent: #VipsIntent, rendering intent
+ * * @fast: %gboolean, use a box filter for very small outputs
  * * @option_string: %gchararray, extra loader options
  *
  * Exacty as vips_thumbnail(), but read from a memory buffer. One extra
@@ -1564,6 +1785,7 @@ vips_thumbnail_source_init( VipsThumbnailSource *source )
  * * @import_profile: %gchararray, fallback import ICC profile
  * * @export_profile: %gchararray, export ICC profile
  * * @intent: #VipsIntent, rendering intent
+ * * @fast: %gboolean, use a box filter for very small outputs
  * * @option_string: %gchararray, extra loader options
  *
  * Exacty as vips_thumbnail(), but read from a source. One extra
@@ -1672,6 +1894,7 @@ vips_thumbnail_image_init( VipsThumbnailImage *image )
  * * @import_profile: %gchararray, fallback import ICC profile
  * * @export_profile: %gchararray, export ICC profile
  * * @intent: #VipsIntent, rendering intent
+ * * @fast: %gboolean, use a box filter for very small outputs
  *
  * Exacty as vips_thumbnail(), but read from an existing image. 
  *
@@ -10,6 +10,7 @@ import pyvips
 IMAGES = os.path.join(os.path.dirname(__file__), os.pardir, 'images')
 JPEG_FILE = os.path.join(IMAGES, "sample.jpg")
 TRUNCATED_FILE = os.path.join(IMAGES, "truncated.jpg")
+RESTART_FILE = os.path.join(IMAGES, "restart.jpg")
 SRGB_FILE = os.path.join(IMAGES, "sRGB.icm")
 MATLAB_FILE = os.path.join(IMAGES, "sample.mat")
 PNG_FILE = os.path.join(IMAGES, "sample.png")
@@ -80,6 +80,19 @@ class TestConversion:
         im2 = im.cast("char")
         assert im2.avg() == max_value["char"]
 
+        # float to 8 and 16-bit ints truncates and clips
+        values = [-1e10, -1.5, -0.5, 0.4, 1.9, 127.5, 254.9, 255.5,
+                  32767.9, 65535.5, 1e10]
+        for fmt in ["float", "double"]:
+            im = pyvips.Image.new_from_array([values]).cast(fmt)
+            for target in ["uchar", "char", "ushort", "short"]:
+                mx = max_value[target]
+                mn = -mx - 1 if target in ["char", "short"] else 0
+                predict = [int(min(max(x, mn), mx)) for x in values]
+                im2 = im.cast(target)
+                result = [im2(x, 0)[0] for x in range(im2.width)]
+                assert result == predict
+
     def test_band_and(self):
         def band_and(x):
             if isinstance(x, pyvips.Image):
@@ -165,6 +178,26 @@ class TestConversion:
 
         self.run_unary(self.all_images, cache)
 
+    def test_tilecache(self):
+        # a cache too small to hold the image, so we must evict tiles
+        tile_bytes = 16 * 16 * self.colour.bands * 4
+        for access in ["random", "sequential"]:
+            x = self.colour.tilecache(tile_width=16, tile_height=16,
+                                      max_bytes=4 * tile_bytes,
+                                      access=access)
+            assert (x - self.colour).abs().max() == 0
+            assert x.get("tilecache-misses") > 0
+            assert x.get("tilecache-evictions") > 0
+
+        # and with a spill file to catch evicted tiles
+        x = self.colour.tilecache(tile_width=16, tile_height=16,
+                                  max_bytes=4 * tile_bytes,
+                                  spill_bytes=16 * tile_bytes)
+        assert (x - self.colour).abs().max() == 0
+        assert (x.flipver() - self.colour.flipver()).abs().max() == 0
+        assert x.get("tilecache-spill-hits") + \
+            x.get("tilecache-spill-misses") > 0
+
     def test_copy(self):
         x = self.colour.copy(interpretation=pyvips.Interpretation.LAB)
         assert x.interpretation == pyvips.Interpretation.LAB
@@ -334,6 +367,16 @@ class TestConversion:
         assert test.width == 100
         assert test.height == 100
 
+        # attention should find a saturated patch on a flat background
+        im = (pyvips.Image.black(200, 200, bands=3) + 50).cast("uchar")
+        im = im.copy(interpretation="srgb")
+        im = im.draw_rect([255, 0, 0], 140, 20, 40, 40, fill=True)
+        test = im.smartcrop(60, 60, interesting="attention")
+        assert test.width == 60
+        assert test.height == 60
+        red = (test == [255, 0, 0]).bandand()
+        assert red.avg() > 0
+
     def test_falsecolour(self):
         for fmt in all_formats:
             test = self.colour.cast(fmt)
@@ -408,6 +451,55 @@ class TestConversion:
         assert_almost_equal_objects(comp(0, 0), [51.8, 52.8, 53.8, 255],
                                     threshold=0.1)
 
+    @pytest.mark.skipif(pyvips.type_find("VipsConversion", "composite") == 0,
+                        reason="no composite support, skipping test")
+    def test_composite_skip(self):
+        # a stack with transparent and solid layers, with a solid layer
+        # over the right half only
+        base = self.colour.cast("uchar").bandjoin(255)
+        black = base * 0
+        clear = black.cast("uchar")
+        solid = (black + [10, 20, 30, 255]).cast("uchar")
+        half = (black + [200, 100, 50, 128]).cast("uchar")
+        x = base.width // 2
+
+        comp = base.composite([clear, solid, clear, half], "over",
+                              x=[0, x, 0, 0], y=[0, 0, 0, 0])
+        left = base.composite(half, "over")
+        right = solid.composite(half, "over")
+        assert_almost_equal_objects(comp(10, 10), left(10, 10),
+                                    threshold=1)
+        assert_almost_equal_objects(comp(x + 10, 10), right(10, 10),
+                                    threshold=1)
+
+        # transparent layers should make no difference
+        comp = base.composite([clear, solid, clear], "over",
+                              x=[0, x, 0], y=[0, 0, 0])
+        assert_almost_equal_objects(comp(10, 10), base(10, 10),
+                                    threshold=1)
+        assert_almost_equal_objects(comp(x + 10, 10), [10, 20, 30, 255],
+                                    threshold=1)
+
+    @pytest.mark.skipif(pyvips.type_find("VipsConversion", "composite") == 0,
+                        reason="no composite support, skipping test")
+    def test_composite_premultiplied(self):
+        # premultiplied uchar RGBA "over" has an integer path ... it should
+        # match the float path to within 1
+        base = self.colour.cast("uchar").bandjoin(255)
+        layers = []
+        for alpha in [0, 64, 128, 200, 255]:
+            layer = base.flipver() * [1, 0.5, 0.25, 0] + [0, 0, 0, alpha]
+            layers.append(layer.premultiply().cast("uchar"))
+        # a layer with varying alpha
+        layer = base.extract_band(0, n=3).bandjoin(base[1])
+        layers.append(layer.premultiply().cast("uchar"))
+
+        comp = base.composite(layers, "over", premultiplied=True)
+        comp_float = base.cast("float").composite(
+            [x.cast("float") for x in layers], "over", premultiplied=True)
+        assert comp.format == pyvips.BandFormat.UCHAR
+        assert (comp - comp_float.cast("uchar")).abs().max() <= 1
+
     def test_unpremultiply(self):
         for fmt in unsigned_formats + [pyvips.BandFormat.SHORT,
                                        pyvips.BandFormat.INT] + float_formats:
@@ -767,6 +859,19 @@ class TestConversion:
                 diff = (after - im).abs().max()
                 assert diff == 0
 
+        # 90 and 270 work in blocks ... try a range of pixel sizes on an
+        # image which is not a multiple of the block size
+        test = self.colour.crop(0, 0, 100, 67)
+        for im in [test[0].cast("uchar"), test[0].cast("ushort"),
+                   test.bandjoin(255).cast("uchar"), test.cast("uchar"),
+                   test.bandjoin(255).cast("ushort")]:
+            im90 = im.rot90()
+            assert im90.width == im.height
+            assert im90.height == im.width
+            assert im90(im.height - 1 - 10, 20) == im(20, 10)
+            assert (im90.rot90() - im.rot180()).abs().max() == 0
+            assert (im90.rot270() - im).abs().max() == 0
+
     def test_autorot(self):
         rotation_images = os.path.join(IMAGES, 'rotation')
         files = os.listdir(rotation_images)
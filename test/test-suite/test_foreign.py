@@ -4,6 +4,7 @@ import sys
 import os
 import shutil
 import tempfile
+import zipfile
 import pytest
 
 import pyvips
@@ -18,7 +19,7 @@ from helpers import \
     GIF_ANIM_DISPOSE_PREVIOUS_EXPECTED_PNG_FILE, \
     temp_filename, assert_almost_equal_objects, have, skip_if_no, \
     TIF1_FILE, TIF2_FILE, TIF4_FILE, WEBP_LOOKS_LIKE_SVG_FILE, \
-    WEBP_ANIMATED_FILE
+    WEBP_ANIMATED_FILE, RESTART_FILE
 
 class TestForeign:
     tempdir = None
@@ -207,6 +208,38 @@ class TestForeign:
             assert x1.width == x2.height
             assert x1.height == x2.width
 
+            # autorotate on load should match autorot after load, for all
+            # orientations
+            for orientation in range(2, 9):
+                x = pyvips.Image.new_from_file(JPEG_FILE, shrink=4)
+                x = x.copy()
+                x.set("orientation", orientation)
+                filename = temp_filename(self.tempdir, '.jpg')
+                x.write_to_file(filename)
+
+                x1 = pyvips.Image.new_from_file(filename).autorot()
+                x2 = pyvips.Image.new_from_file(filename, autorotate=True)
+                assert x1.width == x2.width
+                assert x1.height == x2.height
+                assert (x1 - x2).abs().max() == 0
+
+            # images with whole MCUs are rotated in the DCT domain and 
+            # decoded sequentially, so we only expect a close match
+            for orientation in [3, 6, 8]:
+                x = pyvips.Image.new_from_file(JPEG_FILE)
+                x = x.crop(0, 0, 256, 384).copy()
+                x.set("orientation", orientation)
+                filename = temp_filename(self.tempdir, '.jpg')
+                x.write_to_file(filename)
+
+                x1 = pyvips.Image.new_from_file(filename).autorot()
+                x2 = pyvips.Image.new_from_file(filename, autorotate=True,
+                                                access="sequential")
+                assert x1.width == x2.width
+                assert x1.height == x2.height
+                assert x2.get_typeof("orientation") == 0
+                assert (x1 - x2).abs().avg() < 1
+
             # sets incorrect orientation, save, load again, orientation
             # has reset to 1
             x = x.copy()
@@ -294,6 +327,19 @@ class TestForeign:
         assert len(q90_subsample_on) < len(q90) 
         assert len(q90_subsample_off) == len(q90_subsample_auto)
 
+        # restart markers don't change the pixels, even when bands are
+        # compressed in parallel
+        big = im.replicate(4, 4)
+        for interlace in [False, True]:
+            buf = big.jpegsave_buffer(interlace=interlace)
+            plain = pyvips.Image.new_from_buffer(buf, "")
+            for restart_interval in [1, 7, 73, 146]:
+                buf = big.jpegsave_buffer(restart_interval=restart_interval,
+                                          interlace=interlace)
+                assert buf.find(b"\xff\xdd") > 0
+                x = pyvips.Image.new_from_buffer(buf, "")
+                assert (x - plain).abs().max() == 0
+
     @skip_if_no("jpegload")
     def test_truncated(self):
         # This should open (there's enough there for the header)
@@ -307,6 +353,85 @@ class TestForeign:
         # and this should fail with a warning once more
         x = im.avg()
 
+    @skip_if_no("jpegload")
+    def test_jpeg_restart(self):
+        # files with restart markers are decoded in chunks in parallel ... a
+        # custom source can't be mapped, so that will decode in one pass
+        def load_serial(filename, **kwargs):
+            f = open(filename, 'rb')
+            source = pyvips.SourceCustom()
+            source.on_read(lambda length: f.read(length))
+            return pyvips.Image.new_from_source(source, "", **kwargs).copy_memory()
+
+        for shrink in [1, 2, 4, 8]:
+            im = pyvips.Image.new_from_file(RESTART_FILE, shrink=shrink)
+            serial = load_serial(RESTART_FILE, shrink=shrink)
+            assert im.width == serial.width
+            assert im.height == serial.height
+            assert (im - serial).abs().max() == 0
+
+            im = pyvips.Image.new_from_file(RESTART_FILE, shrink=shrink,
+                                            access="sequential")
+            assert (im - serial).abs().max() == 0
+
+    @skip_if_no("jpegtran_source")
+    def test_jpegtran(self):
+        def jpegtran(data, **kwargs):
+            source = pyvips.Source.new_from_memory(data)
+            target = pyvips.Target.new_to_memory()
+            pyvips.Operation.call("jpegtran_source", source, target,
+                                  **kwargs)
+            return target.get("blob")
+
+        def load(data):
+            return pyvips.Image.new_from_buffer(data, "")
+
+        with open(JPEG_FILE, 'rb') as f:
+            data = f.read()
+        im = load(data)
+
+        # a plain copy or an interlaced copy should be lossless
+        assert (load(jpegtran(data)) - im).abs().max() == 0
+        x = load(jpegtran(data, interlace=True))
+        assert (x - im).abs().max() == 0
+
+        # left and top round down to the 16x16 MCU grid ... only edge pixels
+        # can change, since chroma upsampling has no context there
+        x = load(jpegtran(data, left=37, top=21, width=100, height=100))
+        assert x.width == 105
+        assert x.height == 105
+        ref = im.crop(32, 16, 105, 105)
+        assert (x - ref).crop(2, 2, 101, 101).abs().max() == 0
+
+        with pytest.raises(pyvips.Error):
+            jpegtran(data, left=300)
+
+        # rotation trims partial MCUs from edges which move to the left or
+        # top, and rotating back again is lossless
+        inverse = {"d90": "d270", "d180": "d180", "d270": "d90"}
+        trimmed = {"d90": [290, 432], "d180": [288, 432], "d270": [288, 442]}
+        for angle in inverse:
+            width, height = trimmed[angle]
+            buf = jpegtran(data, angle=angle)
+            x = load(buf)
+            ref = im.crop(0, 0, width, height).rot(angle)
+            assert x.width == ref.width
+            assert x.height == ref.height
+            assert (x - ref).abs().avg() < 1
+
+            x = load(jpegtran(buf, angle=inverse[angle]))
+            ref = load(jpegtran(data, width=width, height=height))
+            assert (x - ref).abs().max() == 0
+
+        # mono images have an 8x8 MCU
+        data = im.colourspace("b-w").jpegsave_buffer()
+        buf = jpegtran(data, angle="d180")
+        assert load(buf).width == 288
+        assert load(buf).height == 440
+        x = load(jpegtran(buf, angle="d180"))
+        ref = load(jpegtran(data, width=288, height=440))
+        assert (x - ref).abs().max() == 0
+
     @skip_if_no("pngload")
     def test_png(self):
         def png_valid(im):
@@ -337,6 +462,40 @@ class TestForeign:
         len_mono1 = len(self.mono.write_to_buffer(".png", bitdepth=1))
         assert( len_mono1 < len_mono2 )
 
+        # large images are filtered and deflated in many blocks ... check
+        # every filter, and 8 and 16-bit, round trip exactly
+        big = self.colour.replicate(2, 2)
+        for filter in ["none", "sub", "up", "avg", "paeth", "all"]:
+            for compression in [0, 6, 9]:
+                buf = big.write_to_buffer(".png", filter=filter,
+                                          compression=compression)
+                im = pyvips.Image.new_from_buffer(buf, "")
+                assert (im - big).abs().max() == 0
+        big16 = ((big.cast("ushort") << 8) | big) \
+            .cast("ushort").copy(interpretation="rgb16")
+        buf = big16.write_to_buffer(".png")
+        im = pyvips.Image.new_from_buffer(buf, "")
+        assert im.format == "ushort"
+        assert (im - big16).abs().max() == 0
+
+        # interlaced save goes a different way ... check 16-bit, and that
+        # comments survive
+        im = big16.copy()
+        im.set_type(pyvips.GValue.gstr_type, "png-comment-0-vips", "hello")
+        buf = im.write_to_buffer(".png", interlace=True)
+        im = pyvips.Image.new_from_buffer(buf, "")
+        assert im.get("interlaced") == 1
+        assert im.get("png-comment-0-vips") == "hello"
+        assert (im - big16).abs().max() == 0
+
+        # profile= attaches the ICC from the file, and the data must still
+        # be there when the header is encoded
+        buf = self.colour.write_to_buffer(".png", profile=SRGB_FILE)
+        im = pyvips.Image.new_from_buffer(buf, "")
+        with open(SRGB_FILE, "rb") as f:
+            assert im.get("icc-profile-data") == f.read()
+        assert (im - self.colour).abs().max() == 0
+
         # we can't test palette save since we can't be sure libimagequant is
         # available and there's no easy test for its presence
 
@@ -410,6 +569,34 @@ class TestForeign:
         self.save_load_file(".tif", "[compression=jpeg]", self.colour, 80)
         self.save_load_file(".tif",
                             "[tile,tile-width=256]", self.colour, 10)
+        self.save_load_file(".tif",
+                            "[tile,compression=deflate]", self.colour, 0)
+        self.save_load_file(".tif",
+                            "[tile,compression=deflate,predictor=horizontal]",
+                            self.colour, 0)
+        self.save_load_file(".tif",
+                            "[tile,compression=deflate,predictor=horizontal]",
+                            (self.colour * 256).cast("ushort"), 0)
+        self.save_load_file(".tif",
+                            "[tile,compression=deflate,predictor=none]",
+                            self.mono.cast("float"), 0)
+        self.save_load_file(".tif",
+                            "[tile,pyramid,compression=deflate]",
+                            self.colour, 0)
+        self.save_load_file(".tif",
+                            "[tile,tile-width=48,tile-height=32,"
+                            "compression=deflate]",
+                            self.mono, 0)
+
+        # pyramid layers are built in memory and appended with a raw copy
+        for compression in ["jpeg", "deflate", "lzw"]:
+            filename = temp_filename(self.tempdir, '.tif')
+            self.colour.tiffsave(filename, tile=True, pyramid=True,
+                                 compression=compression)
+            x = pyvips.Image.new_from_file(filename, page=1)
+            assert x.width == self.colour.width // 2
+            assert x.height == self.colour.height // 2
+            assert abs(x.avg() - self.colour.avg()) < 2
 
         im = pyvips.Image.new_from_file(TIF2_FILE)
         self.save_load_file(".tif", "[bitdepth=2]", im, 0)
@@ -1002,6 +1189,40 @@ class TestForeign:
         assert os.path.exists(filename2)
         assert os.path.getsize(filename2) < os.path.getsize(filename)
 
+        # both zips should be valid and have the full path to every tile
+        root = os.path.splitext(os.path.basename(filename2))[0]
+        for name in [filename, filename2]:
+            with zipfile.ZipFile(name) as zf:
+                assert zf.testzip() is None
+        with zipfile.ZipFile(filename2) as zf:
+            names = zf.namelist()
+            assert root + "/" + root + ".dzi" in names
+            assert root + "/" + root + "_files/0/0_0.jpeg" in names
+            x = pyvips.Image.new_from_buffer(
+                zf.read(root + "/" + root + "_files/0/0_0.jpeg"), "")
+            assert x.width == 1
+
+        # test dedupe ... identical tiles should be written once and
+        # reused, but look the same to readers
+        im = (pyvips.Image.black(1024, 1024, bands=3) + 128).cast("uchar")
+        im = im.draw_rect([255, 0, 0], 300, 300, 100, 100, fill=True)
+        filename = temp_filename(self.tempdir, '')
+        im.dzsave(filename, layout="google", skip_blanks=-1, dedupe=True)
+        a = filename + "/2/0/0.jpg"
+        b = filename + "/2/3/3.jpg"
+        assert filecmp.cmp(a, b, shallow=False)
+        if hasattr(os, "link"):
+            assert os.path.samefile(a, b)
+        assert not filecmp.cmp(a, filename + "/2/1/1.jpg", shallow=False)
+
+        filename = temp_filename(self.tempdir, '.zip')
+        im.dzsave(filename, layout="google", skip_blanks=-1, dedupe=True)
+        root = os.path.splitext(os.path.basename(filename))[0]
+        with zipfile.ZipFile(filename) as zf:
+            assert zf.testzip() is None
+            assert zf.read(root + "/2/0/0.jpg") == \
+                zf.read(root + "/2/3/3.jpg")
+
         # test suffix
         filename = temp_filename(self.tempdir, '')
         self.colour.dzsave(filename, suffix=".png")
@@ -1,10 +1,19 @@
 # vim: set fileencoding=utf-8 :
+import math
 import pytest
 
 import pyvips
 from helpers import JPEG_FILE, OME_FILE, HEIC_FILE, TIF_FILE, all_formats, have
 
 
+# Peak signal to noise ratio of b against a, both uchar
+def psnr(a, b):
+    mse = ((a - b) ** 2).avg()
+    if mse == 0:
+        return float("inf")
+    return 10 * math.log10(255 * 255 / mse)
+
+
 # Run a function expecting a complex image on a two-band image
 def run_cmplx(fn, image):
     if image.format == pyvips.BandFormat.FLOAT:
@@ -114,6 +123,22 @@ class TestResample:
         assert x.width == 50
         assert x.height == 1
 
+    def test_resize_gap(self):
+        im = pyvips.Image.new_from_file(JPEG_FILE)
+
+        # gap 0 is pure lanczos3 ... measure the error of the fast modes 
+        # against that
+        ref = im.resize(0.25, gap=0)
+        for gap in [1.0, 2.0]:
+            im2 = im.resize(0.25, gap=gap)
+            assert im2.width == ref.width
+            assert im2.height == ref.height
+            assert psnr(ref, im2) > 25
+
+        # a gap of less than 1 would overshoot
+        with pytest.raises(Exception):
+            im.resize(0.25, gap=0.5)
+
     def test_shrink(self):
         im = pyvips.Image.new_from_file(JPEG_FILE)
         im2 = im.shrink(4, 4)
@@ -193,6 +218,31 @@ class TestResample:
         im2 = pyvips.Image.thumbnail_buffer(buf, 100)
         assert abs(im1.avg() - im2.avg()) < 1
 
+        # with fast, tiny outputs take a fused box filter path ... check 
+        # the size matches the lanczos3 path, and check alpha handling
+        im_orig = pyvips.Image.new_from_file(JPEG_FILE)
+        for height in [64, 33, 7]:
+            im = pyvips.Image.thumbnail(JPEG_FILE, height, fast=True)
+            slow = pyvips.Image.thumbnail(JPEG_FILE, height)
+            assert im.height == height
+            assert im.width == slow.width
+            assert im.format == pyvips.BandFormat.UCHAR
+            assert abs(im_orig.avg() - im.avg()) < 1
+
+        im = im_orig.bandjoin(255)
+        im = im.draw_rect(0, 0, 0, im.width, im.height // 2, fill=True)
+        buf = im.write_to_buffer(".png")
+        thumb = pyvips.Image.thumbnail_buffer(buf, 64, fast=True)
+        assert thumb.bands == 4
+        assert thumb.height == 64
+        # the transparent half should stay black and transparent, the 
+        # opaque half should not pick up any black
+        assert thumb.crop(0, 0, thumb.width, 20).max() == 0
+        bottom = thumb.crop(0, 44, thumb.width, 20)
+        assert bottom[3].min() == 255
+        assert abs(bottom.avg() -
+                   im.crop(0, im.height - 150, im.width, 150).avg()) < 10
+
         if have("heifload"):
             # this image is orientation 6 ... thumbnail should flip it
             im = pyvips.Image.new_from_file(HEIC_FILE)
@@ -244,6 +294,18 @@ class TestResample:
         interp = pyvips.Interpolate.new('bicubic')
         assert im.mapim(mp, interpolate=interp).avg() == im.avg()
 
+        # output tiles which need two distant parts of the input are
+        # split ... check we get the right pixels back
+        im = pyvips.Image.xyz(2000, 64)
+        xy = pyvips.Image.xyz(128, 64)
+        x = (xy[0] >= 64).ifthenelse(xy[0] + 1800, xy[0])
+        index = x.bandjoin(xy[1])
+        interp = pyvips.Interpolate.new('nearest')
+        a = im.mapim(index, interpolate=interp)
+        b = im.crop(0, 0, 64, 64).join(im.crop(1864, 0, 64, 64),
+                                       "horizontal")
+        assert (a - b).abs().max() == 0
+
 
 if __name__ == '__main__':
     pytest.main()
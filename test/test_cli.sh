@@ -116,3 +116,15 @@ test_size $tmp/t1.jpg 66 100
 cat $image | $vipsthumbnail stdin -s 100 -o .jpg | cat > $tmp/t1.jpg
 echo ok
 test_size $tmp/t1.jpg 66 100
+
+# test batch thumbnailing
+echo -n "testing thumbnail --jobs ... "
+cp $image $tmp/b1.jpg
+cp $image $tmp/b2.jpg
+cp $image $tmp/b3.jpg
+$vipsthumbnail $tmp/b1.jpg $tmp/b2.jpg $tmp/b3.jpg -s 100 -j 2 \
+	-o $tmp/tn_%s.jpg
+test_size $tmp/tn_b1.jpg 66 100
+test_size $tmp/tn_b2.jpg 66 100
+test_size $tmp/tn_b3.jpg 66 100
+echo ok
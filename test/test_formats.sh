@@ -183,6 +183,22 @@ if test_supported tiffload; then
 	test_format $cmyk tif 90 [compression=jpeg,tile,pyramid]
 fi
 
+# with a tiny disc threshold, the smaller pyramid layers go to temp files 
+# before being gathered ... they should match the in-memory path exactly
+if test_supported tiffload; then
+	printf "testing pyramid tif with temp file layers ... "
+
+	VIPS_DISC_THRESHOLD=1k $vips copy $image $tmp/t1.tif[tile,pyramid]
+	$vips copy $image $tmp/t2.tif[tile,pyramid]
+	for page in 0 1 2; do
+		$vips copy $tmp/t1.tif[page=$page] $tmp/back.v
+		$vips copy $tmp/t2.tif[page=$page] $tmp/back2.v
+		test_difference $tmp/back.v $tmp/back2.v 0
+	done
+
+	echo "ok"
+fi
+
 test_rad $rad 
 
 test_raw $mono 
@@ -52,3 +52,18 @@ if ! $vipsheader $tmp/x.png > /dev/null 2>&1 ; then
 	exit 1
 fi
 echo "ok"
+
+printf "testing sequential lookahead ... "
+$vips copy $huge $tmp/x.v
+for cpus in 1 4 16; do
+	$vips --vips-concurrency=$cpus sequential $huge[access=sequential] \
+		$tmp/y.v --tile-height 16 --lookahead 8
+	$vips subtract $tmp/x.v $tmp/y.v $tmp/z.v
+	$vips abs $tmp/z.v $tmp/z2.v
+	max=$($vips max $tmp/z2.v)
+	if [ $(echo "$max > 0" | bc) -eq 1 ]; then
+		echo "sequential lookahead failed with $cpus threads"
+		exit 1
+	fi
+done
+echo "ok"
@@ -32,6 +32,23 @@ for tile in 10 64 128 512; do
 	fi
 done
 
+# a threaded tilecache with small tiles and a small cache, so many threads 
+# contend for the same tiles
+if [ $(echo "$max == 0" | bc) -eq 1 ]; then
+	for cpus in 1 2 4 8 16 99; do
+		echo trying threaded tilecache, cpus = $cpus ...
+		$vips --vips-concurrency=$cpus tilecache $image $tmp/t10.v \
+			--tile-width 16 --tile-height 16 --max-tiles 32 \
+			--threaded 
+		$vips subtract $image $tmp/t10.v $tmp/t8.v
+		$vips abs $tmp/t8.v $tmp/t9.v
+		max=$($vips max $tmp/t9.v)
+		if [ $(echo "$max > 0" | bc) -eq 1 ]; then
+			break
+		fi
+	done
+fi
+
 if [ $(echo "$max > 0" | bc) -eq 1 ]; then
 	echo error, max == $max
 	exit 1
@@ -105,6 +105,9 @@
  * 2/10/20
  * 	- support "stdin" as a magic input filename for thumbnail_source
  * 	- support ".suffix" as a magic ouput format for stdout write
+ * 18/10/26
+ * 	- add --jobs to thumbnail several files at once
+ * 	- --jobs runs serially for stdin input or stdout output
  */
 
 #ifdef HAVE_CONFIG_H
@@ -138,6 +141,7 @@ static gboolean crop_image = FALSE;
 static gboolean no_rotate_image = FALSE;
 static char *smartcrop_image = NULL;
 static char *thumbnail_intent = NULL;
+static int thumbnail_jobs = 1;
 
 /* Deprecated and unused.
  */
@@ -183,6 +187,10 @@ static GOptionEntry options[] = {
 	{ "no-rotate", 0, 0, 
 		G_OPTION_ARG_NONE, &no_rotate_image, 
 		N_( "don't auto-rotate" ), NULL },
+	{ "jobs", 'j', 0, 
+		G_OPTION_ARG_INT, &thumbnail_jobs, 
+		N_( "thumbnail N files at once" ), 
+		N_( "N" ) },
 
 	{ "format", 'f', G_OPTION_FLAG_HIDDEN, 
 		G_OPTION_ARG_STRING, &output_format, 
@@ -479,6 +487,168 @@ thumbnail_parse_geometry( const char *geometry )
 	return( 0 );
 }
 
+/* Set for batch runs: the error buffer is shared, so we don't want workers 
+ * interleaving their messages.
+ */
+static GMutex *thumbnail_report_lock = NULL;
+
+/* Print a message, plus the error text captured for it. 
+ */
+static void
+thumbnail_report( const char *message, const char *error )
+{
+	if( thumbnail_report_lock )
+		g_mutex_lock( thumbnail_report_lock );
+	fprintf( stderr, "%s", message );
+	fprintf( stderr, "%s", error );
+	if( thumbnail_report_lock )
+		g_mutex_unlock( thumbnail_report_lock );
+}
+
+/* Thumbnail argv[i] and report any errors. Hang resources for processing 
+ * this thumbnail off @process.
+ */
+static int
+thumbnail_process_report( char **argv, int i )
+{
+	VipsObject *process = VIPS_OBJECT( vips_image_new() ); 
+	int result;
+
+	result = 0;
+	if( thumbnail_process( process, argv[i] ) ) {
+		char *error;
+		char *message;
+
+		/* Take the text and clear the buffer in one step, so we 
+		 * can't wipe an error another worker has just logged and not
+		 * yet reported.
+		 */
+		error = vips_error_buffer_copy();
+		message = g_strdup_printf( "%s: unable to thumbnail %s\n", 
+			argv[0], argv[i] );
+		thumbnail_report( message, error );
+		g_free( message );
+		g_free( error );
+
+		/* We had a conversion failure: return an error code
+		 * when we finally exit.
+		 */
+		result = -1;
+	}
+
+	g_object_unref( process );
+
+	return( result );
+}
+
+/* State shared between the workers of a batch run.
+ */
+typedef struct _ThumbnailBatch {
+	char **argv;
+	int n_files;
+
+	/* The index of the next argv[] to process, and the number of 
+	 * failures so far. Both updated atomically.
+	 */
+	int next;
+	int n_failed;
+} ThumbnailBatch;
+
+static void *
+thumbnail_batch_worker( void *a )
+{
+	ThumbnailBatch *batch = (ThumbnailBatch *) a;
+
+	int i;
+
+	while( (i = g_atomic_int_add( &batch->next, 1 )) <= batch->n_files )
+		if( thumbnail_process_report( batch->argv, i ) )
+			g_atomic_int_inc( &batch->n_failed );
+
+	return( NULL );
+}
+
+/* Process all the files in argv with a pool of thumbnail_jobs workers, each
+ * pulling the next filename as it finishes the previous one. 
+ *
+ * Per-image parallelism is poor for small images (most of the time goes on
+ * open, header parse and pipeline setup), so we split the vips worker
+ * threads between the jobs. Memory use is bounded by the number of images 
+ * in flight at once. 
+ */
+static int
+thumbnail_batch( char **argv )
+{
+	ThumbnailBatch batch;
+	GThread **threads;
+	int n_jobs;
+	int n_files;
+	int i;
+
+	for( n_files = 0; argv[n_files + 1]; n_files++ )
+		;
+	n_jobs = VIPS_MIN( thumbnail_jobs, n_files );
+
+	vips_concurrency_set( 
+		VIPS_MAX( 1, vips_concurrency_get() / n_jobs ) );
+
+	batch.argv = argv;
+	batch.n_files = n_files;
+	batch.next = 1;
+	batch.n_failed = 0;
+
+	thumbnail_report_lock = vips_g_mutex_new();
+
+	threads = VIPS_ARRAY( NULL, n_jobs, GThread * );
+	for( i = 0; i < n_jobs; i++ ) 
+		if( !(threads[i] = vips_g_thread_new( "thumbnail", 
+			thumbnail_batch_worker, &batch )) ) {
+			char *error;
+
+			/* We can carry on with fewer workers.
+			 */
+			error = vips_error_buffer_copy();
+			thumbnail_report( "", error );
+			g_free( error );
+		}
+
+	/* If we couldn't start any workers, do it ourselves.
+	 */
+	for( i = 0; i < n_jobs; i++ )
+		if( threads[i] )
+			break;
+	if( i == n_jobs ) 
+		thumbnail_batch_worker( &batch );
+
+	for( i = 0; i < n_jobs; i++ )
+		if( threads[i] )
+			vips_g_thread_join( threads[i] );
+
+	g_free( threads );
+	VIPS_FREEF( vips_g_mutex_free, thumbnail_report_lock );
+
+	return( batch.n_failed > 0 ? -1 : 0 );
+}
+
+/* Jobs can't share stdin or stdout, so we can only run several at once 
+ * if no input is "stdin" and we are not writing to stdout.
+ */
+static gboolean
+thumbnail_batch_ok( char **argv )
+{
+	int i;
+
+	if( vips_isprefix( ".", output_format ) &&
+		!vips_isprefix( "./", output_format ) ) 
+		return( FALSE );
+
+	for( i = 1; argv[i]; i++ )
+		if( strcmp( argv[i], "stdin" ) == 0 )
+			return( FALSE );
+
+	return( TRUE );
+}
+
 int
 main( int argc, char **argv )
 {
@@ -541,25 +711,15 @@ main( int argc, char **argv )
 
 	result = 0;
 
-	for( i = 1; argv[i]; i++ ) {
-		/* Hang resources for processing this thumbnail off @process.
-		 */
-		VipsObject *process = VIPS_OBJECT( vips_image_new() ); 
-
-		if( thumbnail_process( process, argv[i] ) ) {
-			fprintf( stderr, "%s: unable to thumbnail %s\n", 
-				argv[0], argv[i] );
-			fprintf( stderr, "%s", vips_error_buffer() );
-			vips_error_clear();
-
-			/* We had a conversion failure: return an error code
-			 * when we finally exit.
-			 */
-			result = -1;
-		}
-
-		g_object_unref( process );
-	}
+	if( thumbnail_jobs > 1 &&
+		argv[1] && 
+		argv[2] &&
+		thumbnail_batch_ok( argv ) ) 
+		result = thumbnail_batch( argv );
+	else 
+		for( i = 1; argv[i]; i++ ) 
+			if( thumbnail_process_report( argv, i ) )
+				result = -1;
 
 	/* We don't free this on error exit, sadly.
 	 */